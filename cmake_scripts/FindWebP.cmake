@@ -0,0 +1,40 @@
+# FindWebP.cmake
+# Locate the libwebp encoder
+# This module defines
+#  WebP_FOUND, if false, do not try to use libwebp.
+#  WebP_INCLUDE_DIRS, where to find webp/encode.h, etc.
+#  WebP_LIBRARIES, the libraries to link against.
+
+if (WebP_INCLUDE_DIRS AND WebP_LIBRARIES)
+  # Already in cache, be silent
+  set(WebP_FOUND TRUE)
+else ()
+  find_path(WebP_INCLUDE_DIR
+    NAMES webp/encode.h
+    PATHS
+      ${CMAKE_INSTALL_PREFIX}/include
+      /usr/local/include
+      /usr/include
+  )
+
+  find_library(WebP_LIBRARY
+    NAMES webp
+    PATHS
+      ${CMAKE_INSTALL_PREFIX}/lib
+      /usr/local/lib
+      /usr/lib
+  )
+
+  include(FindPackageHandleStandardArgs)
+  find_package_handle_standard_args(WebP DEFAULT_MSG
+    WebP_INCLUDE_DIR
+    WebP_LIBRARY
+  )
+
+  if (WebP_FOUND)
+    set(WebP_INCLUDE_DIRS ${WebP_INCLUDE_DIR})
+    set(WebP_LIBRARIES ${WebP_LIBRARY})
+  endif ()
+endif ()
+
+mark_as_advanced(WebP_INCLUDE_DIR WebP_LIBRARY)
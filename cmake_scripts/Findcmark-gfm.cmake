@@ -27,16 +27,26 @@ else ()
       /usr/lib
   )
 
+  # The GFM extensions (tables, strikethrough...) are in a separate library
+  find_library(cmark-gfm-extensions_LIBRARY
+    NAMES cmark-gfm-extensions
+    PATHS
+      ${CMAKE_INSTALL_PREFIX}/lib
+      /usr/local/lib
+      /usr/lib
+  )
+
   include(FindPackageHandleStandardArgs)
   find_package_handle_standard_args(cmark-gfm DEFAULT_MSG
     cmark-gfm_INCLUDE_DIR
     cmark-gfm_LIBRARY
+    cmark-gfm-extensions_LIBRARY
   )
 
   if (cmark-gfm_FOUND)
     set(cmark-gfm_INCLUDE_DIRS ${cmark-gfm_INCLUDE_DIR})
-    set(cmark-gfm_LIBRARIES ${cmark-gfm_LIBRARY})
+    set(cmark-gfm_LIBRARIES ${cmark-gfm-extensions_LIBRARY} ${cmark-gfm_LIBRARY})
   endif ()
 endif ()
 
-mark_as_advanced(cmark-gfm_INCLUDE_DIR cmark-gfm_LIBRARY)
+mark_as_advanced(cmark-gfm_INCLUDE_DIR cmark-gfm_LIBRARY cmark-gfm-extensions_LIBRARY)
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <ctime>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/property_tree/ptree.hpp>
+
+#include "stbl/Image.h"
+#include "stbl/resample.h"
+
+namespace stbl {
+
+/*! Typed snapshot of stbl.conf
+ *
+ * Compiled once at startup by CompileConfig(), so that the
+ * render paths don't have to look up the property tree.
+ */
+struct Config
+{
+    struct MenuItem {
+        std::string name;
+        std::string url;
+        std::vector<MenuItem> children;
+    };
+
+    struct SocialHandle {
+        std::string handle;
+        std::string name;
+        std::string url;
+        std::string icon; // Empty: use the default icon
+    };
+
+    struct Person {
+        std::string name;
+        std::string email;
+        std::vector<SocialHandle> handles;
+    };
+
+    struct CommentProvider {
+        std::string tmplte;
+        // Template variables, like {"disqus-src", "https://..."}
+        std::vector<std::pair<std::string, std::string>> vars;
+    };
+
+    std::string name = "Anonymous Nest";
+    std::string abstract;
+    std::string url;
+    std::string language = "en";
+    int max_articles_on_frontpage = 16;
+
+    struct {
+        std::vector<int> widths = {94, 248, 480, 640, 720, 950};
+        int quality = 95;
+        // Also used for the images in the articles
+        JpegSettings jpeg;
+        // Search for the quality of each image, up to the configured quality
+        QualityTarget target;
+        int align = 0;
+        ResampleFilter filter = ResampleFilter::Area;
+        // Extra formats to make next to the JPEG images, preferred first
+        std::vector<ImageFormat> formats;
+        int webp_quality = 80;
+        int avif_quality = 60;
+        // Show a tiny, blurry copy of the image while it loads
+        bool placeholders = true;
+    } banner;
+
+    // What to do with the jpg files in the images directory, when they are published
+    enum class Originals {
+        // As they are, unless the metadata is stripped
+        Copy,
+        // Recompressed without changing the pixels
+        Lossless,
+        // Encoded again at banner.quality, if that makes them smaller
+        Reencode
+    };
+
+    // Images in the articles
+    struct {
+        // Scaled variants to make. Empty to use the images as they are.
+        std::vector<int> widths = {320, 640, 960, 1280, 1920};
+        // The sizes attribute of the <img> elements
+        std::string sizes = "100vw";
+        // The first images on a page are loaded right away. The rest are
+        // loaded when they are about to be scrolled into view.
+        int eager = 1;
+        // Show a tiny, blurry copy of the image while it loads
+        bool placeholders = true;
+
+        Originals originals = Originals::Copy;
+        // Don't publish the EXIF (with the GPS position), XMP and comments
+        // of the originals. The orientation, and an ICC profile that is
+        // not sRGB, are kept. The originals are then at least recompressed
+        // losslessly. Off by default, as it changes the published originals.
+        bool strip_metadata = false;
+    } images;
+
+    std::vector<MenuItem> menu;
+
+    std::map<std::string, Person> people;
+    std::string default_author;
+
+    struct {
+        std::string format = "%c";
+        time_t roundup = 1800;
+    } date;
+
+    std::string publish_command;
+
+    struct {
+        bool enabled = true;
+        int max_articles = 64;
+        unsigned ttl = 1800;
+    } rss;
+
+    std::string google_site_verification;
+    // Sitemap priority (0 - 100) for "frontpage", "article", "series" and "tag"
+    std::map<std::string, float> sitemap_priority;
+
+    std::map<std::string, CommentProvider> comments;
+    std::string default_comments;
+
+    struct {
+        std::string enabled; // true, false or auto. Empty if not set.
+        std::string path = "chroma";
+        std::string style = "friendly";
+    } chroma;
+};
+
+/*! Compile the properties from stbl.conf
+ *
+ * Throws std::runtime_error for unknown keys and values of the wrong type.
+ */
+Config CompileConfig(const boost::property_tree::ptree& tree);
+
+}
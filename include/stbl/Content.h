@@ -21,7 +21,7 @@ public:
     virtual void UpdateSourceHeaders(Scanner& scanner,
                                      const Node::Metadata& meta) = 0;
 
-    static content_t Create(const std::filesystem::path& path);
+    static content_t Create(const source_t& source);
 };
 
 }
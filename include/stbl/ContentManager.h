@@ -1,7 +1,9 @@
 #pragma once
 
+#include <functional>
 #include <memory>
-#include <regex>
+#include <string>
+#include <string_view>
 
 #include "stbl/Node.h"
 #include "stbl/Article.h"
@@ -15,29 +17,70 @@
 namespace stbl {
 
 struct RenderCtx {
+    RenderCtx() = default;
+    explicit RenderCtx(size_t urlRecurseLevel) {
+        SetUrlRecurseLevel(urlRecurseLevel);
+    }
+
     // The node we are about to render
     node_t current;
-    size_t url_recuse_level = 0; // Relative to the sites root
-
-    std::string GetRelativeUrl(const std::string url) const {
-        static const std::regex url_pattern(R"(^https?:\/\/.*)");
 
-        if (regex_match(url, url_pattern)) {
-            return url;
+    // Returns the html for a block of source code, or an empty string.
+    using code_highlighter_t = std::function<std::string (const std::string& code,
+                                                          const std::string& language)>;
+
+    // Set if fenced code blocks should be syntax highlighted
+    code_highlighter_t highlight_code;
+
+    // Returns the html for an image in "images/", or an empty string to
+    // use a plain <img>. index counts the images on the page, from 0.
+    using image_renderer_t = std::function<std::string (std::string_view url,
+                                                        std::string_view alt,
+                                                        std::string_view title,
+                                                        size_t index)>;
+
+    // Set if images should get scaled variants
+    image_renderer_t render_image;
+
+    // Relative to the sites root
+    void SetUrlRecurseLevel(size_t level) {
+        url_recuse_level_ = level;
+        relative_prefix_.clear();
+        relative_prefix_.reserve(level * 3);
+        for(size_t i = 0; i < level; ++i) {
+            relative_prefix_ += "../";
         }
+    }
+
+    size_t GetUrlRecurseLevel() const noexcept {
+        return url_recuse_level_;
+    }
 
-        std::stringstream out;
-        out << getRelativePrefix() << url;
-        return out.str();
+    static bool IsAbsoluteUrl(std::string_view url) noexcept {
+        return url.substr(0, 7) == "http://" || url.substr(0, 8) == "https://";
     }
 
-    std::string getRelativePrefix() const {
-        std::stringstream out;
-        for(size_t level = 0; level < url_recuse_level; ++level) {
-            out << "../";
+    std::string GetRelativeUrl(std::string_view url) const {
+        std::string out;
+        AppendRelativeUrl(out, url);
+        return out;
+    }
+
+    // Append the resolved url to out
+    void AppendRelativeUrl(std::string& out, std::string_view url) const {
+        if (!IsAbsoluteUrl(url)) {
+            out += relative_prefix_;
         }
-        return out.str();
+        out += url;
     }
+
+    const std::string& getRelativePrefix() const noexcept {
+        return relative_prefix_;
+    }
+
+private:
+    size_t url_recuse_level_ = 0;
+    std::string relative_prefix_;
 };
 
 class ContentManager
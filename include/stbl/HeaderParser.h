@@ -1,6 +1,6 @@
 #pragma once
 
-#include <string>
+#include <string_view>
 
 #include "stbl/Article.h"
 
@@ -9,12 +9,15 @@ namespace stbl {
 class HeaderParser
 {
 public:
-    using header_map_t = std::map<std::string, std::string>;
-
     HeaderParser() = default;
     virtual ~HeaderParser() = default;
 
-    virtual void Parse(Article::Header& header, std::string& headerSection) = 0;
+    /*! Parse the header-section of an article
+     *
+     * Lines are "key: value". Blank lines and lines starting with '#'
+     * are ignored. Unknown keys are ignored.
+     */
+    virtual void Parse(Article::Header& header, std::string_view headerSection) = 0;
 
     static std::unique_ptr<HeaderParser> Create();
 };
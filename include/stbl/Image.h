@@ -1,8 +1,80 @@
+#pragma once
+
+#include <cstdint>
 #include <memory>
 #include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "stbl/resample.h"
 
 namespace stbl {
 
+enum class ImageFormat {
+    Jpeg,
+    Webp,
+    Avif
+};
+
+//! Parse "jpeg", "webp" or "avif". Returns false for other names.
+bool ToImageFormat(std::string_view name, ImageFormat& format) noexcept;
+
+//! Like "image/webp"
+std::string_view GetMimeType(ImageFormat format) noexcept;
+
+//! Like ".webp"
+std::string_view GetExtension(ImageFormat format) noexcept;
+
+//! A 0xRRGGBB color as "#rrggbb"
+std::string ToHexColor(std::uint32_t color);
+
+// The resolution of the color, relative to the brightness
+enum class ChromaSubsampling {
+    // Half, both ways. The smallest files.
+    Yuv420,
+    // Half, horizontally
+    Yuv422,
+    // Full. For sharp colored edges, like in screenshots.
+    Yuv444
+};
+
+//! Parse "4:2:0", "4:2:2" or "4:4:4". Returns false for other names.
+bool ToChromaSubsampling(std::string_view name, ChromaSubsampling& subsampling) noexcept;
+
+//! How JPEG images are encoded, other than the quality
+struct JpegSettings {
+    // Progressive scans. A little smaller, and the browser can show a
+    // coarse image before all of it has arrived.
+    bool progressive = true;
+    // Huffman tables made for each image, instead of the standard tables
+    bool optimize_coding = true;
+    ChromaSubsampling subsampling = ChromaSubsampling::Yuv420;
+    // When an original is recompressed: only copy its orientation and
+    // its ICC profile, unless that is sRGB. Not its EXIF, XMP and comments.
+    // The scaled images are always made like that, but upright.
+    bool strip_metadata = false;
+};
+
+/*! How to pick the encoder quality for an image
+ *
+ * The quality is found by a binary search, where each step encodes the
+ * image and decodes it again.
+ */
+struct QualityTarget {
+    // The lowest quality that gives at least this SSIM (see Ssim()). 0: off
+    double ssim = 0;
+    // The highest quality that gives at most this many bytes per pixel. 0: off
+    double max_bytes_per_pixel = 0;
+    // The range to search. If both targets are met at min_quality, that is used.
+    int min_quality = 40;
+    int max_quality = 95;
+
+    bool IsEnabled() const noexcept {
+        return ssim > 0 || max_bytes_per_pixel > 0;
+    }
+};
+
 class Image {
 public:
     struct Size {
@@ -10,15 +82,117 @@ public:
         int height = 0;
     };
 
+    struct Output {
+        ImageFormat format = ImageFormat::Jpeg;
+        std::filesystem::path path;
+        // 0: Search for it with target
+        int quality = 95;
+        QualityTarget target;
+        // Only used for JPEG
+        JpegSettings jpeg;
+    };
+
+    //! One size, saved in one or more formats
+    struct Variant {
+        Size size;
+        std::vector<Output> outputs;
+    };
+
     Image() = default;
     virtual ~Image() = default;
-    virtual Size ScaleAndSave(const std::filesystem::path& path,
-                              int width,
-                              int quality = 95) = 0;
+
+    //! The size of the image scaled to width, keeping the aspect ratio
+    virtual Size GetScaledSize(int width) const = 0;
+
+    //! Return a scaled copy of the image, in memory
+    virtual std::unique_ptr<Image> Scale(const Size& size,
+                                         ResampleFilter filter = ResampleFilter::Area) const = 0;
+
+    //! Encode the image as JPEG, in memory
+    virtual std::string ToJpeg(int quality = 95) const = 0;
+
+    //! The most common color, as 0xRRGGBB
+    virtual std::uint32_t GetDominantColor() const = 0;
+
+    // Size of the original image
     virtual int GetWidth() const = 0;
     virtual int GetHeight() const = 0;
 
-    static std::unique_ptr<Image> Create(const std::filesystem::path& path);
+    //! The size of an image of size original, scaled to width
+    static Size ScaledSize(const Size& original, int width);
+
+    /*! Make scaled variants of a JPEG image, in one pass
+     *
+     * The source is decoded one scanline at the time, and the rows are
+     * streamed through the resamplers straight into the JPEG encoders.
+     * Memory use depends on the width of the images, not on their size.
+     * A variant is fed from a larger variant when that is at least twice
+     * as wide, else from the source.
+     *
+     * The source is decoded once, at the smallest scale (N/8) that is
+     * still as wide as the largest variant. For the default widths, a set
+     * then costs 1.2 to 1.9 times its largest variant alone, mostly for
+     * encoding the smaller variants.
+     *
+     * The WebP and AVIF encoders need the whole image, so variants with
+     * those outputs are kept in memory until they are encoded. So are the
+     * variants with an output of quality 0. Their quality is found by a
+     * search on the scaled pixels (see QualityTarget), and set in variants.
+     *
+     * An image with EXIF orientation 3 to 8 (upside down, flipped or
+     * sideways) is the exception to the bound above: its rows are decoded
+     * in another order than the variants need them, so the whole source is
+     * decoded into memory first, 3 bytes per pixel, at the reduced scale
+     * (1/1 to 1/8) the decoder uses for the largest variant. Orientations
+     * 1 and 2 are streamed.
+     *
+     * The variants are upright, and have no metadata. The JPEG images get
+     * the ICC profile of the source, if it is an RGB profile but not sRGB.
+     */
+    static void MakeVariants(const std::filesystem::path& path,
+                             std::vector<Variant>& variants,
+                             ResampleFilter filter = ResampleFilter::Area);
+
+    /*! Recompress a JPEG image into dst
+     *
+     * With quality 0 the image is not decoded: the DCT coefficients are
+     * copied as they are, and only the coding (progressive scans, Huffman
+     * tables) is redone. That is lossless. Else the image is encoded
+     * again at quality, unless that does not make it smaller; then it is
+     * recompressed losslessly. If nothing helps, dst is a copy of path.
+     *
+     * The subsampling is only changed when the image is encoded again.
+     * Encoded images are upright. Without jpeg.strip_metadata, the EXIF
+     * orientation is then set to 1. If the metadata is stripped, dst is
+     * never a copy of path. Encoding again an image with EXIF orientation 3
+     * to 8 decodes all of it into memory, as in MakeVariants().
+     *
+     * \return The size of dst
+     */
+    static std::uintmax_t Recompress(const std::filesystem::path& path,
+                                     const std::filesystem::path& dst,
+                                     int quality,
+                                     const JpegSettings& jpeg = {});
+
+    //! True if stbl was built with an encoder for the format
+    static bool CanEncode(ImageFormat format) noexcept;
+
+    /*! Get the size of a JPEG, PNG or WebP image from its header
+     *
+     * Only the first few bytes of the file are read (for JPEG, up to the
+     * SOF marker). Nothing is decoded. For JPEG, the size is that of the
+     * image with the EXIF orientation applied.
+     */
+    static Size Probe(const std::filesystem::path& path);
+
+    /*! Load a JPEG image, with the EXIF orientation applied
+     *
+     * \param minWidth If set, the image may be decoded at 1/8 to 7/8 of
+     *      its size, as long as it is at least minWidth pixels wide.
+     *      It can then only be scaled to minWidth or less.
+     */
+    static std::unique_ptr<Image> Create(const std::filesystem::path& path,
+                                         int minWidth = 0);
 };
 
 }
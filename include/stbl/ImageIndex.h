@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "stbl/Image.h"
+
+namespace stbl {
+
+/*! Persistent index of the banner images and their variants
+ *
+ * Remembers what we learned about each source image, so that the next
+ * run can render the html without opening the images. An entry is used
+ * as long as the source file has the same size and modification time,
+ * or, if the time changed, the same content hash.
+ *
+ * The index is a property-tree (info) file. A missing or unreadable
+ * file just gives an empty index.
+ */
+class ImageIndex {
+public:
+    struct Variant {
+        ImageFormat format = ImageFormat::Jpeg;
+        // Relative path from the sites root
+        std::string relative_path;
+        Image::Size size;
+        std::uintmax_t bytes = 0;
+        // The encoder quality, 0 if unknown
+        int quality = 0;
+    };
+
+    struct Entry {
+        // Of the source image. Filled in by Update()
+        std::uint64_t hash = 0;
+        std::uintmax_t bytes = 0;
+        std::int64_t mtime = 0;
+
+        Image::Size size;
+        // 0xRRGGBB
+        std::uint32_t dominant_color = 0;
+        // data: URI of a tiny copy of the image, or empty
+        std::string placeholder;
+        // The settings the variants were made with. An entry made with
+        // other settings is not used.
+        std::string settings;
+        std::vector<Variant> variants;
+    };
+
+    ImageIndex() = default;
+    virtual ~ImageIndex() = default;
+
+    //! The entry for the image at path, if the image is unchanged
+    virtual const Entry *Lookup(const std::filesystem::path& path) = 0;
+
+    //! Add or replace the entry for the image at path
+    virtual const Entry& Update(const std::filesystem::path& path, Entry entry) = 0;
+
+    //! Write the index, if it has changed
+    virtual void Save() = 0;
+
+    /*! Create an index
+     *
+     * \param root The images are identified by their path relative to root.
+     * \param file The index file. If empty, the index is only kept in memory.
+     */
+    static std::unique_ptr<ImageIndex> Create(const std::filesystem::path& root,
+                                              const std::filesystem::path& file);
+};
+
+}
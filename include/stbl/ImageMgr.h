@@ -1,4 +1,6 @@
+#include <cstdint>
 #include <memory>
+#include <string>
 #include <vector>
 #include <filesystem>
 
@@ -10,16 +12,52 @@ class ImageMgr {
 public:
     using widths_t = std::vector<int>;
 
+    // An extra format to save the images in, next to the JPEG
+    struct Encoding {
+        ImageFormat format = ImageFormat::Webp;
+        int quality = 80;
+    };
+
+    using encodings_t = std::vector<Encoding>;
+
     struct ImageInfo {
         // Relative path from the sites root
         std::string relative_path;
 
         // Size of the image
         Image::Size size;
+
+        // Size of the file
+        std::uintmax_t bytes = 0;
+
+        // The encoder quality, if known
+        int quality = 0;
+
+        struct Alternative {
+            ImageFormat format = ImageFormat::Jpeg;
+            std::string relative_path;
+            std::uintmax_t bytes = 0;
+            int quality = 0;
+        };
+
+        // The same image in the extra formats, in the order they were given
+        std::vector<Alternative> alternatives;
     };
 
     using images_t = std::vector<ImageInfo>;
 
+    // A source image and its variants
+    struct Source {
+        Image::Size size;
+        std::uintmax_t bytes = 0;
+        // 0xRRGGBB
+        std::uint32_t dominant_color = 0;
+        // A tiny, blurry copy of the image as a data: URI, to show
+        // while the image loads. Empty if disabled.
+        std::string placeholder;
+        images_t images;
+    };
+
     /*! Image manager
      *
      * \param widths List of desired widths for banner-images.
@@ -37,11 +75,63 @@ public:
      * The returned list consists of alternative images that can be
      * used, sorted by size, smallest first. The idea is to prepare
      * several variants of each image for responsive web sites.
+     *
+     * What we learn about an image is kept in the image index, so
+     * when an image and its variants are unchanged since the last run,
+     * none of them are opened.
+     *
+     * Missing variants are made by worker threads. The sizes are read
+     * from the image header, so the returned paths and sizes are valid
+     * right away, but the files may not exist until Wait() returns. The
+     * byte sizes are 0 until then. The dominant color and the placeholder
+     * are made from a small decode of the image before Prepare() returns.
+     */
+    virtual Source Prepare(const std::filesystem::path& image) = 0;
+
+    /*! Recompress an original image, to publish instead of it
+     *
+     * See Image::Recompress(). It is done by the worker threads. When
+     * Wait() returns, dst exists, unless the image could not be
+     * recompressed (for example if it is not really a JPEG image). That
+     * is logged, but it is not an error. If dst is newer than the image,
+     * it is used as it is.
      */
-    virtual images_t Prepare(const std::filesystem::path& image) = 0;
+    virtual void PrepareOriginal(const std::filesystem::path& image,
+                                 const std::filesystem::path& dst,
+                                 int quality) = 0;
 
+    //! Wait for the variants to be made. Throws if any of them failed.
+    virtual void Wait() = 0;
+
+    //! Wait(), and write the image index if it has changed
+    virtual void SaveIndex() = 0;
+
+    /*! Create an image manager
+     *
+     * \param widths The widths to make variants for.
+     * \param quality JPEG quality.
+     * \param jpeg The other JPEG settings.
+     * \param filter Filter used to scale the images.
+     * \param alternatives Extra formats to save each variant in. Formats
+     *      that stbl was built without are ignored, with a warning.
+     * \param root The sites source directory. The relative paths
+     *      of the images are relative to this directory.
+     * \param indexFile Where to keep the image index between runs. If
+     *      empty, the index is only kept in memory.
+     * \param placeholders Make a placeholder for each image.
+     * \param target If enabled, the quality of each JPEG and WebP image
+     *      is searched for, up to quality or the quality of the format.
+     *      The results are kept in the image index.
+     */
     static std::unique_ptr<ImageMgr> Create(const widths_t& widths,
-                                            int quality);
+                                            int quality,
+                                            const JpegSettings& jpeg,
+                                            ResampleFilter filter = ResampleFilter::Area,
+                                            const encodings_t& alternatives = {},
+                                            const std::filesystem::path& root = {},
+                                            const std::filesystem::path& indexFile = {},
+                                            bool placeholders = true,
+                                            const QualityTarget& target = {});
 };
 
 }
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <functional>
+#include <string_view>
+
+struct cmark_node;
+
+namespace stbl {
+
+/*! Renders markdown to html with cmark-gfm
+ *
+ * There is one renderer per thread. All the memory used by cmark for a
+ * document, including the html output, comes from an arena owned by the
+ * renderer, which is reset before the next document is rendered.
+ *
+ * The GFM extensions (tables, strikethrough, autolinks and task-lists)
+ * are enabled.
+ */
+class MarkdownRenderer
+{
+protected:
+    MarkdownRenderer() = default;
+    MarkdownRenderer(const MarkdownRenderer&) = delete;
+    MarkdownRenderer& operator = (const MarkdownRenderer&) = delete;
+
+public:
+    // Called with the parsed document before it is rendered.
+    // New nodes must be allocated with cmark_node_mem(doc).
+    using transform_t = std::function<void (cmark_node *doc)>;
+
+    virtual ~MarkdownRenderer() = default;
+
+    /*! Render markdown to html
+     *
+     * The returned html is valid until the next call to Render()
+     * on the same thread.
+     */
+    virtual std::string_view Render(std::string_view markdown,
+                                    const transform_t& transform = {}) = 0;
+
+    // The renderer for the current thread
+    static MarkdownRenderer& GetInstance();
+};
+
+}
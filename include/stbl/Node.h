@@ -17,11 +17,12 @@ class Node
 public:
     enum class Type { ARTICLE, SERIES };
 
+    // All text is UTF-8
     struct Metadata {
         std::string uuid;
-        std::wstring title;
+        std::string title;
         std::string abstract;
-        std::wstring menu;
+        std::string menu;
         std::string tmplte;
         std::string type;
         std::string banner;
@@ -29,7 +30,7 @@ public:
         std::string comments;
         int sitemap_priority = -1;
         std::string sitemap_changefreq;
-        std::vector<std::wstring> tags;
+        std::vector<std::string> tags;
         time_t updated = 0;
         time_t published = 0;
         time_t expires = 0;
@@ -2,6 +2,8 @@
 #include <string>
 #include <boost/property_tree/ptree.hpp>
 
+#include "stbl/Config.h"
+
 namespace stbl {
 
 struct Options
@@ -22,9 +24,13 @@ struct Options
     bool update_source_headers = true;
     bool preview_mode = false;
     bool automatic_update = false;
+    bool write_if_changed = false; // Don't touch output files that are unchanged
 
     // From stbl.conf
     boost::property_tree::ptree options;
+
+    // Compiled from options
+    Config config;
 };
 
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <ostream>
+#include <string_view>
 
 #include <filesystem>
 
@@ -25,8 +26,14 @@ public:
 
     // Return the number of words in the article
     virtual size_t Render2Html(std::ostream& out, RenderCtx& ctx) = 0;
-    static page_t Create(const std::filesystem::path& path);
-    static page_t Create(const std::string& content);
+
+    /*! Render the page without copying the html
+     *
+     * The returned html is valid until the next page is rendered
+     * on the same thread. words is set to the number of words.
+     */
+    virtual std::string_view Render2Html(RenderCtx& ctx, size_t& words) = 0;
+    static page_t Create(const source_t& source);
 
 };
 
@@ -20,7 +20,7 @@ public:
     // Called when the article is rendered to make sure the published
     // and uuid headers are set and saved.
     // Both are required to support rss feeds.
-    virtual void UpdateRequiredHeaders(const std::string& article,
+    virtual void UpdateRequiredHeaders(const SourceBuffer& article,
                                        const Node::Metadata& meta) = 0;
 
     static std::unique_ptr<Scanner> Create(const Options& options);
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <filesystem>
+
+#include "stbl/stbl.h"
+
+namespace stbl {
+
+/*! The content of one source (markdown) file
+ *
+ * The file is read once, and the header-section and body are
+ * located when the buffer is created. The header parser, the
+ * markdown renderer and the header rewriter all work on views
+ * into the same buffer.
+ *
+ * Large files are memory-mapped. Small files are read into memory.
+ */
+class SourceBuffer
+{
+protected:
+    SourceBuffer() = default;
+    SourceBuffer(const SourceBuffer&) = delete;
+    SourceBuffer(SourceBuffer&&) = delete;
+    SourceBuffer& operator = (const SourceBuffer&) = delete;
+    SourceBuffer& operator = (SourceBuffer&&) = delete;
+
+public:
+    virtual ~SourceBuffer() = default;
+
+    // The path to the file. Empty if the buffer was created from a string.
+    virtual const std::filesystem::path& GetPath() const noexcept = 0;
+
+    // True if the file has a header-section between two "---" lines
+    virtual bool HaveHeader() const noexcept = 0;
+
+    // The lines between the "---" delimiters
+    virtual std::string_view GetHeader() const noexcept = 0;
+
+    // Everything after the header-section. The whole file if there is none.
+    virtual std::string_view GetBody() const noexcept = 0;
+
+    static source_t Create(const std::filesystem::path& path);
+    static source_t Create(std::string content);
+};
+
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string_view>
+
+namespace stbl {
+
+enum class ResampleFilter {
+    // Interpolates between the 2x2 nearest source pixels, like the gil
+    // sampler stbl used before. Only those pixels are read, so it is by
+    // far the fastest, but large downscales alias.
+    Bilinear,
+    // Average of the covered source pixels. Sharp and without ringing.
+    Area,
+    // Windowed sinc. The sharpest, with a little ringing on hard edges.
+    Lanczos3
+};
+
+//! Parse "bilinear", "area" or "lanczos3". Returns false for other names.
+bool ToResampleFilter(std::string_view name, ResampleFilter& filter) noexcept;
+
+/*! Resize an interleaved 8 bit RGB image
+ *
+ * The filter is separable and works in linear light, so that
+ * downscaled images keep their brightness and thin lines don't alias.
+ * The inner loops use AVX2/SSE when available, and the rows are split
+ * in bands across up to threads threads (0: one per core).
+ *
+ * Area and Lanczos3 read every source pixel, so they are slower than
+ * Bilinear. Scaling 6000x4000 to 320, 640, 960, 1280 and 1920 pixels
+ * wide takes about 300-480 ms in all with Area and 560-900 ms with
+ * Lanczos3 on one core, against 40-65 ms with Bilinear (and 70-110 ms
+ * with the gil bilinear sampler). MakeVariants() decodes JPEG images at
+ * a reduced scale first, and then feeds the small variants from the
+ * large ones, so it scales far fewer pixels.
+ *
+ * The strides are in bytes.
+ */
+void Resample(const std::uint8_t *src, int srcWidth, int srcHeight, std::ptrdiff_t srcStride,
+              std::uint8_t *dst, int dstWidth, int dstHeight, std::ptrdiff_t dstStride,
+              ResampleFilter filter = ResampleFilter::Area,
+              unsigned threads = 0);
+
+/*! Resize an interleaved 8 bit RGB image one row at the time
+ *
+ * Same filter as Resample(), but the source rows are pushed one by one,
+ * and each output row is passed to the sink as soon as it can be made.
+ * Only the rows the filter needs are kept, so the memory use depends on
+ * the widths, not on the heights. Runs on the caller's thread.
+ */
+class RowResampler
+{
+protected:
+    RowResampler() = default;
+    RowResampler(const RowResampler&) = delete;
+    RowResampler& operator = (const RowResampler&) = delete;
+
+public:
+    // Called with each output row (dstWidth * 3 bytes) and its index
+    using sink_t = std::function<void (const std::uint8_t *row, int y)>;
+
+    virtual ~RowResampler() = default;
+
+    //! Push the next source row (srcWidth * 3 bytes)
+    virtual void Push(const std::uint8_t *row) = 0;
+
+    static std::unique_ptr<RowResampler> Create(int srcWidth, int srcHeight,
+                                                int dstWidth, int dstHeight,
+                                                ResampleFilter filter, sink_t sink);
+};
+
+/*! Structural similarity (SSIM) between two RGB images of the same size
+ *
+ * Computed on the luma, over 8x8 windows. 1.0 means identical. Above
+ * 0.98 the difference is hard to see.
+ */
+double Ssim(const std::uint8_t *left, std::ptrdiff_t leftStride,
+            const std::uint8_t *right, std::ptrdiff_t rightStride,
+            int width, int height);
+
+}
@@ -10,6 +10,7 @@ class Article;
 class Series;
 class Page;
 class Content;
+class SourceBuffer;
 
 using node_t = std::shared_ptr<Node>;
 using nodes_t = std::vector<node_t>;
@@ -24,6 +25,8 @@ using pages_t = std::vector<page_t>;
 
 using content_t = std::shared_ptr<Content>;
 
+using source_t = std::shared_ptr<SourceBuffer>;
+
 #ifndef PROGRAM_NAME
 #   define PROGRAM_NAME "stbl"
 #endif
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+namespace stbl {
+
+/*! Check that str is well-formed UTF-8
+ *
+ * Rejects overlong encodings, surrogates and code points above U+10FFFF.
+ * Runs of ASCII are skipped 16 bytes at the time.
+ */
+bool IsValidUtf8(std::string_view str) noexcept;
+
+/*! Decode one code point from str, starting at pos
+ *
+ * pos is advanced past the sequence. Invalid input yields U+FFFD
+ * and consumes one byte.
+ */
+char32_t DecodeUtf8(std::string_view str, size_t& pos) noexcept;
+
+void AppendUtf8(std::string& out, char32_t cp);
+
+/*! Simple, locale-independent lower-casing of UTF-8 text
+ *
+ * Covers ASCII, Latin-1, Latin Extended-A and Additional, Greek,
+ * Cyrillic, Armenian and full-width Latin. Other code points are copied
+ * as they are. Used to build case-insensitive keys, like for tags.
+ */
+std::string Utf8ToLower(std::string_view str);
+
+}
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include <filesystem>
 #include <boost/property_tree/ptree.hpp>
@@ -18,43 +22,94 @@ void Save(const std::filesystem::path& path,
           const std::string& data,
           bool createDirectoryIsMissing = false,
           bool binary = false);
+
+/*! Write the segments, in order, to path
+ *
+ * The segments are written with writev(), so they are never joined
+ * in memory. Write-if-changed applies like for the other Save().
+ */
+void Save(const std::filesystem::path& path,
+          const std::vector<std::string_view>& segments,
+          bool createDirectoryIsMissing = false);
+
 void CreateDirectory(const std::filesystem::path& path);
 void CreateDirectoryForFile(const std::filesystem::path& path);
 
 boost::property_tree::ptree
 LoadProperties(const std::filesystem::path& path);
 
-std::string ToString(const std::wstring& str);
-std::wstring ToWstring(const std::string& str);
+/*! Format a time-stamp as local time, like "2017-11-30 09:54"
+ *
+ * The date functions are thread-safe, and cache their results.
+ * They return an empty string if when is 0.
+ */
 std::string ToStringAnsi(const time_t& when);
+
+//! Format a time-stamp as local time, using a strftime() format
+std::string ToStringLocal(const time_t& when, const std::string& format);
+
+//! Format a time-stamp for RSS (RFC 822), like "Sat, 07 Sep 2002 00:00:01 GMT"
+std::string ToStringRss(const time_t& when);
+
 time_t Roundup(time_t when, const int roundup);
 
 void CopyDirectory(const std::filesystem::path& src,
                    const std::filesystem::path& dst);
 
-void EatHeader(std::istream& in);
+/*! Make dst an exact copy of src
+ *
+ * Files with the same content are left untouched, so that their
+ * modification time is kept. Files in dst that are not in src are
+ * removed.
+ */
+void SyncDirectory(const std::filesystem::path& src,
+                   const std::filesystem::path& dst);
+
+/*! Write-if-changed mode
+ *
+ * When enabled, Save() compares the data with the existing file (size
+ * first, then the content) and skips the write if they are the same.
+ */
+void SetWriteIfChanged(bool enable);
+bool IsWriteIfChanged();
+
+struct WriteStats {
+    std::atomic<std::uint64_t> written{0};
+    std::atomic<std::uint64_t> skipped{0};
+    std::atomic<std::uint64_t> bytes_written{0};
+    std::atomic<std::uint64_t> bytes_skipped{0};
+};
+
+//! Files written and skipped by Save(), CopyDirectory() and SyncDirectory()
+WriteStats& GetWriteStats();
+
+/*! Count the words in a markdown document
+ *
+ * Fenced code blocks, inline code, link targets, html tags and bare
+ * URLs are not counted. Non-ASCII letters are part of words.
+ */
+size_t CountWords(std::string_view markdown);
 
 std::string CreateUuid();
 
 std::filesystem::path MkTmpPath();
 
-template <typename T>
-auto escapeForXml(const T& orig) {
-    std::ostringstream out;
-    for(const auto ch : orig) {
-        if (ch == '<') {
-            out << "&lt;";
-        } else if (ch == '>') {
-            out << "&gt;";
-        } else if (ch == '\"') {
-            out << "&quot;";
-        } else if (ch == '\'') {
-            out << "&apos;";
-        } else {
-            out << ch;
-        }
-    }
-    return out.str();
+//! Standard base64 (RFC 4648), with padding
+std::string Base64Encode(std::string_view data);
+
+/*! Append orig to out with the XML special characters escaped
+ *
+ * The result is safe both as element content and as a quoted
+ * attribute value. The input is scanned 16 or 32 bytes at the time
+ * (SSE2/AVX2), and the runs without special characters are copied
+ * in bulk.
+ */
+void EscapeForXml(std::string_view orig, std::string& out);
+
+inline std::string escapeForXml(std::string_view orig) {
+    std::string out;
+    EscapeForXml(orig, out);
+    return out;
 }
 
 std::string Pipe(const std::string& cmd,
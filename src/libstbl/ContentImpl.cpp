@@ -15,8 +15,8 @@ namespace stbl {
 class ContentImpl : public Content
 {
 public:
-    ContentImpl(const std::filesystem::path& path)
-    : path_{path}
+    ContentImpl(const source_t& source)
+    : source_{source}
     {
     }
 
@@ -35,17 +35,17 @@ public:
                              const Node::Metadata& meta) override {
 
         if (!meta.have_uuid || !meta.have_published) {
-            scanner.UpdateRequiredHeaders(path_.string(), meta);
+            scanner.UpdateRequiredHeaders(*source_, meta);
         }
     }
 
 private:
-    const std::filesystem::path path_;
+    const source_t source_;
     pages_t pages_;
 };
 
-content_t Content::Create(const std::filesystem::path& path) {
-    return make_shared<ContentImpl>(path);
+content_t Content::Create(const source_t& source) {
+    return make_shared<ContentImpl>(source);
 }
 
 }
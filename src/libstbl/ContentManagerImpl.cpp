@@ -15,7 +15,6 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string/split.hpp>
 #include <boost/algorithm/string.hpp>
-#include <boost/regex.hpp>
 
 #include "stbl/Options.h"
 #include "stbl/ContentManager.h"
@@ -26,6 +25,7 @@
 #include "stbl/Sitemap.h"
 #include "stbl/logging.h"
 #include "stbl/utility.h"
+#include "stbl/utf8.h"
 #include "templates_res.h"
 #include "stbl/stbl_config.h"
 #include "stbl/utility.h"
@@ -62,23 +62,22 @@ public:
 
 
     struct Menu {
-        wstring name;
+        string name;
         string url;
         vector<shared_ptr<Menu>> children;
     };
 
     ContentManagerImpl(const Options& options)
     : now_{time(nullptr)}
-    , roundup_{options.options.get<time_t>("system.date.roundup", 1800)}
+    , config_{options.config}
+    , roundup_{config_.date.roundup}
     {
         options_ = options;
-        if (auto chroma = options.options.get_optional<string>("chroma.enabled")) {
-            auto command = options.options.get_optional<string>("chroma.path");
-            if (!command) {
-                command = "chroma";
-            };
-            if (*chroma == "auto") {
-                auto query = *command + " -h";
+        SetWriteIfChanged(options.write_if_changed);
+        if (auto chroma = config_.chroma.enabled; !chroma.empty()) {
+            const auto& command = config_.chroma.path;
+            if (chroma == "auto") {
+                auto query = command + " -h";
                 if (std::system(query.c_str()) == 0) {
                     chroma = "true";
                 } else {
@@ -86,8 +85,8 @@ public:
                 }
             }
 
-            if (*chroma == "true") {
-                syntax_highlighter_ = *command;
+            if (chroma == "true") {
+                syntax_highlighter_ = command;
             } else {
                 LOG_WARN << "No syntax highlighter specified.";
             }
@@ -116,20 +115,34 @@ protected:
         scanner_ = Scanner::Create(options_);
 
         {
-            string str_widths = options_.options.get<string>("banner.widths",
-                                              "94, 248, 480, 640, 720, 950");
-            vector<string> values;
-            boost::split(values, str_widths, boost::is_any_of(" ,"));
-            ImageMgr::widths_t widths;
-            for(const auto& v: values) {
-                if (v.empty()) {
-                    continue;
-                }
-                widths.push_back(stoi(v));
+            const ImageMgr::widths_t widths{config_.banner.widths.begin(),
+                                            config_.banner.widths.end()};
+            ImageMgr::encodings_t alternatives;
+            for(const auto format : config_.banner.formats) {
+                alternatives.push_back({format, format == ImageFormat::Avif
+                                        ? config_.banner.avif_quality
+                                        : config_.banner.webp_quality});
+            }
+            auto jpeg = config_.banner.jpeg;
+            jpeg.strip_metadata = config_.images.strip_metadata;
+            path cache = options_.source_path;
+            cache /= ".stbl-cache";
+            images_ = ImageMgr::Create(widths, config_.banner.quality, jpeg,
+                                        config_.banner.filter, alternatives,
+                                        options_.source_path, cache / "images.info",
+                                        config_.banner.placeholders, config_.banner.target);
+
+            // The images in the articles use the same encoder settings
+            if (!config_.images.widths.empty()) {
+                const ImageMgr::widths_t inline_widths{config_.images.widths.begin(),
+                                                       config_.images.widths.end()};
+                inline_images_ = ImageMgr::Create(inline_widths, config_.banner.quality, jpeg,
+                                                  config_.banner.filter, alternatives,
+                                                  options_.source_path,
+                                                  cache / "inline-images.info",
+                                                  config_.images.placeholders,
+                                                  config_.banner.target);
             }
-
-            images_ = ImageMgr::Create(widths,
-                options_.options.get<int>("banner.quality", 95));
         }
         nodes_= scanner_->Scan();
 
@@ -149,7 +162,7 @@ protected:
     void Prepare()
     {
         // Prepare menus from config
-        ScanMenus(menu_, options_.options.get_child("menu"));
+        ScanMenus(menu_, config_.menu);
 
         tmp_path_ = MkTmpPath();
         create_directories(tmp_path_);
@@ -175,35 +188,34 @@ protected:
 
         // Prepare tags
         for(auto& tag : tags_) {
-            auto path =  stbl::ToString(tag.first);
+            auto path = tag.first;
             boost::replace_all(path, " ", "_");
             tag.second.url = "_tags/"s + path + ".html";
         }
     }
 
-    template <typename T>
-    void ScanMenus(Menu& parent, const T& mlist) {
+    void ScanMenus(Menu& parent, const vector<Config::MenuItem>& mlist) {
         for(const auto& n : mlist) {
             auto menu = make_shared<Menu>();
-            menu->name= stbl::ToWstring(n.first);
-            menu->url = n.second.get("", "");
+            menu->name = n.name;
+            menu->url = n.url;
             if (menu->url.empty()) {
-                ScanMenus(*menu, n.second);
+                ScanMenus(*menu, n.children);
             }
             parent.children.push_back(menu);
-            LOG_TRACE <<  "Adding menu << " << stbl::ToString(parent.name)
-                << "/" << stbl::ToString(menu->name)
+            LOG_TRACE <<  "Adding menu << " << parent.name
+                << "/" << menu->name
                 << " --> " << menu->url;
         }
     }
 
     // Add or merge a menu at any level into the menu-tree
-    void AddToMenu(const wstring& name, string url) {
+    void AddToMenu(const string& name, string url) {
 
-        LOG_TRACE << "Adding menu-item: \"" << stbl::ToString(name)
+        LOG_TRACE << "Adding menu-item: \"" << name
             << "\" --> " << url;
 
-        vector<wstring> parts;
+        vector<string> parts;
         boost::split(parts, name, boost::is_any_of("/"));
         Menu *current_menu = &menu_;
 
@@ -261,6 +273,9 @@ protected:
 
         sitemap_ = Sitemap::Create();
 
+        // Recompressed while the pages are rendered
+        PrepareOriginals();
+
         // Create the main page from template
         RenderFrontpage();
 
@@ -293,6 +308,12 @@ protected:
             sitemap_->Write(sitemap);
         }
 
+        // The scaled images are made while the pages are rendered
+        images_->SaveIndex();
+        if (inline_images_) {
+            inline_images_->SaveIndex();
+        }
+
         // Copy artifacts, images and other files
         for(const auto& d : directories_to_copy) {
             path src = options_.source_path, dst = tmp_path_;
@@ -300,6 +321,9 @@ protected:
             dst /= d;
             if (std::filesystem::is_directory(src)) {
                 CopyDirectory(src, dst);
+                if (d == "images"s) {
+                    CopyOriginals(dst);
+                }
             } else {
                 LOG_WARN << "Cannot copy directory " << src
                     << ", it does not exist.";
@@ -342,7 +366,7 @@ protected:
                    const std::string& link,
                    const std::string& rss_link) {
 
-        if (!options_.options.get<bool>("rss.enabled", true)) {
+        if (!config_.rss.enabled) {
             LOG_TRACE << "RSS is disabled. Not generating RSS for: " << link;
             return;
         }
@@ -352,14 +376,14 @@ protected:
             << R"(<rss version="2.0" xmlns:atom="http://www.w3.org/2005/Atom">)" << endl
             << "<channel>" << endl
             << R"(<atom:link href=")"
-                << rss_link
+                << escapeForXml(rss_link)
                 << R"(" rel="self" type="application/rss+xml" />)" << endl
             << "<title>" << escapeForXml(title) << "</title>" << endl
             << "<description>" << escapeForXml(description) << "</description>" << endl
-            << "<link>" << link << "</link>" << endl
-            << "<lastBuildDate>" << RssTime(time(nullptr)) << "</lastBuildDate>" << endl
-            << "<pubDate>" << RssTime(time(nullptr)) << "</pubDate>" << endl
-            << "<ttl>" << options_.options.get<unsigned>("rss.ttl", 1800) << "</ttl>" << endl;
+            << "<link>" << escapeForXml(link) << "</link>" << endl
+            << "<lastBuildDate>" << ToStringRss(time(nullptr)) << "</lastBuildDate>" << endl
+            << "<pubDate>" << ToStringRss(time(nullptr)) << "</pubDate>" << endl
+            << "<ttl>" << config_.rss.ttl << "</ttl>" << endl;
 
         for (const auto &a : articles) {
             auto hdr = a->GetMetadata();
@@ -367,11 +391,11 @@ protected:
             const auto url = GetSiteUrl() + "/"s + hdr->relative_url;
 
             out << "<item>" << endl
-                << " <title>" << escapeForXml(ToString(hdr->title)) << "</title>" << endl
+                << " <title>" << escapeForXml(hdr->title) << "</title>" << endl
                 << " <description>" << escapeForXml(hdr->abstract) << "</description>" << endl
-                << " <link>" << url << "</link>" << endl
-                << R"( <guid isPermaLink="false">)" << hdr->uuid << "</guid>" << endl
-                << " <pubDate>" << RssTime(hdr->published) << "</pubDate>" << endl
+                << " <link>" << escapeForXml(url) << "</link>" << endl
+                << R"( <guid isPermaLink="false">)" << escapeForXml(hdr->uuid) << "</guid>" << endl
+                << " <pubDate>" << ToStringRss(hdr->published) << "</pubDate>" << endl
                 << "</item>" << endl;
         }
 
@@ -384,39 +408,6 @@ protected:
         Save(path, out.str());
     }
 
-    // Return a date like: Sat, 07 Sep 2002 0:00:01 GMT
-    string RssTime(const time_t when) {
-        if (!when) {
-            return {};
-        }
-
-        // RFC 822 was written before languages other than US English was invented...
-
-        static array<const char *, 7> days = {
-             "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
-
-        static array <const char *, 12> months = {
-             "Jan", "Feb",  "Mar", "Apr", "May", "Jun", "Jul", "Aug",
-             "Sep", "Oct", "Nov", "Dec"};
-
-        const auto *tm = gmtime(&when);
-        if (tm == nullptr) {
-            throw runtime_error("Invalid date after conversion by gmtime");
-        }
-
-        stringstream out;
-        out << days.at(tm->tm_wday) << ", "
-            << std::setfill('0') << std::setw(2) << tm->tm_mday
-            << std::setw(0) << ' ' << months.at(tm->tm_mon)
-            << ' ' << std::setw(4) << (tm->tm_year + 1900)
-            << std::setw(0) << ' ' << std::setw(2) << tm->tm_hour
-            << std::setw(0) << ':' << std::setw(2) << tm->tm_min
-            << std::setw(0) << ':' << std::setw(2) << tm->tm_sec
-            << " GMT";
-
-        return out.str();
-    }
-
     void RenderTag(const TagInfo& ti) {
         if (ti.nodes.empty()) {
             // Not used
@@ -424,8 +415,7 @@ protected:
             return;
         }
 
-        RenderCtx ctx;
-        ctx.url_recuse_level = GetRecurseLevel(ti.url);
+        RenderCtx ctx{GetRecurseLevel(ti.url)};
 
         auto page = LoadTemplate("tags.html");
 
@@ -456,10 +446,14 @@ protected:
     }
 
     void RenderArticle(const ArticleInfo& ai) {
-        RenderCtx ctx;
+        RenderCtx ctx{GetRecurseLevel(ai.article->GetMetadata()->relative_url)};
         ctx.current = ai.article;
-        ctx.url_recuse_level = GetRecurseLevel(
-            ai.article->GetMetadata()->relative_url);
+        if (!syntax_highlighter_.empty()) {
+            ctx.highlight_code = [this](const string& code, const string& language) {
+                return SyntaxHighlightBlock(code, language);
+            };
+        }
+        SetImageRenderer(ctx);
 
         auto meta = ai.article->GetMetadata();
 
@@ -474,10 +468,11 @@ protected:
                 create_directories(directory);
             }
 
-            stringstream content;
-            const auto words = p->Render2Html(content, ctx);
-
-            string content_str = content.str();
+            // The body is a view of the markdown renderer's output. It is
+            // valid until the next page is rendered, so it goes straight
+            // to the file, without being copied.
+            size_t words = 0;
+            const auto body = p->Render2Html(ctx, words);
 
             LOG_INFO << "Article " << ai.article->GetMetadata()->title
                 << " contains " << words << " words.";
@@ -487,11 +482,6 @@ protected:
                 template_name= "article.html";
             }
 
-            // syntax highlighting
-            if (content_str.find("<code class=") != string::npos) {
-                SyntaxHighlight(content_str);
-            }
-
             string article = LoadTemplate(template_name);
             map<string, string> vars;
             vars["minutes-to-read"] = to_string(max<int>(1, words / 275));
@@ -499,24 +489,30 @@ protected:
             Assign(*meta, vars, ctx);
             AssignHeaderAndFooter(vars, ctx);
             AssignNavigation(vars, *ai.article, ctx);
-            vars["content"] = std::move(content_str);
             auto authors = ai.article->GetAuthors();
             if (authors.empty()) {
-                auto default_author = options_.options.get<string>("people.default", "");
-                if (!default_author.empty()) {
-                    authors.push_back(std::move(default_author));
+                if (!config_.default_author.empty()) {
+                    authors.push_back(config_.default_author);
                 }
             }
             vars["author"] = RenderAuthors(authors, ctx);
             vars["authors"] = vars["author"];
             if (!meta->banner.empty()) {
-                vars["banner"] = RenderBanner(*meta, ctx);
+                AssignBanner(vars, *meta, ctx);
             }
 
             vars["read-time"] = Render("read-time.html", vars, ctx);
 
-            ProcessTemplate(article, vars);
-            Save(ai.tmp_path, article, true);
+            auto parts = SplitTemplate(article, "{{content}}");
+            vector<string_view> segments;
+            segments.reserve(parts.size() * 2);
+            for(auto& part : parts) {
+                if (!segments.empty()) {
+                    segments.push_back(body);
+                }
+                segments.push_back(ProcessTemplate(part, vars));
+            }
+            Save(ai.tmp_path, segments, true);
 
             Sitemap::Entry sm_entry;
             sm_entry.priority = GetSitemapPriority("article",
@@ -579,46 +575,301 @@ protected:
         }));
     }
 
-    string RenderBanner(const Node::Metadata& meta, const RenderCtx& ctx) {
-        static const int align = options_.options.get<int>("banner.align", 0);
+    path GetOriginalsCache() const {
+        path cache = options_.source_path;
+        cache /= ".stbl-cache";
+        cache /= "originals";
+        return cache;
+    }
+
+    /* Recompress the jpg files in the images directory, for publishing
+     *
+     * The results are kept in the cache, as long as the images and the
+     * settings are unchanged. The scaled images are already encoded
+     * with the settings, so they are left alone.
+     */
+    void PrepareOriginals() {
+        const auto mode = config_.images.originals;
+        path images = options_.source_path;
+        images /= "images";
+        if ((mode == Config::Originals::Copy && !config_.images.strip_metadata)
+            || !is_directory(images)) {
+            return;
+        }
+
+        const auto& jpeg = config_.banner.jpeg;
+        ostringstream settings;
+        settings << "mode " << static_cast<int>(mode)
+                 << "; quality " << config_.banner.quality
+                 << "; progressive " << jpeg.progressive
+                 << "; optimize " << jpeg.optimize_coding
+                 << "; subsampling " << static_cast<int>(jpeg.subsampling)
+                 << "; strip " << config_.images.strip_metadata << '\n';
+
+        const auto cache = GetOriginalsCache();
+        auto stamp = cache / "settings";
+        if (!is_regular_file(stamp) || Load(stamp) != settings.str()) {
+            LOG_DEBUG << "The recompressed images in " << cache << " are made with other settings.";
+            remove_all(cache);
+            Save(stamp, settings.str(), true);
+        }
+
+        const int quality = mode == Config::Originals::Reencode ? config_.banner.quality : 0;
+        for(auto it = std::filesystem::recursive_directory_iterator{images};
+            it != std::filesystem::recursive_directory_iterator{}; ++it) {
+            const auto name = it->path().filename().string();
+            if (it->is_directory()) {
+                if (boost::starts_with(name, "_scale_")) {
+                    it.disable_recursion_pending();
+                }
+                continue;
+            }
+
+            auto ext = it->path().extension().string();
+            boost::to_lower(ext);
+            if (!it->is_regular_file() || (ext != ".jpg" && ext != ".jpeg")) {
+                continue;
+            }
+
+            auto relative = it->path().lexically_relative(images);
+            images_->PrepareOriginal(it->path(), cache / relative, quality);
+            originals_.push_back(move(relative));
+        }
+    }
+
+    // Replace the copied originals with the recompressed ones. The images
+    // that failed are published as they are.
+    void CopyOriginals(const path& dst) {
+        const auto cache = GetOriginalsCache();
+        originals_.erase(remove_if(originals_.begin(), originals_.end(), [&](const auto& relative) {
+            if (is_regular_file(cache / relative)) {
+                return false;
+            }
+            LOG_WARN << "The image " << relative << " could not be recompressed. "
+                     << "It is published as it is, with its metadata.";
+            return true;
+        }), originals_.end());
+
+        for(const auto& relative : originals_) {
+            const auto target = dst / relative;
+            LOG_TRACE << "Copying " << cache / relative << " --> " << target;
+            copy_file(cache / relative, target, std::filesystem::copy_options::overwrite_existing);
+        }
+    }
 
+    // The banner, and the placeholder for templates that want to show it elsewhere
+    void AssignBanner(map<string, string>& vars, const Node::Metadata& meta,
+                      const RenderCtx& ctx) {
         path image_path = options_.source_path;
         image_path /= "images";
         image_path /= meta.banner;
 
-        auto imgs = images_->Prepare(image_path);
+        const auto source = images_->Prepare(image_path);
+        vars["banner"] = RenderBanner(source, ctx);
+        vars["banner-color"] = ToHexColor(source.dominant_color);
+        vars["banner-placeholder"] = source.placeholder;
+    }
 
-        stringstream out;
-        string default_src;
+    string RenderBanner(const ImageMgr::Source& source, const RenderCtx& ctx) {
+        const int align = config_.banner.align;
+        const auto& imgs = source.images;
 
-        out << R"(<picture class="banner">)" << endl;
+        string out;
+        const ImageMgr::ImageInfo *default_img = nullptr;
+
+        out += "<picture class=\"banner\">\n";
         for (const auto &v : imgs) {
-            if (default_src.empty() && (v.size.width >= 300)) {
-                default_src = v.relative_path;
+            if (v.size.width >= 300) {
+                default_img = &v;
                 break;
             }
         }
 
-        for(auto it = imgs.rbegin(); it != imgs.rend(); ++it) {
-            const int width = it->size.width + align;
-            out << "<source media=\"(min-width: "
-                <<  width << "px)\" srcset=\""
-                << ctx.GetRelativeUrl(it->relative_path)
-                << "\">" << endl;
+        // The browser uses the first source that matches both the media
+        // query and a type it supports, so the smaller formats go first
+        // and the JPEG images are the fallback.
+        auto add_sources = [&](const auto& get_path, string_view type) {
+            for(auto it = imgs.rbegin(); it != imgs.rend(); ++it) {
+                const int width = it->size.width + align;
+                out += "<source media=\"(min-width: ";
+                out += to_string(width);
+                out += "px)\" ";
+                if (!type.empty()) {
+                    out += "type=\"";
+                    out += type;
+                    out += "\" ";
+                }
+                out += "srcset=\"";
+                AppendUrlAttribute(out, ctx, get_path(*it));
+                out += "\">\n";
+            }
+        };
+
+        const auto alternatives = imgs.empty() ? 0 : imgs.front().alternatives.size();
+        for(size_t i = 0; i < alternatives; ++i) {
+            add_sources([i](const ImageMgr::ImageInfo& ii) -> const string& {
+                return ii.alternatives[i].relative_path;
+            }, GetMimeType(imgs.front().alternatives[i].format));
+        }
+
+        add_sources([](const ImageMgr::ImageInfo& ii) -> const string& {
+            return ii.relative_path;
+        }, {});
+
+        if (default_img) {
+            // The intrinsic size lets the browser reserve the space
+            // before the image is loaded
+            out += "<img src=\"";
+            AppendUrlAttribute(out, ctx, default_img->relative_path);
+            out += "\" width=\"";
+            out += to_string(default_img->size.width);
+            out += "\" height=\"";
+            out += to_string(default_img->size.height);
+            out += '"';
+            AppendPlaceholder(out, source);
+            out += " alt=\"Banner\">\n";
+        }
+        out += "</picture>\n";
+        return out;
+    }
+
+    // Let the markdown images on the page get scaled variants
+    void SetImageRenderer(RenderCtx& ctx) {
+        if (inline_images_) {
+            ctx.render_image = [this, &ctx](string_view url, string_view alt,
+                                            string_view title, size_t index) {
+                return RenderInlineImage(url, alt, title, index, ctx);
+            };
+        }
+    }
+
+    /* An image in an article, with scaled variants
+     *
+     * The browser picks the variant from srcset and sizes. The intrinsic
+     * size prevents the layout from shifting when the image arrives, and
+     * all but the first images on the page are loaded lazily.
+     */
+    string RenderInlineImage(string_view url, string_view alt, string_view title,
+                             size_t index, const RenderCtx& ctx) {
+        path image_path = options_.source_path;
+        image_path /= string{url};
+
+        // The variants can only be made from JPEG images
+        auto ext = image_path.extension().string();
+        boost::to_lower(ext);
+        if ((ext != ".jpg" && ext != ".jpeg") || !is_regular_file(image_path)) {
+            return {};
+        }
+
+        // A file we can't decode is published as it is, in a plain <img>
+        ImageMgr::Source source;
+        try {
+            source = inline_images_->Prepare(image_path);
+        } catch(const exception& ex) {
+            LOG_WARN << "Failed to prepare the image " << image_path << ": " << ex.what()
+                     << ". Using it as it is.";
+            return {};
+        }
+        const auto& imgs = source.images;
+        if (imgs.empty()) {
+            return {};
+        }
+
+        const auto& sizes = config_.images.sizes;
+        auto srcset = [&](const auto& get_path) {
+            string list;
+            for(const auto& ii : imgs) {
+                if (!list.empty()) {
+                    list += ", ";
+                }
+                AppendUrlAttribute(list, ctx, get_path(ii));
+                list += ' ';
+                list += to_string(ii.size.width);
+                list += 'w';
+            }
+            return list;
+        };
+
+        string out;
+        const auto alternatives = imgs.front().alternatives.size();
+        if (alternatives) {
+            out += "<picture>";
+            for(size_t i = 0; i < alternatives; ++i) {
+                out += "<source type=\"";
+                out += GetMimeType(imgs.front().alternatives[i].format);
+                out += "\" srcset=\"";
+                out += srcset([i](const ImageMgr::ImageInfo& ii) -> const string& {
+                    return ii.alternatives[i].relative_path;
+                });
+                out += "\" sizes=\"";
+                EscapeForXml(sizes, out);
+                out += "\">";
+            }
+        }
+
+        // The largest variant for browsers without srcset
+        const auto& largest = imgs.back();
+        out += "<img src=\"";
+        AppendUrlAttribute(out, ctx, largest.relative_path);
+        out += "\" srcset=\"";
+        out += srcset([](const ImageMgr::ImageInfo& ii) -> const string& {
+            return ii.relative_path;
+        });
+        out += "\" sizes=\"";
+        EscapeForXml(sizes, out);
+        out += "\" width=\"";
+        out += to_string(largest.size.width);
+        out += "\" height=\"";
+        out += to_string(largest.size.height);
+        out += '"';
+        AppendPlaceholder(out, source);
+        out += " alt=\"";
+        EscapeForXml(alt, out);
+        out += '"';
+        if (!title.empty()) {
+            out += " title=\"";
+            EscapeForXml(title, out);
+            out += '"';
+        }
+        if (index >= static_cast<size_t>(config_.images.eager)) {
+            out += " loading=\"lazy\"";
+        }
+        out += " decoding=\"async\">";
+
+        if (alternatives) {
+            out += "</picture>";
+        }
+        return out;
+    }
+
+    /* Let the placeholder show through until the image is loaded
+     *
+     * The dominant color fills the box at once, and the tiny image is
+     * scaled up over it. Both are inline, so they need no requests.
+     */
+    static void AppendPlaceholder(string& out, const ImageMgr::Source& source) {
+        if (source.placeholder.empty()) {
+            return;
         }
+        out += " style=\"background:";
+        out += ToHexColor(source.dominant_color);
+        out += " url(";
+        out += source.placeholder; // base64 needs no escaping
+        out += ") center/cover no-repeat\"";
+    }
 
-        if (!default_src.empty()) {
-            out << R"(<img src=")" << ctx.GetRelativeUrl(default_src) << R"(" alt="Banner">)" << endl;
+    // Append url, resolved relative to the page, as an escaped attribute value
+    void AppendUrlAttribute(string& out, const RenderCtx& ctx, string_view url) const {
+        if (!RenderCtx::IsAbsoluteUrl(url)) {
+            out += ctx.getRelativePrefix();
         }
-        out << "</picture>" << endl;
-        return out.str();
+        EscapeForXml(url, out);
     }
 
     void RenderSerie(const serie_t& serie) {
-        RenderCtx ctx;
+        RenderCtx ctx{GetRecurseLevel(serie->GetMetadata()->relative_url)};
         ctx.current = serie;
-        ctx.url_recuse_level = GetRecurseLevel(
-            serie->GetMetadata()->relative_url);
+        SetImageRenderer(ctx);
 
         string series = LoadTemplate("series.html");
 
@@ -658,7 +909,7 @@ protected:
                     meta->abstract = am->abstract;
                     meta->banner = am->banner;
                     if (!meta->banner.empty()) {
-                        vars["banner"] = RenderBanner(*meta, ctx);
+                        AssignBanner(vars, *meta, ctx);
                     }
 
                     if (meta->sitemap_priority >= 0) {
@@ -686,13 +937,13 @@ protected:
                        bool skipMenu = false) {
         vars["now"] = ToStringLocal(now_);
         vars["now-ansi"] = ToStringAnsi(now_);
-        vars["site-title"] = options_.options.get<string>("name", "Anonymous Nest");
-        vars["site-abstract"] = options_.options.get<string>("abstract");
+        vars["site-title"] = config_.name;
+        vars["site-abstract"] = config_.abstract;
         vars["site-url"] = GetSiteUrl();
         vars["program-name"] = PROGRAM_NAME;
         vars["program-version"] = STBL_VERSION;
-        vars["rel"] = ctx.GetRelativeUrl(""s);
-        vars["lang"] = options_.options.get<string>("language", "en");
+        vars["rel"] = ctx.getRelativePrefix();
+        vars["lang"] = config_.language;
         vars["scripts"] = RenderScripts(ctx);
 
         if (!skipMenu) {
@@ -706,8 +957,7 @@ protected:
     }
 
     string ComputeSiteUrl() const {
-        string url = options_.options.get<string>(
-            "url", options_.destination_path);
+        string url = config_.url.empty() ? options_.destination_path : config_.url;
         if (!url.empty() && url[url.size() -1] == '/') {
             url.resize(url.size() -1);
         }
@@ -750,8 +1000,9 @@ protected:
         vars["updated-ansi"] = ToStringAnsi(Roundup(md.updated, roundup_));
         vars["published-ansi"] = ToStringAnsi(Roundup(md.published, roundup_));
         vars["expires-ansi"] = ToStringAnsi(md.expires);
-        vars["title"] = stbl::ToString(md.title);
+        vars["title"] = md.title;
         vars["abstract"] = md.abstract;
+        AssignAttributes(vars);
         vars["url"] = ctx.GetRelativeUrl(md.relative_url);
         vars["page-url"] = GetSiteUrl() + "/" + md.relative_url;
         vars["tags"] = RenderTagList(md.tags, ctx);
@@ -770,7 +1021,7 @@ protected:
         vars["og-image"] = RenderOgImage(md, vars, ctx);
 
         if (!md.abstract.empty()) {
-            vars["og-description"] = R"(<meta property="og:description" content=")"s + md.abstract + R"("/>)";
+            vars["og-description"] = RenderMeta("property", "og:description", md.abstract);
         }
     }
 
@@ -781,8 +1032,35 @@ protected:
             return {};
         }
 
-        auto path = GetSiteUrl() + "/images/" + md.banner;
-        return R"(<meta property="og:image" content=")"s + path + R"("/>)";
+        path image_path = options_.source_path;
+        image_path /= "images";
+        image_path /= md.banner;
+        // From the image index, so the image is not opened
+        const auto image = images_->Prepare(image_path);
+
+        auto meta = RenderMeta("property", "og:image", GetSiteUrl() + "/images/" + md.banner);
+        auto add = [&meta, this](string_view name, string_view value) {
+            meta += "\n    ";
+            meta += RenderMeta("property", name, value);
+        };
+        add("og:image:type", GetMimeType(ImageFormat::Jpeg));
+        add("og:image:width", to_string(image.size.width));
+        add("og:image:height", to_string(image.size.height));
+        return meta;
+    }
+
+    // <meta> element with an escaped content attribute
+    string RenderMeta(string_view attr, string_view name, string_view content) {
+        string out;
+        out.reserve(content.size() + 64);
+        out += "<meta ";
+        out += attr;
+        out += "=\"";
+        EscapeForXml(name, out);
+        out += "\" content=\"";
+        EscapeForXml(content, out);
+        out += "\"/>";
+        return out;
     }
 
     string RenderComments(const Node::Metadata& md, map<string, string>& vars, const RenderCtx& ctx) {
@@ -790,27 +1068,26 @@ protected:
             return {};
         }
 
-        auto comments = md.comments;
-        if (comments.empty()) {
-            comments = options_.options.get("comments.default", "");
-        }
-
-        if (comments.empty()) {
+        const auto& comments = md.comments.empty() ? config_.default_comments : md.comments;
+        if (comments.empty() || comments == "no") {
             return {};
         }
 
-        const auto key = "comments."s + comments;
+        const auto provider = config_.comments.find(comments);
+        if (provider == config_.comments.end()) {
+            LOG_ERROR << "Unknown comments provider '" << comments << "' in " << md.title;
+            throw runtime_error("Configuration error");
+        }
 
-        for(const auto& it :  options_.options.get_child(key)) {
-            vars[comments + "-" + it.first] =  it.second.get("", "");
+        for(const auto& [name, value] : provider->second.vars) {
+            vars[name] = value;
         }
 
-        string tmplte_file = options_.options.get(key + ".template", "");
-        if (tmplte_file.empty()) {
+        if (provider->second.tmplte.empty()) {
             return {};
         }
 
-        return Render(tmplte_file, vars, ctx);
+        return Render(provider->second.tmplte, vars, ctx);
     }
 
     string Render(const string& templateName,
@@ -824,16 +1101,35 @@ protected:
 
     void CommitToDestination()
     {
-        if (std::filesystem::is_directory(options_.destination_path)) {
-            LOG_DEBUG << "Deleting directory: " << options_.destination_path;
-            std::filesystem::remove_all(options_.destination_path);
+        // Only count what goes to the destination
+        const auto& stats = GetWriteStats();
+        const uint64_t written = stats.written, bytes_written = stats.bytes_written;
+        const uint64_t skipped = stats.skipped, bytes_skipped = stats.bytes_skipped;
+
+        if (options_.write_if_changed) {
+            LOG_DEBUG << "Synchronizing directory: " << options_.destination_path;
+            SyncDirectory(tmp_path_, options_.destination_path);
+        } else {
+            if (std::filesystem::is_directory(options_.destination_path)) {
+                LOG_DEBUG << "Deleting directory: " << options_.destination_path;
+                std::filesystem::remove_all(options_.destination_path);
+            }
+
+            CopyDirectory(tmp_path_, options_.destination_path);
         }
 
-        CopyDirectory(tmp_path_, options_.destination_path);
+        LOG_INFO << "Output: " << (stats.written - written) << " files written ("
+                 << (stats.bytes_written - bytes_written) << " bytes), "
+                 << (stats.skipped - skipped) << " unchanged files skipped ("
+                 << (stats.bytes_skipped - bytes_skipped) << " bytes).";
     }
 
     void Publish() {
-        string cmd = options_.options.get<string>("publish.command");
+        string cmd = config_.publish_command;
+        if (cmd.empty()) {
+            LOG_ERROR << "publish.command must be set in stbl.conf in order to publish the site.";
+            throw runtime_error("Configuration error");
+        }
 
         map<string, string> vars;
         vars["tmp-site"] = tmp_path_.string();
@@ -870,14 +1166,14 @@ protected:
         if (meta->published > now) {
             LOG_INFO << *node
                 << " is held back because it is due to be published at "
-                << put_time(localtime(&meta->published), "%Y-%m-%d %H:%M");
+                << ToStringAnsi(meta->published);
             return options_.preview_mode ? true : false;
         }
 
         if (meta->expires && (meta->expires < now)) {
             LOG_INFO << *node
                 << " is held back because it expired at "
-                << put_time(localtime(&meta->expires), "%Y-%m-%d %H:%M");
+                << ToStringAnsi(meta->expires);
             return options_.preview_mode ? true : false;
         }
 
@@ -889,7 +1185,7 @@ protected:
             return false;
         }
 
-        set<wstring> tags;
+        set<string> tags;
 
         articles_t publishable;
 
@@ -1015,26 +1311,26 @@ protected:
         }
     }
 
-    void AddTags(const vector<wstring>& tags, const node_t& node) {
+    void AddTags(const vector<string>& tags, const node_t& node) {
         for(const auto& tag : tags) {
             auto key = ToKey(tag);
 
             // Preserve caps from the first time we encounter a tag
             if (tags_.find(key) == tags_.end()) {
-                tags_[key].name = stbl::ToString(tag);
+                tags_[key].name = tag;
             }
 
             tags_[key].nodes.push_back(node);
         }
     }
 
-    wstring ToKey(wstring name) {
-        transform(name.begin(), name.end(), name.begin(), ::tolower);
-        return name;
+    string ToKey(const string& name) {
+        return Utf8ToLower(name);
     }
 
     void RenderFrontpage() {
         RenderCtx ctx;
+        SetImageRenderer(ctx);
         std::map<std::string, std::string> vars;
 
         AssignDefauls(vars, ctx);
@@ -1045,17 +1341,15 @@ protected:
         vars["url"] = vars["page-url"] = vars["site-url"];
         vars["rss"] = "index.rss";
 
-        auto gsv = options_.options.get("seo.google-site-verification", "");
-        if (!gsv.empty()) {
+        if (const auto& gsv = config_.google_site_verification; !gsv.empty()) {
             vars["google-site-verification"] =
-                R"(<meta name="google-site-verification" content=")" + gsv +
-                R"("/>)";
+                RenderMeta("name", "google-site-verification", gsv);
         }
 
         if (index_) {
             auto meta = index_->GetMetadata();
             if (!meta->banner.empty()) {
-                vars["banner"] = RenderBanner(*meta, ctx);
+                AssignBanner(vars, *meta, ctx);
             }
 
             auto pages = index_->GetContent()->GetPages();
@@ -1092,7 +1386,7 @@ protected:
                  return left->GetMetadata()->title > right->GetMetadata()->title;
              });
 
-        const int max_articles = options_.options.get("max-articles-on-frontpage", 16);
+        const int max_articles = config_.max_articles_on_frontpage;
         nodes_t articles;
         int page_count = 0;
 
@@ -1106,7 +1400,7 @@ protected:
                 vars["list-articles"] = RenderNodeList(articles, ctx);
 
                 {
-                    vector<wstring> tags;
+                    vector<string> tags;
                     for(const auto& t: tags_) {
                         tags.push_back(t.first);
                     }
@@ -1161,9 +1455,10 @@ protected:
         if (fixed >= 0.0) {
             return fixed;
         }
-        float priority = options_.options.get<float>("seo.sitemap.priority."s + key,
-                                                     50.0) / 100.0;
-        return priority;
+        if (auto it = config_.sitemap_priority.find(key); it != config_.sitemap_priority.end()) {
+            return it->second / 100.0;
+        }
+        return 0.5;
     }
 
     string GetFrontPageName(const int page) {
@@ -1176,7 +1471,7 @@ protected:
 
     void RenderRssForFrontpage(path path, std::map<std::string, std::string>& vars) {
         nodes_t rss_articles;
-        int max_articles_in_rss_feed = options_.options.get("rss.max-articles", 64);
+        const int max_articles_in_rss_feed = config_.rss.max_articles;
         for(auto& a: all_articles_) {
             if (FilterRss(*a->article)) {
                 rss_articles.push_back(a->article);
@@ -1218,8 +1513,16 @@ protected:
         return true;
     }
 
+    // The title and abstract, escaped for use in attribute values
+    static void AssignAttributes(std::map<std::string, std::string>& vars) {
+        vars["title-attr"] = escapeForXml(vars["title"]);
+        vars["abstract-attr"] = escapeForXml(vars["abstract"]);
+    }
+
     void AssignHeaderAndFooter(std::map<std::string, std::string>& vars,
                                const RenderCtx& ctx) {
+        // The title and abstract may have been changed since Assign()
+        AssignAttributes(vars);
         string page_header = LoadTemplate("page-header.html");
         string site_header = LoadTemplate("site-header.html");
         string footer = LoadTemplate("footer.html");
@@ -1302,7 +1605,7 @@ protected:
             auto tag_info = tags_[key];
 
             vars["url"] = ctx.GetRelativeUrl(tag_info.url);
-            vars["name"] = stbl::ToString(tag);
+            vars["name"] = tag;
 
             string tmplte = LoadTemplate("tag.html");
             ProcessTemplate(tmplte, vars);
@@ -1337,12 +1640,12 @@ protected:
                 tmplte = LoadTemplate("submenu.html");
                 vars["content"] = RenderMenu(menu->children, ctx);
             } else {
-                LOG_WARN << "Menu ... " << stbl::ToString(menu->name)
+                LOG_WARN << "Menu ... " << menu->name
                     << "Has neither a URL nor sub-menus!";
                 return {};
             }
 
-            vars["name"] = stbl::ToString(menu->name);
+            vars["name"] = menu->name;
             ProcessTemplate(tmplte, vars);
             out << tmplte << endl;
         }
@@ -1355,32 +1658,27 @@ protected:
         std::stringstream out;
 
         for(const auto& key : authors) {
-            string full_key = "people."s + key;
             map<string, string> vars;
             AssignDefauls(vars, ctx);
 
-            if (options_.options.get_child_optional(full_key)) {
+            if (auto person = config_.people.find(key); person != config_.people.end()) {
 
-                vars["name"] = options_.options.get<string>(full_key + ".name", key);
-                string email = options_.options.get<string>(full_key + ".email", "");
-                if (!email.empty()) {
-                    vars["email"] = R"(<a class="author" href="mailto:)"s + email + R"(">)"s
-                        + email + "</a>";
+                vars["name"] = person->second.name;
+                if (const auto& email = person->second.email; !email.empty()) {
+                    const auto escaped = escapeForXml(email);
+                    vars["email"] = R"(<a class="author" href="mailto:)"s + escaped + R"(">)"s
+                        + escaped + "</a>";
                 }
 
 
                 std::vector<string> handles;
-                for(const auto& it :  options_.options.get_child(full_key)) {
-                    if ((it.first == "name") || (it.first == "email")) {
-                        continue;
-                    }
-
+                for(const auto& handle : person->second.handles) {
                     map<string, string> hvars;
                     AssignDefauls(hvars, ctx);
-                    hvars["handle"] = it.first;
-                    hvars["name"] = it.second.get("name", it.first);
-                    hvars["url"] = it.second.get("url", "");
-                    hvars["icon"] = it.second.get("icon", ctx.GetRelativeUrl("www.svg"));
+                    hvars["handle"] = handle.handle;
+                    hvars["name"] = handle.name;
+                    hvars["url"] = handle.url;
+                    hvars["icon"] = handle.icon.empty() ? ctx.GetRelativeUrl("www.svg") : handle.icon;
 
                     auto handle_template = LoadTemplate("social-handle.html");
                     handles.push_back(ProcessTemplate(handle_template, hvars));
@@ -1413,13 +1711,7 @@ protected:
     }
 
     string ToStringLocal(const time_t& when) {
-        if (when) {
-            static const string format = options_.options.get<string>("system.date.format", "%c");
-            if (const auto tm = std::localtime(&when)) {
-                return boost::lexical_cast<string>(put_time(tm, format.c_str()));
-            }
-        }
-        return {};
+        return stbl::ToStringLocal(when, config_.date.format);
     }
 
     string& ProcessTemplate(string& tmplte,
@@ -1443,6 +1735,19 @@ protected:
         return tmplte;
     }
 
+    // Split the template at each occurrence of the macro
+    static vector<string> SplitTemplate(const string& tmplte, string_view macro) {
+        vector<string> parts;
+        size_t start = 0;
+        for(auto pos = tmplte.find(macro); pos != string::npos;
+            pos = tmplte.find(macro, start)) {
+            parts.emplace_back(tmplte, start, pos - start);
+            start = pos + macro.size();
+        }
+        parts.emplace_back(tmplte, start);
+        return parts;
+    }
+
     string LoadTemplate(string name) const {
         path template_path = options_.source_path;
         template_path /= "templates";
@@ -1460,49 +1765,14 @@ protected:
         return string(reinterpret_cast<const char *>(it->second.first), it->second.second);
     }
 
-    bool SyntaxHighlight(string& content) {
-        if (syntax_highlighter_.empty()) {
-            return false;
-        }
-
-        static const boost::regex code_block(R"regex(<pre><code class="language-([a-zA-Z0-9+]{1,16})">(.*?)</code></pre>)regex",
-                                             boost::regex::normal | boost::regex::icase);
-
-        boost::smatch matches;
-        size_t start_at = 0;
-        while (boost::regex_search(content.cbegin() + start_at, content.cend(), matches, code_block)) {
-            const auto offset = std::distance(content.cbegin(), matches[0].first);
-            string language= matches[1];
-            std::string code = matches[2];
-            if (language == "c++" || language == "C++") {
-                language = "cpp";
-            }
-            string highlighted = SyntaxHighlightBlock(code, language);
-            if (!highlighted.empty()) {
-                content.replace(matches[0].first, matches[0].second, highlighted);
-                start_at = offset + highlighted.size();
-            } else {
-                start_at = std::distance(content.cbegin(), matches[0].second);
-            }
-            assert(start_at > offset);
-        }
-
-        return true;
-    }
-
-    string SyntaxHighlightBlock(string part, const string& language) {
+    string SyntaxHighlightBlock(const string& code, string language) {
         string cmd = syntax_highlighter_;
 
-        auto style = options_.options.get_optional<string>("chroma.style");
-        if (!style) {
-            style = "friendly";
+        if (language == "c++" || language == "C++") {
+            language = "cpp";
         }
 
-        boost::replace_all(part, "&amp;", "&");
-        boost::replace_all(part, "&gt;", ">");
-        boost::replace_all(part, "&lt;", "<");
-        boost::replace_all(part, "&br;", "\n");
-        boost::replace_all(part, "&quot;", "\"");
+        const auto& style = config_.chroma.style;
 
         vector<string> args;
         args.push_back("--html");
@@ -1513,8 +1783,8 @@ protected:
         // We need to handle section for each block to use thie
         //args.push_back("--html-linkable-lines");
         args.push_back("--filename=x." + string(language));
-        args.push_back("--style=" + *style);
-        auto ret = Pipe(cmd, args, part);
+        args.push_back("--style=" + style);
+        auto ret = Pipe(cmd, args, code);
 
         return ret;
     }
@@ -1531,7 +1801,7 @@ protected:
     deque<node_t> articles_for_frontpages_;
 
     // All tags from all content
-    map<std::wstring, TagInfo> tags_;
+    map<std::string, TagInfo> tags_;
 
     // Root menu item
     Menu menu_;
@@ -1539,8 +1809,12 @@ protected:
     path tmp_path_;
 
     const time_t now_;
+    const Config config_;
     unique_ptr<Scanner> scanner_;
     unique_ptr<ImageMgr> images_;
+    unique_ptr<ImageMgr> inline_images_;
+    // The recompressed originals, relative to the images directory
+    vector<path> originals_;
     const time_t roundup_;
     unique_ptr<Sitemap> sitemap_;
     std::string syntax_highlighter_;
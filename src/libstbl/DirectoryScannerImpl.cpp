@@ -6,7 +6,6 @@
 #include <sstream>
 #include <map>
 #include <locale>
-#include <codecvt>
 #include <sstream>
 #include <fstream>
 #include <chrono>
@@ -21,6 +20,7 @@
 #include "stbl/logging.h"
 #include "stbl/Page.h"
 #include "stbl/Scanner.h"
+#include "stbl/SourceBuffer.h"
 #include "stbl/HeaderParser.h"
 #include "stbl/utility.h"
 
@@ -120,18 +120,11 @@ public:
         return std::move(nodes_);
     }
 
-    void UpdateRequiredHeaders(const std::string & article,
+    void UpdateRequiredHeaders(const SourceBuffer& source,
                                const Node::Metadata& meta) override {
 
+        const auto article = source.GetPath().string();
         LOG_INFO << "Updating headers in " << article;
-        std::ifstream in(article);
-        if (!in) {
-            auto err = strerror(errno);
-            LOG_ERROR << "IO error. Failed to open "
-                << '"' << article << "\" for write: " << err;
-
-            throw runtime_error("IO error");
-        }
 
         // Make temporary file
         auto tmp_name = article + ".tmp";
@@ -170,12 +163,16 @@ public:
         out << "---" << endl;
 
         // Copy content
-        EatHeader(in);
-        copy(istreambuf_iterator<char>(in), istreambuf_iterator<char>(),
-             ostreambuf_iterator<char>(out));
-
-        in.close();
+        const auto body = source.GetBody();
+        out.write(body.data(), body.size());
         out.close();
+        if (!out) {
+            auto err = strerror(errno);
+            LOG_ERROR << "IO error. Failed to write "
+                << '"' << tmp_name << "\": " << err;
+
+            throw runtime_error("IO error");
+        }
 
         // Set file date
         auto when = std::filesystem::last_write_time(article);
@@ -193,11 +190,7 @@ private:
         }
     }
 
-    void WriteIf(ostream& out, const char *name, const std::wstring& value) {
-        WriteIf(out, name, ToString(value));
-    }
-
-    void WriteIf(ostream& out, const char *name, std::vector<std::wstring> value) {
+    void WriteIf(ostream& out, const char *name, const std::vector<std::string>& value) {
         if (!value.empty()) {
             bool virgin = true;
             out << name << ": ";
@@ -209,7 +202,7 @@ private:
                     out << ", ";
                 }
 
-                out << ToString(v);
+                out << v;
             }
 
             out << endl;
@@ -353,7 +346,7 @@ private:
         }
 
         if (!md->is_published) {
-            md->tags.push_back(L"UNPUBLISHED");
+            md->tags.push_back("UNPUBLISHED"s);
         }
 
         //series->SetMetadata(md);
@@ -389,7 +382,12 @@ private:
 
             try {
                 auto hdr = make_shared<Article::Header>();
-                ParseHeader(*hdr, FetchHeader(a.full_path));
+                auto source = SourceBuffer::Create(a.full_path);
+                if (!source->HaveHeader()) {
+                    LOG_ERROR << "Failed to extract header-section from " << a.full_path;
+                    throw runtime_error("Parse error");
+                }
+                ParseHeader(*hdr, source->GetHeader());
 
                 if (a.full_path.filename() == "index.md") {
                     hdr->type = "index"s;
@@ -422,13 +420,13 @@ private:
                 }
 
                 if (!hdr->is_published) {
-                    hdr->tags.push_back(L"UNPUBLISHED");
+                    hdr->tags.push_back("UNPUBLISHED"s);
                 }
 
                 article->SetMetadata(hdr);
 
-                auto content = Content::Create(a.full_path);
-                content->AddPage(Page::Create(a.full_path));
+                auto content = Content::Create(source);
+                content->AddPage(Page::Create(source));
                 article->SetContent(std::move(content));
 
                 articles.push_back(article);
@@ -466,11 +464,11 @@ private:
         }
     }
 
-    std::wstring GetTitleFromPath(const path& path) {
+    std::string GetTitleFromPath(const path& path) {
         return PrepareTitleFromPath(path.stem().string());
     }
 
-    std::wstring PrepareTitleFromPath(std::string name) {
+    std::string PrepareTitleFromPath(std::string name) {
 
         boost::replace_all(name, "_", " ");
 
@@ -479,7 +477,7 @@ private:
             name[0] = toupper(name[0], loc);
         }
 
-        return converter.from_bytes(name);
+        return name;
     }
 
 
@@ -494,66 +492,13 @@ private:
      * the header section. This approach will only read the part of the
      * file that we need for now.)
      */
-    std::string FetchHeader(path path) {
-        ostringstream out;
-
-        string inpath = path.string();
-        std::ifstream in(inpath.c_str());
-        array<char, 1024> buffer;
-        int delimiters = 0;
-        bool start = true;
-        size_t offset {};
-
-        while(in) {
-            in.getline(buffer.data(), buffer.size());
-            const auto len = in.gcount();
-
-            if (start) {
-                if (len >= 3) {
-                    if (static_cast<unsigned char>(buffer[0]) == 0xef
-                        && static_cast<unsigned char>(buffer[1]) == 0xbb
-                        && static_cast<unsigned char>(buffer[2]) == 0xbf) {
-
-                        // BOF
-                        offset = 3;
-                    }
-                }
-                start = false;
-            } else {
-                offset = 0;
-            }
-
-            bool is_delimiter = false;
-            if (len >= (offset + 3)) {
-                if ((buffer[offset + 0] == '-')
-                    && (buffer[offset + 1] == '-')
-                    &&  (buffer[offset + 2] == '-')) {
-                    ++delimiters;
-                    is_delimiter = true;
-                }
-            }
-
-            if (delimiters == 1) {
-                if (!is_delimiter) {
-                    out << buffer.data() << '\n';
-                }
-            } else if (delimiters == 2) {
-                return out.str();
-            }
-        }
-
-        LOG_ERROR << "Failed to extract header-section from " << path;
-        throw runtime_error("Parse error");
-    }
-
-    void ParseHeader(Article::Header& header, std::string input) {
+    void ParseHeader(Article::Header& header, std::string_view input) {
         parser_->Parse(header, input);
     }
 
     const Options& options_;
     nodes_t nodes_;
     unique_ptr<HeaderParser> parser_;
-    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
 };
 
 
@@ -1,63 +1,187 @@
 
-#include <iostream>
+#include <array>
 #include <string>
-#include <locale>
-#include <codecvt>
-#include <sstream>
-#include <iomanip>
+#include <string_view>
 #include <ctime>
 
-#include <boost/spirit/include/classic.hpp>
-#include <boost/config/warning_disable.hpp>
-#include <boost/spirit/include/qi.hpp>
-#include <boost/spirit/include/phoenix.hpp>
-#include <boost/fusion/include/std_pair.hpp>
-#include <boost/fusion/include/map.hpp>
-#include <boost/fusion/adapted/struct.hpp>
-#include <boost/spirit/include/phoenix_core.hpp>
-#include <boost/spirit/include/phoenix_operator.hpp>
-#include <boost/spirit/include/phoenix_stl.hpp>
-
-
 #include "stbl/stbl.h"
 #include "stbl/HeaderParser.h"
 #include "stbl/Article.h"
 #include "stbl/logging.h"
 #include "stbl/utility.h"
+#include "stbl/utf8.h"
 
 using namespace std;
-using namespace boost;
-namespace qi = boost::spirit::qi;
 
 namespace stbl {
 
-template <typename Iterator, typename Skipper = qi::ascii::blank_type>
-struct HeaderGrammar: qi::grammar <Iterator, ::stbl::HeaderParser::header_map_t(), Skipper> {
-    HeaderGrammar() : HeaderGrammar::base_type(header_lines, "HeaderGrammar Grammar") {
-        field_key    = +qi::char_("0-9a-zA-Z-");
-        field_value  = +~qi::char_("\n");
-        header_lines = *(field_key >> *qi::lit(' ') >> ':' >> field_value >> qi::lexeme["\n"]);
-    }
+namespace  {
 
-  private:
-    qi::rule<Iterator, ::stbl::HeaderParser::header_map_t(), Skipper> header_lines;
-    qi::rule<Iterator, std::string()> field_key, field_value;
+// The headers we know about. Anything else is ignored.
+enum Key : uint8_t {
+    UUID,
+    TITLE,
+    TAGS,
+    UPDATED,
+    ABSTRACT,
+    TEMPLATE,
+    TYPE,
+    MENU,
+    BANNER,
+    BANNER_CREDITS,
+    COMMENTS,
+    PART,
+    SITEMAP_PRIORITY,
+    SITEMAP_CHANGEFREQ,
+    PUBLISHED,
+    EXPIRES,
+    AUTHORS,
+    AUTHOR,
+    KEY_COUNT
 };
 
-namespace  {
+constexpr array<string_view, KEY_COUNT> key_names = {
+    "uuid",
+    "title",
+    "tags",
+    "updated",
+    "abstract",
+    "template",
+    "type",
+    "menu",
+    "banner",
+    "banner-credits",
+    "comments",
+    "part",
+    "sitemap-priority",
+    "sitemap-changefreq",
+    "published",
+    "expires",
+    "authors",
+    "author"
+};
 
-std::string removeCommentLines(std::string input) {
-    size_t pos = 0;
-    while ((pos = input.find('#', pos)) != std::string::npos) {
-        size_t endPos = input.find('\n', pos);
-        if (endPos != std::string::npos) {
-            input.erase(pos, endPos - pos + 1);
-        } else {
-            // If no newline character is found, erase till the end of the string
-            input.erase(pos);
+// Perfect hash for the known keys. They are all at least 4 bytes long.
+constexpr size_t hash_slots = 32;
+constexpr size_t min_key_len = 4;
+
+constexpr size_t KeyHash(string_view key) noexcept {
+    return (key.size() * 7
+            + static_cast<uint8_t>(key[0]) * 5
+            + static_cast<uint8_t>(key[1])
+            + static_cast<uint8_t>(key.back()) * 15) % hash_slots;
+}
+
+constexpr array<uint8_t, hash_slots> MakeKeyTable() {
+    array<uint8_t, hash_slots> table{};
+    for(auto& slot : table) {
+        slot = KEY_COUNT;
+    }
+    for(uint8_t k = 0; k < KEY_COUNT; ++k) {
+        table[KeyHash(key_names[k])] = k;
+    }
+    return table;
+}
+
+constexpr auto key_table = MakeKeyTable();
+
+constexpr bool IsCollisionFree() {
+    for(uint8_t k = 0; k < KEY_COUNT; ++k) {
+        if (key_names[k].size() < min_key_len || key_table[KeyHash(key_names[k])] != k) {
+            return false;
         }
     }
-    return input;
+    return true;
+}
+
+static_assert(IsCollisionFree(), "The key hash must be perfect for the known keys");
+
+Key Lookup(string_view key) noexcept {
+    if (key.size() < min_key_len) {
+        return KEY_COUNT;
+    }
+    const auto k = static_cast<Key>(key_table[KeyHash(key)]);
+    return (k != KEY_COUNT && key_names[k] == key) ? k : KEY_COUNT;
+}
+
+bool IsBlank(char ch) noexcept {
+    return ch == ' ' || ch == '\t';
+}
+
+bool IsKeyChar(char ch) noexcept {
+    return (ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'z')
+        || (ch >= 'A' && ch <= 'Z') || ch == '-';
+}
+
+string_view TrimLeft(string_view v) noexcept {
+    size_t pos = 0;
+    while (pos < v.size() && IsBlank(v[pos])) {
+        ++pos;
+    }
+    return v.substr(pos);
+}
+
+string_view TrimRight(string_view v) noexcept {
+    while (!v.empty() && (IsBlank(v.back()) || v.back() == '\r')) {
+        v.remove_suffix(1);
+    }
+    return v;
+}
+
+[[noreturn]] void ParseFailed(string_view at) {
+    LOG_ERROR << "Parsing failed at: << \": " << at.substr(0, 30) << "\"";
+    throw runtime_error("Parse error");
+}
+
+// Accepts 1 - max digits. Returns false if there are no digits.
+bool ParseNumber(string_view& v, size_t max, int& value) noexcept {
+    size_t len = 0;
+    value = 0;
+    while (len < max && len < v.size() && v[len] >= '0' && v[len] <= '9') {
+        value = value * 10 + (v[len] - '0');
+        ++len;
+    }
+    v.remove_prefix(len);
+    return len > 0;
+}
+
+bool Expect(string_view& v, char ch) noexcept {
+    if (v.empty() || v.front() != ch) {
+        return false;
+    }
+    v.remove_prefix(1);
+    return true;
+}
+
+// "YYYY-MM-DD HH:MM". Trailing text, like seconds, is ignored.
+bool ParseDate(string_view v, tm& t) noexcept {
+    int year = 0, month = 0, day = 0, hour = 0, minute = 0;
+
+    if (!ParseNumber(v, 4, year) || !Expect(v, '-')
+        || !ParseNumber(v, 2, month) || !Expect(v, '-')
+        || !ParseNumber(v, 2, day)) {
+        return false;
+    }
+
+    while (!v.empty() && (IsBlank(v.front()) || v.front() == '\n' || v.front() == '\r')) {
+        v.remove_prefix(1);
+    }
+
+    if (!ParseNumber(v, 2, hour) || !Expect(v, ':')
+        || !ParseNumber(v, 2, minute)) {
+        return false;
+    }
+
+    if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59) {
+        return false;
+    }
+
+    t.tm_year = year - 1900;
+    t.tm_mon = month - 1;
+    t.tm_mday = day;
+    t.tm_hour = hour;
+    t.tm_min = minute;
+    return true;
 }
 
 }
@@ -65,175 +189,184 @@ std::string removeCommentLines(std::string input) {
 class HeaderParserImpl : public HeaderParser
 {
 public:
-    using it_t = std::string::const_iterator;
+    // Views into the header-section. Empty if the header is not present.
+    using values_t = array<string_view, KEY_COUNT>;
 
     HeaderParserImpl()
     {
     }
 
-    void Parse(Article::Header& header, std::string& headerBlock) override {
-        auto hdr = removeCommentLines(headerBlock);
-        HeaderGrammar<it_t> grammar;
-        auto iter = hdr.cbegin();
-        auto end = hdr.cend();
-        header_map_t headers;
-        bool result = phrase_parse(iter, end, grammar, qi::ascii::blank, headers);
+    void Parse(Article::Header& header, std::string_view headerBlock) override {
+        values_t values;
 
-        if (!result || (iter != end)) {
-            std::string::const_iterator some = iter+30;
-            std::string context(iter, (some>end)?end:some);
-            LOG_ERROR << "Parsing failed at: << \": " << context << "\"";
-            throw runtime_error("Parse error");
+        while (!headerBlock.empty()) {
+            const auto eol = headerBlock.find('\n');
+            const auto line = headerBlock.substr(0, eol);
+            headerBlock.remove_prefix(eol == string_view::npos ? headerBlock.size() : eol + 1);
+            ParseLine(line, values);
         }
 
-        LOG_TRACE << "Dumping headers: ";
-        for (const auto &h : headers) {
-            LOG_TRACE << "  '" << h.first << "' --> '" << h.second << "'";
-        }
+        // The dump is only formatted if trace-logging is enabled
+        LOG_TRACE << "Dumping headers: " << Dump(values);
 
-        Assign(header, headers);
+        Assign(header, values);
     }
 
 private:
-    void Assign(Article::Header& hdr, const header_map_t headers) {
-
-        hdr.uuid = Get("uuid", headers);
-        hdr.title = GetWide("title", headers);
-        hdr.tags = GetWideList("tags", headers);
-        hdr.updated = GetTime("updated", headers);
-        hdr.abstract = Get("abstract", headers);
-        hdr.tmplte = Get("template", headers);
-        hdr.type = Get("type", headers);
-        hdr.menu = GetWide("menu", headers);
-        hdr.banner = Get("banner", headers);
-        hdr.banner_credits = Get("banner-credits", headers);
-        hdr.comments = Get("comments", headers);
+    static string Dump(const values_t& values) {
+        string out;
+        for (size_t k = 0; k < KEY_COUNT; ++k) {
+            if (!values[k].empty()) {
+                out += "\n  '"s;
+                out += key_names[k];
+                out += "' --> '";
+                out += values[k];
+                out += '\'';
+            }
+        }
+        return out;
+    }
+
+    // key [blanks] ':' [blanks] value
+    void ParseLine(string_view line, values_t& values) {
+        const auto text = TrimLeft(line);
+        if (TrimRight(text).empty() || text.front() == '#') {
+            // Blank line or comment
+            return;
+        }
+
+        size_t len = 0;
+        while (len < text.size() && IsKeyChar(text[len])) {
+            ++len;
+        }
+
+        const auto key = text.substr(0, len);
+        auto rest = TrimLeft(text.substr(len));
+        if (key.empty() || !Expect(rest, ':')) {
+            ParseFailed(line);
+        }
+
+        const auto value = TrimRight(TrimLeft(rest));
+        if (value.empty()) {
+            ParseFailed(line);
+        }
+
+        // The first occurrence of a header wins
+        if (const auto k = Lookup(key); k != KEY_COUNT && values[k].empty()) {
+            values[k] = value;
+        }
+    }
+
+    void Assign(Article::Header& hdr, const values_t& values) {
+
+        hdr.uuid = values[UUID];
+        hdr.title = GetText(TITLE, values);
+        hdr.tags = GetTextList(TAGS, values);
+        hdr.updated = GetTime(UPDATED, values);
+        hdr.abstract = values[ABSTRACT];
+        hdr.tmplte = values[TEMPLATE];
+        hdr.type = values[TYPE];
+        hdr.menu = GetText(MENU, values);
+        hdr.banner = values[BANNER];
+        hdr.banner_credits = values[BANNER_CREDITS];
+        hdr.comments = values[COMMENTS];
         hdr.have_uuid = !hdr.uuid.empty();
         hdr.have_updated = hdr.updated != 0;
         hdr.have_title = !hdr.title.empty();
 
-        if (auto part = Get("part", headers); !part.empty()) {
+        if (const auto part = values[PART]; !part.empty()) {
             try {
-                hdr.part = stoi(part);
+                hdr.part = stoi(string{part});
             } catch(const std::exception& ex) {
                 LOG_WARN << "Failed to cast part: " << part << " to integer.";
             }
         }
 
-        string pri = Get("sitemap-priority", headers);
-        if (!pri.empty()) {
-            hdr.sitemap_priority = stoi(pri);
+        if (const auto pri = values[SITEMAP_PRIORITY]; !pri.empty()) {
+            hdr.sitemap_priority = stoi(string{pri});
         }
-        hdr.sitemap_changefreq = Get("sitemap-changefreq", headers);
+        hdr.sitemap_changefreq = values[SITEMAP_CHANGEFREQ];
 
 
         if (hdr.uuid.empty()) {
             hdr.uuid = CreateUuid();
         }
 
-        auto published = Get("published", headers);
+        const auto published = values[PUBLISHED];
 
         if (!published.empty()) {
             if ((published == "false") || (published == "no")) {
                 hdr.is_published = false;
             } else {
-                hdr.published = GetTime("published", headers);
+                hdr.published = GetTime(PUBLISHED, values);
                 hdr.have_published = true;
             }
         }
 
-        hdr.expires = GetTime("expires", headers);
-        hdr.authors = GetList("authors", headers);
-        auto author = Get("author", headers);
-        if (!author.empty()) {
-            hdr.authors.insert(hdr.authors.begin(), author);
+        hdr.expires = GetTime(EXPIRES, values);
+        hdr.authors = GetList(AUTHORS, values);
+        if (const auto author = values[AUTHOR]; !author.empty()) {
+            hdr.authors.emplace(hdr.authors.begin(), author);
         }
     }
 
-    std::string Get(
-            const std::string& key,
-            const header_map_t& headers) {
-        auto it = headers.find(key);
-        if (it == headers.end()) {
-            return {};
-        }
-
-        return it->second;
+    // Human readable text must be valid UTF-8
+    std::string GetText(Key key, const values_t& values) {
+        const auto value = values[key];
+        ValidateText(key, value);
+        return string{value};
     }
 
-    std::wstring GetWide(
-            const std::string& key,
-            const header_map_t& headers) {
-
-        return converter.from_bytes(Get(key, headers));
-    }
-
-    template <typename Iterator>
-    void parse_list(Iterator first, Iterator last, std::vector<string>& v)
-    {
-        namespace phoenix = boost::phoenix;
-        namespace ascii = boost::spirit::ascii;
-
-        using qi::double_;
-        using qi::phrase_parse;
-        using qi::_1;
-        using ascii::space;
-        using phoenix::push_back;
-
-        qi::rule<Iterator, std::string()> token = +~qi::char_(",");
-
-        bool r = phrase_parse(first, last,
-            (
-                token[push_back(phoenix::ref(v), _1)] % ','
-            )
-            ,
-            space);
-
-        if (first != last) { // fail if we did not get a full match
-            std::string::const_iterator some = first+30;
-            std::string context(first, (some>last)?last:some);
-            LOG_ERROR << "Parsing failed at: << \": " << context << "\"";
+    void ValidateText(Key key, string_view value) {
+        if (!IsValidUtf8(value)) {
+            LOG_ERROR << "The header '" << key_names[key] << "' is not valid UTF-8: " << value;
             throw runtime_error("Parse error");
         }
     }
 
-    std::vector<std::string> GetList(const std::string& key,
-                                      const header_map_t& headers) {
-        auto it = headers.find(key);
-
+    // Comma separated list. Empty elements are not allowed.
+    std::vector<std::string> GetList(Key key, const values_t& values) {
         std::vector<string> list;
+        auto value = values[key];
 
-        if (it != headers.end()) {
-            parse_list(it->second.begin(), it->second.end(), list);
+        if (value.empty()) {
+            return list;
         }
 
-        return list;
-    }
+        while (true) {
+            const auto comma = value.find(',');
+            const auto item = TrimRight(TrimLeft(value.substr(0, comma)));
+            if (item.empty()) {
+                ParseFailed(value);
+            }
+            list.emplace_back(item);
 
-    std::vector<std::wstring> GetWideList(const std::string& key,
-                                          const header_map_t& headers) {
+            if (comma == string_view::npos) {
+                break;
+            }
+            value.remove_prefix(comma + 1);
+        }
 
-        std::vector<std::string> list;
-        list = GetList(key, headers);
+        return list;
+    }
 
-        std::vector<std::wstring> wlist;
+    std::vector<std::string> GetTextList(Key key, const values_t& values) {
+        auto list = GetList(key, values);
         for (const auto &v : list) {
-            wlist.push_back(converter.from_bytes(v));
+            ValidateText(key, v);
         }
 
-        return wlist;
+        return list;
     }
 
-    time_t GetTime( const std::string& key, const header_map_t& headers) {
-        auto value = Get(key, headers);
+    time_t GetTime(Key key, const values_t& values) {
+        const auto value = values[key];
         if (value.empty()) {
             return 0;
         }
 
-        istringstream ss(value);
         tm t = {};
-        ss >> std::get_time(&t, "%Y-%m-%d %H:%M");
-        if (ss.fail()) {
+        if (!ParseDate(value, t)) {
             LOG_ERROR << "Failed to parse date: '" << value << "'";
             throw runtime_error("Parse error");
         }
@@ -244,8 +377,6 @@ private:
         gmtime_r(&local, &t);
         return mktime(&t);
     }
-
-    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
 };
 
 std::unique_ptr<HeaderParser> HeaderParser::Create() {
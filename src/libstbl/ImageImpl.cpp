@@ -3,72 +3,1603 @@
 //#include <boost/gil/image.hpp>
 //#include <boost/gil/typedefs.hpp>
 
+#include <cassert>
+#include <cerrno>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include <jpeglib.h>
+
+#include "stbl/stbl_config.h"
+
+#ifdef STBL_WITH_WEBP
+#   include <webp/decode.h>
+#   include <webp/encode.h>
+#endif
+
+#ifdef STBL_WITH_AVIF
+#   include <avif/avif.h>
+#endif
 
 #include <boost/gil.hpp>
-#include <boost/gil/extension/io/jpeg.hpp>
-#include <boost/gil/extension/numeric/sampler.hpp>
-#include <boost/gil/extension/numeric/resample.hpp>
 
 #include "stbl/stbl.h"
 #include "stbl/Image.h"
+#include "stbl/resample.h"
 #include "stbl/logging.h"
 
 using namespace std;
 using namespace boost::gil;
 
-// Using boost::gil for image processing for now. It takes /forever/ to
-// compile, and the numeric extension is not yet in the boost release branch
-// (as of debian stretch) - but I want to have as few external dependencies as
-// possible.
+// Images are decoded and encoded with libjpeg, so that we can let the
+// decoder do most of the downscaling, and stream the scanlines through
+// the resampler (resample.cpp). boost::gil is only used as a container
+// for images we keep in memory.
 
 namespace stbl {
 
+namespace {
+
+// libjpeg error handler. We can't throw through the C code, so
+// we jump back to the caller, which throws.
+struct JpegErrorMgr {
+    JpegErrorMgr() {
+        jpeg_std_error(&pub);
+        pub.error_exit = OnError;
+        pub.output_message = OnMessage;
+    }
+
+    static void OnError(j_common_ptr cinfo) {
+        auto *err = reinterpret_cast<JpegErrorMgr *>(cinfo->err);
+        (*cinfo->err->format_message)(cinfo, err->message);
+        longjmp(err->jmp, 1);
+    }
+
+    static void OnMessage(j_common_ptr cinfo) {
+        char message[JMSG_LENGTH_MAX];
+        (*cinfo->err->format_message)(cinfo, message);
+        LOG_DEBUG << "libjpeg: " << message;
+    }
+
+    jpeg_error_mgr pub;
+    jmp_buf jmp;
+    char message[JMSG_LENGTH_MAX] = {};
+};
+
+uint32_t GetBe16(const uint8_t *p) noexcept {
+    return (p[0] << 8) | p[1];
+}
+
+uint32_t GetBe32(const uint8_t *p) noexcept {
+    return (GetBe16(p) << 16) | GetBe16(p + 2);
+}
+
+uint32_t GetLe16(const uint8_t *p) noexcept {
+    return p[0] | (p[1] << 8);
+}
+
+uint32_t GetLe32(const uint8_t *p) noexcept {
+    return GetLe16(p) | (GetLe16(p + 2) << 16);
+}
+
+uint32_t GetLe24(const uint8_t *p) noexcept {
+    return GetLe16(p) | (p[2] << 16);
+}
+
+// The metadata we care about in JPEG files. See the EXIF 2.32 and
+// ICC.1:2022 (annex B.4) specifications.
+constexpr string_view exif_id{"Exif\0\0", 6};
+constexpr string_view icc_id{"ICC_PROFILE\0", 12};
+// The ICC profile is split over APP2 markers with a sequence number and a count
+constexpr size_t max_icc_chunk = 65533 - icc_id.size() - 2;
+constexpr uint16_t exif_orientation_tag = 0x0112;
+
+bool HasId(const jpeg_marker_struct& m, int marker, string_view id) noexcept {
+    return m.marker == marker && m.data_length >= id.size()
+        && memcmp(m.data, id.data(), id.size()) == 0;
+}
+
+/* Where the orientation is in an EXIF payload, if it has one
+ *
+ * The orientation is a SHORT in the first IFD, in the byte order of the
+ * TIFF header. Returns the offset of the value, or 0.
+ */
+size_t FindOrientation(const uint8_t *data, size_t size, bool& littleEndian) noexcept {
+    if (size < exif_id.size() + 8 || memcmp(data, exif_id.data(), exif_id.size()) != 0) {
+        return 0;
+    }
+
+    const auto *tiff = data + exif_id.size();
+    const auto len = size - exif_id.size();
+    if (tiff[0] == 'I' && tiff[1] == 'I') {
+        littleEndian = true;
+    } else if (tiff[0] == 'M' && tiff[1] == 'M') {
+        littleEndian = false;
+    } else {
+        return 0;
+    }
+
+    auto get16 = [&](size_t offset) {
+        return littleEndian ? GetLe16(tiff + offset) : GetBe16(tiff + offset);
+    };
+    auto get32 = [&](size_t offset) {
+        return littleEndian ? GetLe32(tiff + offset) : GetBe32(tiff + offset);
+    };
+
+    if (get16(2) != 42) {
+        return 0;
+    }
+    const size_t ifd = get32(4);
+    if (ifd + 2 > len) {
+        return 0;
+    }
+
+    // Entries of 12 bytes: tag, type, count, value
+    const auto entries = get16(ifd);
+    for(size_t i = 0; i < entries; ++i) {
+        const auto entry = ifd + 2 + i * 12;
+        if (entry + 12 > len) {
+            break;
+        }
+        if (get16(entry) == exif_orientation_tag && get16(entry + 2) == 3 /* SHORT */) {
+            return exif_id.size() + entry + 8;
+        }
+    }
+    return 0;
+}
+
+// 1 - 8, as in EXIF. 1 is upright.
+int ReadOrientation(const uint8_t *data, size_t size) noexcept {
+    bool little_endian = false;
+    if (const auto offset = FindOrientation(data, size, little_endian)) {
+        const auto value = little_endian ? GetLe16(data + offset) : GetBe16(data + offset);
+        if (value >= 1 && value <= 8) {
+            return static_cast<int>(value);
+        }
+    }
+    return 1;
+}
+
+// Orientations 5 - 8 swap the width and the height
+bool IsTransposed(int orientation) noexcept {
+    return orientation >= 5;
+}
+
+// An EXIF payload with just the orientation
+vector<uint8_t> MakeOrientationExif(int orientation) {
+    vector<uint8_t> exif{exif_id.begin(), exif_id.end()};
+    const uint8_t tiff[] = {
+        'M', 'M', 0, 42, 0, 0, 0, 8, // Header, and the offset of the IFD
+        0, 1,                        // One entry
+        0x01, 0x12, 0, 3, 0, 0, 0, 1, 0, static_cast<uint8_t>(orientation), 0, 0,
+        0, 0, 0, 0                   // No next IFD
+    };
+    exif.insert(exif.end(), begin(tiff), end(tiff));
+    return exif;
+}
+
+// The ICC profile from the APP2 markers, or empty
+vector<uint8_t> GetIccProfile(jpeg_saved_marker_ptr markers) {
+    map<int, const jpeg_marker_struct *> chunks;
+    int count = 0;
+    for(auto m = markers; m; m = m->next) {
+        if (HasId(*m, JPEG_APP0 + 2, icc_id) && m->data_length > icc_id.size() + 2) {
+            chunks[m->data[icc_id.size()]] = m;
+            count = m->data[icc_id.size() + 1];
+        }
+    }
+
+    vector<uint8_t> profile;
+    if (chunks.empty() || static_cast<int>(chunks.size()) != count
+        || chunks.begin()->first != 1 || chunks.rbegin()->first != count) {
+        return profile;
+    }
+    for(const auto& [seq, m] : chunks) {
+        profile.insert(profile.end(), m->data + icc_id.size() + 2, m->data + m->data_length);
+    }
+    return profile;
+}
+
+// Browsers assume sRGB, so a sRGB profile is just bytes to download.
+// The profile description is ASCII (v2) or UTF-16BE (v4).
+bool IsSrgb(const vector<uint8_t>& profile) noexcept {
+    static constexpr string_view ascii{"sRGB"};
+    static constexpr string_view utf16{"\0s\0R\0G\0B", 8};
+    const string_view data{reinterpret_cast<const char *>(profile.data()), profile.size()};
+    return data.find(ascii) != string_view::npos || data.find(utf16) != string_view::npos;
+}
+
+// The data color space in the profile header. A gray or CMYK profile
+// does not apply to the RGB pixels we decode.
+bool IsRgb(const vector<uint8_t>& profile) noexcept {
+    return profile.size() >= 128 && memcmp(&profile[16], "RGB ", 4) == 0;
+}
+
+/* Decodes a JPEG image into rgb8 scanlines
+ *
+ * libjpeg can scale the image by N/8 (1/8 to 7/8) while it decodes it, by
+ * skipping DCT coefficients. That is a lot cheaper than decoding the full
+ * image and scaling it down afterwards, both in time and memory.
+ *
+ * The EXIF orientation is applied, so the rows are always upright, and
+ * the sizes are those of the upright image. A mirrored image is still
+ * streamed, but a rotated or flipped image has to be decoded into memory
+ * first.
+ */
+class JpegReader
+{
+public:
+    /*! Open a JPEG image and read its header
+     *
+     * \param keepMarkers Keep the APPn and COM markers (EXIF, ICC
+     *      profile, comments ...), so they can be copied to a new image.
+     */
+    JpegReader(const std::filesystem::path& path, bool keepMarkers = false)
+    : path_{path}, file_{fopen(path.c_str(), "rb"), &fclose}
+    {
+        if (!file_) {
+            const auto err = strerror(errno);
+            LOG_ERROR << "IO error. Failed to open " << path << " for read: " << err;
+            throw runtime_error("IO error");
+        }
+
+        cinfo_.err = &jerr_.pub;
+
+        if (setjmp(jerr_.jmp)) {
+            Failed();
+        }
+
+        jpeg_create_decompress(&cinfo_);
+        created_ = true;
+        jpeg_stdio_src(&cinfo_, file_.get());
+        // We always need the EXIF and the ICC profile
+        jpeg_save_markers(&cinfo_, JPEG_APP0 + 1, 0xffff);
+        jpeg_save_markers(&cinfo_, JPEG_APP0 + 2, 0xffff);
+        if (keepMarkers) {
+            jpeg_save_markers(&cinfo_, JPEG_COM, 0xffff);
+            for(int m = 0; m < 16; ++m) {
+                jpeg_save_markers(&cinfo_, JPEG_APP0 + m, 0xffff);
+            }
+        }
+        jpeg_read_header(&cinfo_, TRUE);
+
+        for(auto m = cinfo_.marker_list; m; m = m->next) {
+            if (HasId(*m, JPEG_APP0 + 1, exif_id)) {
+                orientation_ = ReadOrientation(m->data, m->data_length);
+                break;
+            }
+        }
+
+        color_profile_ = GetIccProfile(cinfo_.marker_list);
+        if (IsSrgb(color_profile_)) {
+            color_profile_.clear();
+        }
+    }
+
+    ~JpegReader() {
+        if (created_) {
+            jpeg_destroy_decompress(&cinfo_);
+        }
+    }
+
+    int GetWidth() const noexcept {
+        return static_cast<int>(IsTransposed(orientation_) ? cinfo_.image_height : cinfo_.image_width);
+    }
+
+    int GetHeight() const noexcept {
+        return static_cast<int>(IsTransposed(orientation_) ? cinfo_.image_width : cinfo_.image_height);
+    }
+
+    // Size of the decoded image. Valid after Start()
+    int GetOutputWidth() const noexcept {
+        return static_cast<int>(IsTransposed(orientation_) ? cinfo_.output_height : cinfo_.output_width);
+    }
+
+    int GetOutputHeight() const noexcept {
+        return static_cast<int>(IsTransposed(orientation_) ? cinfo_.output_width : cinfo_.output_height);
+    }
+
+    //! The EXIF orientation of the stored image, 1 - 8
+    int GetOrientation() const noexcept {
+        return orientation_;
+    }
+
+    //! The ICC profile, unless it is sRGB. Empty if there is none.
+    const vector<uint8_t>& GetColorProfile() const noexcept {
+        return color_profile_;
+    }
+
+    /*! Start decoding
+     *
+     * \param minWidth Use the largest DCT scale-down (N/8, down to 1/8)
+     *      that still gives an image at least this wide. 0 to decode at
+     *      full size.
+     */
+    void Start(int minWidth) {
+        if (setjmp(jerr_.jmp)) {
+            Failed();
+        }
+
+        if (cinfo_.jpeg_color_space != JCS_GRAYSCALE) {
+            cinfo_.out_color_space = JCS_RGB;
+        }
+        cinfo_.scale_num = 1;
+        cinfo_.scale_denom = 1;
+        if (minWidth > 0) {
+            // libjpeg before version 7 rounds N/8 up to 1/4, 1/2 or 1/1
+            for(unsigned num = 1; num < 8; ++num) {
+                cinfo_.scale_num = num;
+                cinfo_.scale_denom = 8;
+                jpeg_calc_output_dimensions(&cinfo_);
+                if (GetOutputWidth() >= minWidth) {
+                    break;
+                }
+                cinfo_.scale_num = 1;
+                cinfo_.scale_denom = 1;
+            }
+        }
+
+        jpeg_start_decompress(&cinfo_);
+
+        if (cinfo_.output_components != 3 && cinfo_.output_components != 1) {
+            LOG_ERROR << "Unsupported JPEG color space in " << path_
+                      << " (" << cinfo_.output_components << " components)";
+            throw runtime_error("Unsupported image");
+        }
+
+        LOG_TRACE << "Decoding " << path_ << " (" << GetWidth() << 'x' << GetHeight()
+                  << ") at " << cinfo_.scale_num << '/' << cinfo_.scale_denom << " scale"
+                  << (orientation_ != 1 ? ", orientation " + to_string(orientation_) : ""s);
+
+        if (orientation_ > 2) {
+            // The rows come out in another order than they are stored
+            const auto stride = static_cast<size_t>(cinfo_.output_width) * 3;
+            stored_.resize(stride * cinfo_.output_height);
+            for(size_t y = 0; y < cinfo_.output_height; ++y) {
+                ReadStoredRow(&stored_[y * stride]);
+            }
+        }
+    }
+
+    //! Decode the next upright scanline into row (GetOutputWidth() * 3 bytes)
+    void ReadRow(uint8_t *row) {
+        if (stored_.empty()) {
+            ReadStoredRow(row);
+            if (orientation_ == 2) {
+                // Mirrored
+                const auto width = static_cast<int>(cinfo_.output_width);
+                for(int x = 0; x < width / 2; ++x) {
+                    swap_ranges(row + x * 3, row + x * 3 + 3, row + (width - 1 - x) * 3);
+                }
+            }
+            return;
+        }
+
+        // Position of pixel (x, y) of the upright image in the stored image
+        const int width = static_cast<int>(cinfo_.output_width);
+        const int height = static_cast<int>(cinfo_.output_height);
+        const int y = next_row_++;
+        const auto stride = static_cast<size_t>(width) * 3;
+        auto source = [&](int x) -> const uint8_t * {
+            int sx = 0, sy = 0;
+            switch(orientation_) {
+            case 3: // Rotated 180
+                sx = width - 1 - x;
+                sy = height - 1 - y;
+                break;
+            case 4: // Flipped
+                sx = x;
+                sy = height - 1 - y;
+                break;
+            case 5: // Transposed
+                sx = y;
+                sy = x;
+                break;
+            case 6: // Rotated 90 clockwise to be upright
+                sx = y;
+                sy = height - 1 - x;
+                break;
+            case 7: // Transversed
+                sx = width - 1 - y;
+                sy = height - 1 - x;
+                break;
+            case 8: // Rotated 90 counter-clockwise to be upright
+                sx = width - 1 - y;
+                sy = x;
+                break;
+            }
+            return &stored_[sy * stride + sx * 3];
+        };
+
+        for(int x = 0, count = GetOutputWidth(); x < count; ++x) {
+            memcpy(row + x * 3, source(x), 3);
+        }
+    }
+
+    void Finish() {
+        if (setjmp(jerr_.jmp)) {
+            Failed();
+        }
+
+        jpeg_finish_decompress(&cinfo_);
+    }
+
+    //! Read the DCT coefficients, instead of decoding the image. Not rotated.
+    jvirt_barray_ptr *ReadCoefficients() {
+        if (setjmp(jerr_.jmp)) {
+            Failed();
+        }
+
+        return jpeg_read_coefficients(&cinfo_);
+    }
+
+    //! For JpegWriter
+    jpeg_decompress_struct& GetInfo() noexcept {
+        return cinfo_;
+    }
+
+    //! Decode the image into img
+    void Decode(rgb8_image_t& img, int minWidth) {
+        Start(minWidth);
+
+        img.recreate(GetOutputWidth(), GetOutputHeight());
+        const auto v = view(img);
+        auto *data = interleaved_view_get_raw_data(v);
+        const auto stride = v.pixels().row_size();
+
+        for(int y = 0; y < GetOutputHeight(); ++y) {
+            ReadRow(data + stride * y);
+        }
+
+        Finish();
+    }
+
+private:
+    // Decode the next row, as it is stored
+    void ReadStoredRow(uint8_t *row) {
+        if (setjmp(jerr_.jmp)) {
+            Failed();
+        }
+
+        auto *sample = reinterpret_cast<JSAMPROW>(row);
+        jpeg_read_scanlines(&cinfo_, &sample, 1);
+        if (cinfo_.output_components == 1) {
+            // Expand in place, from the end
+            for(auto x = static_cast<int>(cinfo_.output_width) - 1; x >= 0; --x) {
+                row[x * 3] = row[x * 3 + 1] = row[x * 3 + 2] = row[x];
+            }
+        }
+    }
+
+    [[noreturn]] void Failed() {
+        if (created_) {
+            // The destructor is not called if we are in the constructor
+            jpeg_destroy_decompress(&cinfo_);
+            created_ = false;
+        }
+        LOG_ERROR << "Failed to decode JPEG image " << path_ << ": " << jerr_.message;
+        throw runtime_error("Image decode error");
+    }
+
+    const std::filesystem::path path_;
+    unique_ptr<FILE, decltype(&fclose)> file_;
+    jpeg_decompress_struct cinfo_ = {};
+    JpegErrorMgr jerr_;
+    bool created_ = false;
+    int orientation_ = 1;
+    vector<uint8_t> color_profile_;
+    // The whole image, when it is not upright
+    vector<uint8_t> stored_;
+    int next_row_ = 0;
+};
+
+// A unique name to write path to, before it is renamed. The same image
+// may be written by two threads at the same time.
+std::filesystem::path GetTmpPath(const std::filesystem::path& path) {
+    static atomic<unsigned> counter{0};
+    return path.string() + ".tmp" + to_string(++counter);
+}
+
+// Apply the settings, after jpeg_set_defaults() or jpeg_copy_critical_parameters()
+void ApplySettings(jpeg_compress_struct& cinfo, const JpegSettings& settings, bool lossless) {
+    cinfo.optimize_coding = settings.optimize_coding ? TRUE : FALSE;
+
+    // The sampling factors of the coefficients can't be changed
+    if (!lossless && cinfo.jpeg_color_space == JCS_YCbCr) {
+        auto& luma = cinfo.comp_info[0];
+        switch(settings.subsampling) {
+        case ChromaSubsampling::Yuv420:
+            luma.h_samp_factor = 2;
+            luma.v_samp_factor = 2;
+            break;
+        case ChromaSubsampling::Yuv422:
+            luma.h_samp_factor = 2;
+            luma.v_samp_factor = 1;
+            break;
+        case ChromaSubsampling::Yuv444:
+            luma.h_samp_factor = 1;
+            luma.v_samp_factor = 1;
+            break;
+        }
+    }
+
+    // Last, as the scan script depends on the components
+    if (settings.progressive) {
+        jpeg_simple_progression(&cinfo);
+    }
+}
+
+/* Encodes rgb8 scanlines to a JPEG file
+ *
+ * The image is written to a temporary file, which is renamed to path
+ * by Finish(). An interrupted run can therefore not leave a truncated
+ * image behind, that would later be taken for a valid variant.
+ */
+class JpegWriter
+{
+public:
+    JpegWriter(const std::filesystem::path& path, int width, int height, int quality,
+               const JpegSettings& settings = {})
+    : path_{path}, tmp_path_{GetTmpPath(path)}
+    {
+        Open();
+
+        if (setjmp(jerr_.jmp)) {
+            Failed();
+        }
+
+        cinfo_.image_width = width;
+        cinfo_.image_height = height;
+        cinfo_.input_components = 3;
+        cinfo_.in_color_space = JCS_RGB;
+        jpeg_set_defaults(&cinfo_);
+        jpeg_set_quality(&cinfo_, quality, TRUE);
+        ApplySettings(cinfo_, settings, false);
+        jpeg_start_compress(&cinfo_, TRUE);
+    }
+
+    // Write the coefficients from source, as they are. Call Finish() to complete.
+    JpegWriter(const std::filesystem::path& path, JpegReader& source,
+               const JpegSettings& settings)
+    : path_{path}, tmp_path_{GetTmpPath(path)}
+    {
+        auto *coefficients = source.ReadCoefficients();
+
+        Open();
+
+        if (setjmp(jerr_.jmp)) {
+            Failed();
+        }
+
+        jpeg_copy_critical_parameters(&source.GetInfo(), &cinfo_);
+        ApplySettings(cinfo_, settings, true);
+        jpeg_write_coefficients(&cinfo_, coefficients);
+    }
+
+    ~JpegWriter() {
+        if (created_) {
+            jpeg_destroy_compress(&cinfo_);
+        }
+        if (!done_) {
+            file_.reset();
+            std::error_code ec;
+            std::filesystem::remove(tmp_path_, ec);
+        }
+    }
+
+    //! Encode the next scanline (width * 3 bytes)
+    void WriteRow(const uint8_t *row) {
+        if (setjmp(jerr_.jmp)) {
+            Failed();
+        }
+
+        auto *sample = const_cast<JSAMPROW>(reinterpret_cast<const JSAMPLE *>(row));
+        jpeg_write_scanlines(&cinfo_, &sample, 1);
+    }
+
+    //! Embed an ICC profile. Must be called before the first row.
+    void WriteColorProfile(const vector<uint8_t>& profile) {
+        if (setjmp(jerr_.jmp)) {
+            Failed();
+        }
+
+        const auto chunks = (profile.size() + max_icc_chunk - 1) / max_icc_chunk;
+        for(size_t i = 0; i < chunks; ++i) {
+            const auto offset = i * max_icc_chunk;
+            const auto len = min(max_icc_chunk, profile.size() - offset);
+            jpeg_write_m_header(&cinfo_, JPEG_APP0 + 2,
+                                static_cast<unsigned>(icc_id.size() + 2 + len));
+            for(const auto ch : icc_id) {
+                jpeg_write_m_byte(&cinfo_, ch);
+            }
+            jpeg_write_m_byte(&cinfo_, static_cast<int>(i + 1));
+            jpeg_write_m_byte(&cinfo_, static_cast<int>(chunks));
+            for(size_t j = 0; j < len; ++j) {
+                jpeg_write_m_byte(&cinfo_, profile[offset + j]);
+            }
+        }
+    }
+
+    /*! Copy the metadata from source. Must be called before the first row.
+     *
+     * \param strip Only copy the ICC profile, if it is not sRGB, and the
+     *      orientation. Else copy all the markers the source kept, except
+     *      the JFIF and Adobe markers, which libjpeg writes itself.
+     * \param decoded The rows are decoded from source, so they are upright
+     *      RGB, and the orientation must not be applied again.
+     */
+    void CopyMetadata(JpegReader& source, bool strip, bool decoded) {
+        if (strip) {
+            if (!decoded || IsRgb(source.GetColorProfile())) {
+                WriteColorProfile(source.GetColorProfile());
+            }
+            if (!decoded && source.GetOrientation() != 1) {
+                const auto exif = MakeOrientationExif(source.GetOrientation());
+                WriteMarker(JPEG_APP0 + 1, exif.data(), exif.size());
+            }
+            return;
+        }
+
+        for(auto m = source.GetInfo().marker_list; m; m = m->next) {
+            if (HasId(*m, JPEG_APP0, "JFIF") || HasId(*m, JPEG_APP0 + 14, "Adobe")) {
+                continue;
+            }
+            bool little_endian = false;
+            size_t offset = 0;
+            if (decoded && HasId(*m, JPEG_APP0 + 1, exif_id)
+                && (offset = FindOrientation(m->data, m->data_length, little_endian))) {
+                vector<uint8_t> exif{m->data, m->data + m->data_length};
+                exif[offset] = little_endian ? 1 : 0;
+                exif[offset + 1] = little_endian ? 0 : 1;
+                WriteMarker(m->marker, exif.data(), exif.size());
+                continue;
+            }
+            WriteMarker(m->marker, m->data, m->data_length);
+        }
+    }
+
+    void Finish() {
+        if (setjmp(jerr_.jmp)) {
+            Failed();
+        }
+
+        jpeg_finish_compress(&cinfo_);
+        if (fclose(file_.release()) != 0) {
+            const auto err = strerror(errno);
+            LOG_ERROR << "IO error. Failed to write " << tmp_path_ << ": " << err;
+            throw runtime_error("IO error");
+        }
+        std::filesystem::rename(tmp_path_, path_);
+        done_ = true;
+    }
+
+private:
+    void WriteMarker(int marker, const uint8_t *data, size_t size) {
+        if (setjmp(jerr_.jmp)) {
+            Failed();
+        }
+
+        jpeg_write_marker(&cinfo_, marker, data, static_cast<unsigned>(size));
+    }
+
+    void Open() {
+        file_.reset(fopen(tmp_path_.c_str(), "wb"));
+        if (!file_) {
+            const auto err = strerror(errno);
+            LOG_ERROR << "IO error. Failed to open " << tmp_path_ << " for write: " << err;
+            throw runtime_error("IO error");
+        }
+
+        cinfo_.err = &jerr_.pub;
+
+        if (setjmp(jerr_.jmp)) {
+            Failed();
+        }
+
+        jpeg_create_compress(&cinfo_);
+        created_ = true;
+        jpeg_stdio_dest(&cinfo_, file_.get());
+    }
+
+    [[noreturn]] void Failed() {
+        // The destructor is not called if we are in a constructor
+        if (created_) {
+            jpeg_destroy_compress(&cinfo_);
+            created_ = false;
+        }
+        file_.reset();
+        std::error_code ec;
+        std::filesystem::remove(tmp_path_, ec);
+        LOG_ERROR << "Failed to encode JPEG image " << path_ << ": " << jerr_.message;
+        throw runtime_error("Image encode error");
+    }
+
+    const std::filesystem::path path_;
+    const std::filesystem::path tmp_path_;
+    unique_ptr<FILE, decltype(&fclose)> file_{nullptr, &fclose};
+    jpeg_compress_struct cinfo_ = {};
+    JpegErrorMgr jerr_;
+    bool created_ = false;
+    bool done_ = false;
+};
+
+// Encode an image to JPEG in memory
+string EncodeJpeg(const uint8_t *rgb, int width, int height, ptrdiff_t stride, int quality,
+                  const JpegSettings& settings) {
+    jpeg_compress_struct cinfo = {};
+    JpegErrorMgr jerr;
+    unsigned char *buffer = nullptr;
+    unsigned long size = 0;
+
+    cinfo.err = &jerr.pub;
+    if (setjmp(jerr.jmp)) {
+        jpeg_destroy_compress(&cinfo);
+        free(buffer);
+        LOG_ERROR << "Failed to encode JPEG image: " << jerr.message;
+        throw runtime_error("Image encode error");
+    }
+
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &buffer, &size);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    ApplySettings(cinfo, settings, false);
+    jpeg_start_compress(&cinfo, TRUE);
+    for(int y = 0; y < height; ++y) {
+        auto *row = const_cast<JSAMPROW>(reinterpret_cast<const JSAMPLE *>(rgb + y * stride));
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+
+    string out{reinterpret_cast<const char *>(buffer), size};
+    jpeg_destroy_compress(&cinfo);
+    free(buffer);
+    return out;
+}
+
+// Decode a JPEG image of the given size from memory, into rgb
+void DecodeJpeg(const string& data, uint8_t *rgb, int width, int height, ptrdiff_t stride) {
+    jpeg_decompress_struct cinfo = {};
+    JpegErrorMgr jerr;
+
+    cinfo.err = &jerr.pub;
+    if (setjmp(jerr.jmp)) {
+        jpeg_destroy_decompress(&cinfo);
+        LOG_ERROR << "Failed to decode JPEG image: " << jerr.message;
+        throw runtime_error("Image decode error");
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, reinterpret_cast<const unsigned char *>(data.data()), data.size());
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+    if (static_cast<int>(cinfo.output_width) != width
+        || static_cast<int>(cinfo.output_height) != height) {
+        jpeg_destroy_decompress(&cinfo);
+        LOG_ERROR << "Unexpected size of the decoded JPEG image";
+        throw runtime_error("Image decode error");
+    }
+    while(cinfo.output_scanline < cinfo.output_height) {
+        auto *row = reinterpret_cast<JSAMPROW>(rgb + cinfo.output_scanline * stride);
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+}
+
+// Write an encoded image to a temporary file, and rename it when it is complete
+void SaveEncoded(const std::filesystem::path& path, const uint8_t *data, size_t size) {
+    const auto tmp_path = GetTmpPath(path);
+    unique_ptr<FILE, decltype(&fclose)> file{fopen(tmp_path.c_str(), "wb"), &fclose};
+    if (!file) {
+        const auto err = strerror(errno);
+        LOG_ERROR << "IO error. Failed to open " << tmp_path << " for write: " << err;
+        throw runtime_error("IO error");
+    }
+
+    const bool written = fwrite(data, 1, size, file.get()) == size;
+    if (!written || fclose(file.release()) != 0) {
+        const auto err = strerror(errno);
+        LOG_ERROR << "IO error. Failed to write " << tmp_path << ": " << err;
+        file.reset();
+        std::error_code ec;
+        std::filesystem::remove(tmp_path, ec);
+        throw runtime_error("IO error");
+    }
+
+    std::filesystem::rename(tmp_path, path);
+}
+
+#ifdef STBL_WITH_WEBP
+void SaveWebp(const std::filesystem::path& path, const uint8_t *rgb,
+              const Image::Size& size, int quality) {
+    uint8_t *data = nullptr;
+    const auto bytes = WebPEncodeRGB(rgb, size.width, size.height, size.width * 3,
+                                     static_cast<float>(quality), &data);
+    unique_ptr<uint8_t, decltype(&WebPFree)> output{data, &WebPFree};
+    if (bytes == 0) {
+        LOG_ERROR << "Failed to encode WebP image " << path;
+        throw runtime_error("Image encode error");
+    }
+
+    SaveEncoded(path, output.get(), bytes);
+}
+
+// Encode to WebP and decode again into out. Returns the encoded size.
+size_t RoundtripWebp(const uint8_t *rgb, int width, int height, ptrdiff_t stride, int quality,
+                     uint8_t *out, ptrdiff_t outStride) {
+    uint8_t *data = nullptr;
+    const auto bytes = WebPEncodeRGB(rgb, width, height, static_cast<int>(stride),
+                                     static_cast<float>(quality), &data);
+    unique_ptr<uint8_t, decltype(&WebPFree)> encoded{data, &WebPFree};
+    if (bytes == 0
+        || !WebPDecodeRGBInto(encoded.get(), bytes, out, outStride * height,
+                              static_cast<int>(outStride))) {
+        LOG_ERROR << "Failed to encode and decode a WebP image";
+        throw runtime_error("Image encode error");
+    }
+    return bytes;
+}
+#endif
+
+#ifdef STBL_WITH_AVIF
+void SaveAvif(const std::filesystem::path& path, const uint8_t *rgb,
+              const Image::Size& size, int quality) {
+    auto failed = [&path](const char *what) {
+        LOG_ERROR << "Failed to encode AVIF image " << path << ": " << what;
+        throw runtime_error("Image encode error");
+    };
+
+    unique_ptr<avifImage, decltype(&avifImageDestroy)> image{
+        avifImageCreate(size.width, size.height, 8, AVIF_PIXEL_FORMAT_YUV420),
+        &avifImageDestroy};
+    if (!image) {
+        failed("Out of memory");
+    }
+
+    avifRGBImage pixels;
+    avifRGBImageSetDefaults(&pixels, image.get());
+    pixels.format = AVIF_RGB_FORMAT_RGB;
+    pixels.depth = 8;
+    pixels.pixels = const_cast<uint8_t *>(rgb);
+    pixels.rowBytes = size.width * 3;
+
+    auto result = avifImageRGBToYUV(image.get(), &pixels);
+    if (result != AVIF_RESULT_OK) {
+        failed(avifResultToString(result));
+    }
+
+    unique_ptr<avifEncoder, decltype(&avifEncoderDestroy)> encoder{
+        avifEncoderCreate(), &avifEncoderDestroy};
+    if (!encoder) {
+        failed("Out of memory");
+    }
+    encoder->quality = quality;
+    // The default (slowest) speed takes many seconds for a banner
+    encoder->speed = 6;
+
+    avifRWData output = AVIF_DATA_EMPTY;
+    result = avifEncoderWrite(encoder.get(), image.get(), &output);
+    unique_ptr<avifRWData, decltype(&avifRWDataFree)> release{&output, &avifRWDataFree};
+    if (result != AVIF_RESULT_OK) {
+        failed(avifResultToString(result));
+    }
+
+    SaveEncoded(path, output.data, output.size);
+}
+#endif
+
+// Encode an image we have in memory, as interleaved RGB
+// The profile is the ICC profile of the source. Only JPEG images get it.
+void SaveRgb(const Image::Output& output, const uint8_t *rgb, const Image::Size& size,
+             const vector<uint8_t>& profile) {
+    switch(output.format) {
+    case ImageFormat::Jpeg: {
+        JpegWriter writer{output.path, size.width, size.height, output.quality, output.jpeg};
+        if (IsRgb(profile)) {
+            writer.WriteColorProfile(profile);
+        }
+        const auto stride = static_cast<size_t>(size.width) * 3;
+        for(int y = 0; y < size.height; ++y) {
+            writer.WriteRow(rgb + y * stride);
+        }
+        writer.Finish();
+    } return;
+    case ImageFormat::Webp:
+#ifdef STBL_WITH_WEBP
+        SaveWebp(output.path, rgb, size, output.quality);
+        return;
+#else
+        break;
+#endif
+    case ImageFormat::Avif:
+#ifdef STBL_WITH_AVIF
+        SaveAvif(output.path, rgb, size, output.quality);
+        return;
+#else
+        break;
+#endif
+    }
+
+    LOG_ERROR << "Cannot save " << output.path << ": stbl was built without an encoder for "
+              << GetMimeType(output.format);
+    throw runtime_error("Unsupported image format");
+}
+
+// Search for the quality to encode an image with, as described for QualityTarget.
+// Supported for JPEG, and for WebP if stbl is built with it. For other
+// formats, target.max_quality is returned.
+int FindQuality(const uint8_t *rgb, int width, int height, ptrdiff_t stride,
+                ImageFormat format, const QualityTarget& target, const JpegSettings& jpeg,
+                const std::filesystem::path& path) {
+    const auto out_stride = static_cast<ptrdiff_t>(width) * 3;
+    vector<uint8_t> decoded(out_stride * height);
+    auto *out = decoded.data();
+
+    // Encode at a quality, and decode into decoded. Returns the encoded size.
+    function<size_t (int)> roundtrip;
+    switch(format) {
+    case ImageFormat::Jpeg:
+        roundtrip = [&](int quality) {
+            const auto data = EncodeJpeg(rgb, width, height, stride, quality, jpeg);
+            DecodeJpeg(data, out, width, height, out_stride);
+            return data.size();
+        };
+        break;
+    case ImageFormat::Webp:
+#ifdef STBL_WITH_WEBP
+        roundtrip = [&](int quality) {
+            return RoundtripWebp(rgb, width, height, stride, quality, out, out_stride);
+        };
+#endif
+        break;
+    case ImageFormat::Avif:
+        break;
+    }
+
+    if (!roundtrip || !target.IsEnabled()) {
+        return target.max_quality;
+    }
+
+    struct Result {
+        size_t bytes = 0;
+        double ssim = 0;
+    };
+    map<int, Result> results;
+    auto measure = [&](int quality) -> const Result& {
+        auto [it, added] = results.try_emplace(quality);
+        if (added) {
+            it->second.bytes = roundtrip(quality);
+            if (target.ssim > 0) {
+                it->second.ssim = Ssim(rgb, stride, out, out_stride, width, height);
+            }
+        }
+        return it->second;
+    };
+
+    const auto budget = target.max_bytes_per_pixel * width * height;
+    auto looks_good = [&](int quality) {
+        return measure(quality).ssim >= target.ssim;
+    };
+    auto fits = [&](int quality) {
+        return budget <= 0 || static_cast<double>(measure(quality).bytes) <= budget;
+    };
+
+    // The lowest quality that looks good enough
+    int quality = target.max_quality;
+    if (target.ssim > 0) {
+        int low = target.min_quality, high = target.max_quality;
+        while(low < high) {
+            const auto mid = (low + high) / 2;
+            if (looks_good(mid)) {
+                high = mid;
+            } else {
+                low = mid + 1;
+            }
+        }
+        quality = low;
+    }
+
+    // The byte budget wins. The highest quality that fits.
+    if (!fits(quality)) {
+        int low = target.min_quality, high = quality;
+        while(low < high) {
+            const auto mid = (low + high + 1) / 2;
+            if (fits(mid)) {
+                low = mid;
+            } else {
+                high = mid - 1;
+            }
+        }
+        quality = low;
+    }
+
+    LOG_TRACE << "Found quality " << quality << " for " << GetMimeType(format) << ' '
+              << path << " at " << width << 'x' << height << " in "
+              << results.size() << " steps";
+    return quality;
+}
+
+[[noreturn]] void ProbeFailed(const std::filesystem::path& path, const char *what) {
+    LOG_ERROR << "Failed to get the size of the image " << path << ": " << what;
+    throw runtime_error("Image probe error");
+}
+
+// Walk the markers until we find a start of frame. The size is that of
+// the upright image, as the decoder gives it.
+Image::Size ProbeJpeg(istream& in, const std::filesystem::path& path) {
+    in.seekg(2);
+    uint8_t buf[7];
+    int orientation = 1;
+    while (in) {
+        int marker = in.get();
+        if (marker < 0) {
+            break;
+        }
+        if (marker != 0xFF) {
+            ProbeFailed(path, "Invalid JPEG marker");
+        }
+        // Skip fill bytes
+        do {
+            marker = in.get();
+        } while (marker == 0xFF);
+
+        if (marker < 0) {
+            break;
+        }
+
+        // Markers without a payload
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) {
+            continue;
+        }
+
+        if (marker == 0xD9 || marker == 0xDA) {
+            ProbeFailed(path, "No SOF marker before the image data");
+        }
+
+        if (!in.read(reinterpret_cast<char *>(buf), 2)) {
+            break;
+        }
+        const auto length = GetBe16(buf);
+        if (length < 2) {
+            ProbeFailed(path, "Invalid JPEG segment length");
+        }
+
+        // SOF0 - SOF15, except DHT, JPG and DAC
+        if (marker >= 0xC0 && marker <= 0xCF
+            && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            if (length < 7 || !in.read(reinterpret_cast<char *>(buf), 5)) {
+                break;
+            }
+            // buf[0] is the precision
+            const auto width = static_cast<int>(GetBe16(buf + 3));
+            const auto height = static_cast<int>(GetBe16(buf + 1));
+            if (IsTransposed(orientation)) {
+                return {height, width};
+            }
+            return {width, height};
+        }
+
+        if (marker == JPEG_APP0 + 1 && orientation == 1) {
+            // The orientation is near the start of the EXIF data
+            vector<uint8_t> exif(min<size_t>(length - 2, 4096));
+            if (!in.read(reinterpret_cast<char *>(exif.data()), exif.size())) {
+                break;
+            }
+            orientation = ReadOrientation(exif.data(), exif.size());
+            in.seekg(length - 2 - exif.size(), ios_base::cur);
+            continue;
+        }
+
+        in.seekg(length - 2, ios_base::cur);
+    }
+
+    ProbeFailed(path, "Truncated JPEG file");
+}
+
+Image::Size ProbeWebp(istream& in, const std::filesystem::path& path) {
+    // "RIFF" size "WEBP", then the first chunk
+    uint8_t buf[30];
+    if (!in.read(reinterpret_cast<char *>(buf), sizeof(buf))) {
+        ProbeFailed(path, "Truncated WebP file");
+    }
+
+    const string_view chunk{reinterpret_cast<const char *>(buf + 12), 4};
+    const uint8_t *data = buf + 20;
+    if (chunk == "VP8 ") {
+        // Frame tag (3 bytes) and start code (3 bytes), then 14 bit sizes
+        if (data[3] != 0x9D || data[4] != 0x01 || data[5] != 0x2A) {
+            ProbeFailed(path, "Invalid VP8 start code");
+        }
+        return {static_cast<int>(GetLe16(data + 6) & 0x3FFF),
+                static_cast<int>(GetLe16(data + 8) & 0x3FFF)};
+    }
+
+    if (chunk == "VP8L") {
+        if (data[0] != 0x2F) {
+            ProbeFailed(path, "Invalid VP8L signature");
+        }
+        const uint32_t bits = data[1] | (data[2] << 8) | (data[3] << 16)
+            | (static_cast<uint32_t>(data[4]) << 24);
+        return {static_cast<int>((bits & 0x3FFF) + 1),
+                static_cast<int>(((bits >> 14) & 0x3FFF) + 1)};
+    }
+
+    if (chunk == "VP8X") {
+        // Flags (4 bytes), then 24 bit canvas size - 1
+        return {static_cast<int>(GetLe24(data + 4) + 1),
+                static_cast<int>(GetLe24(data + 7) + 1)};
+    }
+
+    ProbeFailed(path, "Unknown WebP chunk");
+}
+
+} // anonymous ns
+
+Image::Size Image::Probe(const std::filesystem::path& path) {
+    std::ifstream in(path, ios_base::in | ios_base::binary);
+    if (!in) {
+        const auto err = strerror(errno);
+        LOG_ERROR << "IO error. Failed to open " << path << " for read: " << err;
+        throw runtime_error("IO error");
+    }
+
+    uint8_t sig[24] = {};
+    in.read(reinterpret_cast<char *>(sig), sizeof(sig));
+    const auto bytes = in.gcount();
+    in.clear();
+
+    if (bytes >= 2 && sig[0] == 0xFF && sig[1] == 0xD8) {
+        return ProbeJpeg(in, path);
+    }
+
+    // Signature, then the IHDR chunk with the width and height
+    static constexpr uint8_t png_sig[] = {0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A};
+    if (bytes >= 24 && memcmp(sig, png_sig, sizeof(png_sig)) == 0) {
+        if (memcmp(sig + 12, "IHDR", 4) != 0) {
+            ProbeFailed(path, "Missing PNG IHDR chunk");
+        }
+        return {static_cast<int>(GetBe32(sig + 16)), static_cast<int>(GetBe32(sig + 20))};
+    }
+
+    if (bytes >= 12 && memcmp(sig, "RIFF", 4) == 0 && memcmp(sig + 8, "WEBP", 4) == 0) {
+        in.seekg(0);
+        return ProbeWebp(in, path);
+    }
+
+    ProbeFailed(path, "Unknown image format");
+}
+
 class ImageImpl : public Image {
 public:
 
-    ImageImpl(const std::filesystem::path& path)
+    ImageImpl(const std::filesystem::path& path, int minWidth)
     : path_{path}
     {
-        boost::gil::read_image(path.c_str(), img_, boost::gil::jpeg_tag{});
+        JpegReader reader{path};
+        width_ = reader.GetWidth();
+        height_ = reader.GetHeight();
+        reader.Decode(img_, minWidth);
+    }
+
+    // A scaled image
+    ImageImpl(rgb8_image_t&& img, const std::filesystem::path& origin)
+    : img_{std::move(img)}, width_{static_cast<int>(img_.width())}
+    , height_{static_cast<int>(img_.height())}, path_{origin}
+    {
+    }
+
+    // The aspect ratio is from the original, as the decoded image
+    // may be a little off due to rounding in the DCT scaling.
+    Size GetScaledSize(int width) const override {
+        return ScaledSize({width_, height_}, width);
     }
 
-    Size ScaleAndSave(const std::filesystem::path& path,
-                      int width,
-                      int quality) override {
+    unique_ptr<Image> Scale(const Size& size, ResampleFilter filter) const override {
         const auto w = img_.width();
         const auto h = img_.height();
-        double rw = static_cast<double>(w) / static_cast<double>(width);
-        const int height = static_cast<int>(static_cast<double>(h) / rw);
-        rgb8_image_t area(width, height);
+        rgb8_image_t area(size.width, size.height);
         LOG_TRACE << "Scaling image " << path_
             << " from " << w << 'x' << h
-            << " to " << width << 'x' << height
-            << " in " << path;
-        boost::gil::resize_view(const_view(img_), view(area), bilinear_sampler());
-        boost::gil::write_view(path.c_str(), boost::gil::const_view(area), boost::gil::jpeg_tag{});
+            << " to " << size.width << 'x' << size.height;
+
+        const auto src = const_view(img_);
+        const auto dst = view(area);
+        Resample(interleaved_view_get_raw_data(src), w, h, src.pixels().row_size(),
+                 interleaved_view_get_raw_data(dst), size.width, size.height,
+                 dst.pixels().row_size(), filter);
+
+        return make_unique<ImageImpl>(std::move(area), path_);
+    }
+
+    string ToJpeg(int quality) const override {
+        const auto v = const_view(img_);
+        // Baseline: the scans of a progressive image are a large part of a tiny file
+        JpegSettings settings;
+        settings.progressive = false;
+        return EncodeJpeg(interleaved_view_get_raw_data(v), static_cast<int>(img_.width()),
+                          static_cast<int>(img_.height()), v.pixels().row_size(), quality,
+                          settings);
+    }
+
+
+    uint32_t GetDominantColor() const override {
+        // Histogram with 4 bits per channel. The color is the average
+        // of the pixels in the largest bucket.
+        struct Bucket {
+            uint32_t count = 0;
+            array<uint32_t, 3> sum = {};
+        };
+        vector<Bucket> buckets(4096);
+
+        const auto v = const_view(img_);
+        for(int y = 0; y < v.height(); ++y) {
+            for(auto it = v.row_begin(y); it != v.row_end(y); ++it) {
+                const uint8_t r = (*it)[0], g = (*it)[1], b = (*it)[2];
+                auto& bucket = buckets[((r >> 4) << 8) | ((g >> 4) << 4) | (b >> 4)];
+                ++bucket.count;
+                bucket.sum[0] += r;
+                bucket.sum[1] += g;
+                bucket.sum[2] += b;
+            }
+        }
+
+        const auto& best = *max_element(buckets.begin(), buckets.end(), [](const auto& a, const auto& b) {
+            return a.count < b.count;
+        });
+        if (!best.count) {
+            return 0;
+        }
 
-        Size s;
-        s.width = area.width();
-        s.height = area.height();
-        return s;
+        uint32_t color = 0;
+        for(const auto sum : best.sum) {
+            color = (color << 8) | ((sum + best.count / 2) / best.count);
+        }
+        return color;
     }
 
     int GetWidth() const override {
-        return img_.width();
+        return width_;
     }
 
     int GetHeight() const override {
-        return img_.height();
+        return height_;
     }
 
 private:
+    // Possibly decoded at a reduced scale
     boost::gil::rgb8_image_t img_;
+    // Size of the original image
+    int width_ = 0;
+    int height_ = 0;
     const std::filesystem::path path_;
 };
 
-unique_ptr<Image> Image::Create(const std::filesystem::path& path) {
-    return make_unique<ImageImpl>(path);
+unique_ptr<Image> Image::Create(const std::filesystem::path& path, int minWidth) {
+    return make_unique<ImageImpl>(path, minWidth);
+}
+
+Image::Size Image::ScaledSize(const Size& original, int width) {
+    double rw = static_cast<double>(original.width) / static_cast<double>(width);
+    const int height = max(1, static_cast<int>(static_cast<double>(original.height) / rw));
+    return {width, height};
+}
+
+namespace {
+
+// Only feed a variant from one that is at least this many times larger.
+// Smaller steps add up to visible softening. tests/stbl_image_cascade.cpp
+// checks that the cascaded variants are close to directly scaled ones.
+constexpr int cascade_factor = 2;
+
+// A step in the pipeline in Image::MakeVariants()
+struct VariantNode {
+    Image::Variant *variant = nullptr;
+    // The JPEG output is encoded as the rows arrive, if we know its quality
+    unique_ptr<JpegWriter> writer;
+    // The other outputs are encoded from pixels when we have all the rows
+    vector<Image::Output *> buffered;
+    // Empty if the variant has the size of the source
+    unique_ptr<RowResampler> resampler;
+    // Fed with our output rows
+    vector<VariantNode *> children;
+    // The output, for the buffered outputs
+    vector<uint8_t> pixels;
+    int next_row = 0;
+
+    void Push(const uint8_t *row) {
+        if (resampler) {
+            resampler->Push(row);
+        } else {
+            Emit(row, next_row++);
+        }
+    }
+
+    void Emit(const uint8_t *row, int y) {
+        if (writer) {
+            writer->WriteRow(row);
+        }
+        if (!pixels.empty()) {
+            const auto stride = static_cast<size_t>(variant->size.width) * 3;
+            memcpy(&pixels[y * stride], row, stride);
+        }
+        for(auto *child : children) {
+            child->Push(row);
+        }
+    }
+
+    // Log name
+    const std::filesystem::path& GetPath() const noexcept {
+        return variant->outputs.front().path;
+    }
+};
+
+} // anonymous ns
+
+bool ToImageFormat(std::string_view name, ImageFormat& format) noexcept {
+    if (name == "jpeg" || name == "jpg") {
+        format = ImageFormat::Jpeg;
+    } else if (name == "webp") {
+        format = ImageFormat::Webp;
+    } else if (name == "avif") {
+        format = ImageFormat::Avif;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+std::string_view GetMimeType(ImageFormat format) noexcept {
+    switch(format) {
+    case ImageFormat::Jpeg:
+        return "image/jpeg";
+    case ImageFormat::Webp:
+        return "image/webp";
+    case ImageFormat::Avif:
+        return "image/avif";
+    }
+    return {};
+}
+
+std::string ToHexColor(uint32_t color) {
+    char buffer[8];
+    snprintf(buffer, sizeof(buffer), "#%06x", color & 0xffffff);
+    return buffer;
+}
+
+std::string_view GetExtension(ImageFormat format) noexcept {
+    switch(format) {
+    case ImageFormat::Jpeg:
+        return ".jpg";
+    case ImageFormat::Webp:
+        return ".webp";
+    case ImageFormat::Avif:
+        return ".avif";
+    }
+    return {};
+}
+
+bool ToChromaSubsampling(std::string_view name, ChromaSubsampling& subsampling) noexcept {
+    if (name == "4:2:0") {
+        subsampling = ChromaSubsampling::Yuv420;
+    } else if (name == "4:2:2") {
+        subsampling = ChromaSubsampling::Yuv422;
+    } else if (name == "4:4:4") {
+        subsampling = ChromaSubsampling::Yuv444;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+std::uintmax_t Image::Recompress(const std::filesystem::path& path,
+                                 const std::filesystem::path& dst,
+                                 int quality,
+                                 const JpegSettings& jpeg) {
+    const auto bytes = std::filesystem::file_size(path);
+    const bool keep_markers = !jpeg.strip_metadata;
+
+    if (quality > 0) {
+        // Streamed, one scanline at the time. Images in other color
+        // spaces than RGB and grayscale (like CMYK) can't be decoded.
+        bool encoded = false;
+        {
+            JpegReader reader{path, keep_markers};
+            const auto components = reader.GetInfo().num_components;
+            if (components == 1 || components == 3) {
+                reader.Start(0);
+                JpegWriter writer{dst, reader.GetOutputWidth(), reader.GetOutputHeight(),
+                                  quality, jpeg};
+                writer.CopyMetadata(reader, jpeg.strip_metadata, true);
+                vector<uint8_t> row(static_cast<size_t>(reader.GetOutputWidth()) * 3);
+                for(int y = 0; y < reader.GetOutputHeight(); ++y) {
+                    reader.ReadRow(row.data());
+                    writer.WriteRow(row.data());
+                }
+                writer.Finish();
+                reader.Finish();
+                encoded = true;
+            }
+        }
+
+        if (encoded) {
+            if (const auto size = std::filesystem::file_size(dst); size < bytes) {
+                LOG_TRACE << "Recompressed " << path << " from " << bytes << " to " << size
+                          << " bytes at quality " << quality;
+                return size;
+            }
+            LOG_DEBUG << "Encoding " << path << " at quality " << quality
+                      << " does not make it smaller. Recompressing it losslessly.";
+        }
+    }
+
+    {
+        JpegReader reader{path, keep_markers};
+        JpegWriter writer{dst, reader, jpeg};
+        // The coefficients are copied as they are, so the viewer must still
+        // apply the orientation.
+        writer.CopyMetadata(reader, jpeg.strip_metadata, false);
+        writer.Finish();
+        reader.Finish();
+    }
+
+    const auto size = std::filesystem::file_size(dst);
+    if (size >= bytes && keep_markers) {
+        LOG_DEBUG << "Recompressing " << path << " does not make it smaller. Using it as it is.";
+        std::filesystem::copy_file(path, dst, std::filesystem::copy_options::overwrite_existing);
+        return bytes;
+    }
+
+    LOG_TRACE << "Recompressed " << path << " losslessly from " << bytes << " to "
+              << size << " bytes";
+    return size;
+}
+
+bool Image::CanEncode(ImageFormat format) noexcept {
+    switch(format) {
+    case ImageFormat::Jpeg:
+        return true;
+    case ImageFormat::Webp:
+#ifdef STBL_WITH_WEBP
+        return true;
+#else
+        return false;
+#endif
+    case ImageFormat::Avif:
+#ifdef STBL_WITH_AVIF
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+void Image::MakeVariants(const std::filesystem::path& path,
+                         std::vector<Variant>& variants,
+                         ResampleFilter filter) {
+    if (variants.empty()) {
+        return;
+    }
+
+    // Largest first, so that the smaller ones can be fed from a larger one
+    vector<Variant *> sorted;
+    for(auto& v : variants) {
+        sorted.push_back(&v);
+    }
+    sort(sorted.begin(), sorted.end(), [](const auto *left, const auto *right) {
+        return left->size.width > right->size.width;
+    });
+
+    JpegReader reader{path};
+    reader.Start(sorted.front()->size.width);
+    const Size source{reader.GetOutputWidth(), reader.GetOutputHeight()};
+
+    // The pointers must be stable, so we reserve room for all the nodes
+    vector<VariantNode> nodes;
+    nodes.reserve(variants.size());
+    vector<VariantNode *> roots;
+
+    auto add_resampler = [&](VariantNode& node, const Size& from) {
+        const auto& to = node.variant->size;
+        if (from.width == to.width && from.height == to.height) {
+            return;
+        }
+        node.resampler = RowResampler::Create(
+            from.width, from.height, to.width, to.height, filter,
+            [&node](const uint8_t *row, int y) {
+                node.Emit(row, y);
+            });
+    };
+
+    for(auto *vp : sorted) {
+        auto& v = *vp;
+        assert(!v.outputs.empty());
+
+        // The smallest variant so far that is large enough
+        VariantNode *parent = nullptr;
+        for(auto i = nodes.size(); i > 0; --i) {
+            auto& candidate = nodes[i - 1];
+            if (candidate.variant->size.width >= v.size.width * cascade_factor) {
+                parent = &candidate;
+                break;
+            }
+        }
+
+        auto& node = nodes.emplace_back();
+        node.variant = &v;
+        for(auto& output : v.outputs) {
+            if (output.format == ImageFormat::Jpeg && output.quality && !node.writer) {
+                node.writer = make_unique<JpegWriter>(output.path, v.size.width,
+                                                      v.size.height, output.quality,
+                                                      output.jpeg);
+                if (IsRgb(reader.GetColorProfile())) {
+                    node.writer->WriteColorProfile(reader.GetColorProfile());
+                }
+            } else {
+                node.buffered.push_back(&output);
+            }
+        }
+        if (!node.buffered.empty()) {
+            node.pixels.resize(static_cast<size_t>(v.size.width) * v.size.height * 3);
+        }
+        add_resampler(node, parent ? parent->variant->size : source);
+
+        LOG_TRACE << "Scaling image " << path << " to " << v.size.width << 'x' << v.size.height
+                  << " in " << node.GetPath() << " from "
+                  << (parent ? parent->GetPath() : path);
+
+        if (parent) {
+            parent->children.push_back(&node);
+        } else {
+            roots.push_back(&node);
+        }
+    }
+
+    // Each decoded scanline goes through the pipeline, and the memory
+    // use is bounded by the widths of the images.
+    vector<uint8_t> row(static_cast<size_t>(source.width) * 3);
+    for(int y = 0; y < source.height; ++y) {
+        reader.ReadRow(row.data());
+        for(auto *node : roots) {
+            node->Push(row.data());
+        }
+    }
+    reader.Finish();
+
+    for(auto& node : nodes) {
+        if (node.writer) {
+            node.writer->Finish();
+        }
+
+        const auto& size = node.variant->size;
+        for(auto *output : node.buffered) {
+            if (!output->quality) {
+                output->quality = FindQuality(node.pixels.data(), size.width, size.height,
+                                              static_cast<ptrdiff_t>(size.width) * 3,
+                                              output->format, output->target, output->jpeg,
+                                              output->path);
+            }
+            SaveRgb(*output, node.pixels.data(), size, reader.GetColorProfile());
+        }
+    }
 }
 
 }
@@ -0,0 +1,217 @@
+
+#include <array>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+#include <boost/property_tree/info_parser.hpp>
+
+#include "stbl/ImageIndex.h"
+#include "stbl/logging.h"
+#include "stbl/utility.h"
+
+using namespace std;
+namespace pt = boost::property_tree;
+
+namespace stbl {
+
+namespace {
+
+// Bump when the meaning of the fields changes
+constexpr int index_version = 3;
+
+// 64 bit FNV-1a. Only used to recognize a file we have seen before.
+uint64_t HashFile(const std::filesystem::path& path) {
+    ifstream in{path, ios::in | ios::binary};
+    if (!in) {
+        LOG_ERROR << "IO error. Failed to open " << path << " for read";
+        throw runtime_error("IO error");
+    }
+
+    uint64_t hash = 14695981039346656037ULL;
+    array<char, 64 * 1024> buffer;
+    while(in) {
+        in.read(buffer.data(), buffer.size());
+        const auto len = static_cast<size_t>(in.gcount());
+        for(size_t i = 0; i < len; ++i) {
+            hash ^= static_cast<uint8_t>(buffer[i]);
+            hash *= 1099511628211ULL;
+        }
+    }
+
+    if (in.bad()) {
+        LOG_ERROR << "IO error. Failed to read " << path;
+        throw runtime_error("IO error");
+    }
+
+    return hash;
+}
+
+int64_t GetMtime(const std::filesystem::path& path) {
+    return std::filesystem::last_write_time(path).time_since_epoch().count();
+}
+
+uint32_t FromColor(const string& color) {
+    if (color.size() != 7 || color[0] != '#') {
+        return 0;
+    }
+    return static_cast<uint32_t>(stoul(color.substr(1), nullptr, 16));
+}
+
+string ToName(ImageFormat format) {
+    return string{GetExtension(format).substr(1)};
+}
+
+} // anonymous ns
+
+class ImageIndexImpl : public ImageIndex
+{
+public:
+    ImageIndexImpl(const std::filesystem::path& root, const std::filesystem::path& file)
+    : root_{root}, file_{file}
+    {
+        if (!file_.empty() && std::filesystem::is_regular_file(file_)) {
+            try {
+                Load();
+            } catch(const exception& ex) {
+                LOG_WARN << "Failed to load the image index " << file_ << ": " << ex.what()
+                         << ". The image information will be rebuilt.";
+                entries_.clear();
+            }
+        }
+    }
+
+    const Entry *Lookup(const std::filesystem::path& path) override {
+        auto it = entries_.find(GetKey(path));
+        if (it == entries_.end()) {
+            return nullptr;
+        }
+
+        auto& entry = it->second;
+        std::error_code ec;
+        const auto bytes = std::filesystem::file_size(path, ec);
+        if (ec || bytes != entry.bytes) {
+            return nullptr;
+        }
+
+        if (const auto mtime = GetMtime(path); mtime != entry.mtime) {
+            // Touched, for example by a checkout. Check the content.
+            if (HashFile(path) != entry.hash) {
+                return nullptr;
+            }
+            entry.mtime = mtime;
+            dirty_ = true;
+        }
+
+        return &entry;
+    }
+
+    const Entry& Update(const std::filesystem::path& path, Entry entry) override {
+        entry.bytes = std::filesystem::file_size(path);
+        entry.mtime = GetMtime(path);
+        entry.hash = HashFile(path);
+        dirty_ = true;
+
+        auto& e = entries_[GetKey(path)];
+        e = move(entry);
+        return e;
+    }
+
+    void Save() override {
+        if (!dirty_ || file_.empty()) {
+            return;
+        }
+
+        LOG_TRACE << "Saving the image index: " << file_;
+
+        pt::ptree root;
+        root.put("version", index_version);
+        auto& images = root.put_child("images", {});
+        for(const auto& [key, e] : entries_) {
+            pt::ptree node;
+            node.put("path", key);
+            node.put("hash", e.hash);
+            node.put("bytes", e.bytes);
+            node.put("mtime", e.mtime);
+            node.put("width", e.size.width);
+            node.put("height", e.size.height);
+            node.put("color", ToHexColor(e.dominant_color));
+            node.put("placeholder", e.placeholder);
+            node.put("settings", e.settings);
+            auto& variants = node.put_child("variants", {});
+            for(const auto& v : e.variants) {
+                pt::ptree vnode;
+                vnode.put("format", ToName(v.format));
+                vnode.put("path", v.relative_path);
+                vnode.put("width", v.size.width);
+                vnode.put("height", v.size.height);
+                vnode.put("bytes", v.bytes);
+                vnode.put("quality", v.quality);
+                variants.add_child("variant", vnode);
+            }
+            images.add_child("image", node);
+        }
+
+        ostringstream out;
+        pt::write_info(out, root);
+        stbl::Save(file_, out.str(), true);
+        dirty_ = false;
+    }
+
+private:
+    void Load() {
+        LOG_TRACE << "Loading the image index: " << file_;
+
+        const auto root = LoadProperties(file_);
+        if (root.get<int>("version", 0) != index_version) {
+            LOG_DEBUG << "The image index " << file_ << " is from another version of stbl.";
+            return;
+        }
+
+        for(const auto& [name, node] : root.get_child("images", {})) {
+            Entry e;
+            e.hash = node.get<uint64_t>("hash");
+            e.bytes = node.get<uintmax_t>("bytes");
+            e.mtime = node.get<int64_t>("mtime");
+            e.size.width = node.get<int>("width");
+            e.size.height = node.get<int>("height");
+            e.dominant_color = FromColor(node.get<string>("color", {}));
+            e.placeholder = node.get<string>("placeholder", {});
+            e.settings = node.get<string>("settings", {});
+            for(const auto& [vname, vnode] : node.get_child("variants", {})) {
+                Variant v;
+                if (!ToImageFormat(vnode.get<string>("format"), v.format)) {
+                    throw runtime_error("Unknown image format");
+                }
+                v.relative_path = vnode.get<string>("path");
+                v.size.width = vnode.get<int>("width");
+                v.size.height = vnode.get<int>("height");
+                v.bytes = vnode.get<uintmax_t>("bytes");
+                v.quality = vnode.get<int>("quality", 0);
+                e.variants.push_back(move(v));
+            }
+            entries_[node.get<string>("path")] = move(e);
+        }
+
+        LOG_DEBUG << "Loaded " << entries_.size() << " images from the image index.";
+    }
+
+    string GetKey(const std::filesystem::path& path) const {
+        if (root_.empty()) {
+            return path.generic_string();
+        }
+        return path.lexically_relative(root_).generic_string();
+    }
+
+    const std::filesystem::path root_;
+    const std::filesystem::path file_;
+    map<string, Entry> entries_;
+    bool dirty_ = false;
+};
+
+std::unique_ptr<ImageIndex> ImageIndex::Create(const std::filesystem::path& root,
+                                               const std::filesystem::path& file) {
+    return make_unique<ImageIndexImpl>(root, file);
+}
+
+}
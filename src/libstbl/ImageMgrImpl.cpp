@@ -1,6 +1,18 @@
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <utility>
+#include <vector>
+
 #include "stbl/stbl.h"
 #include "stbl/ImageMgr.h"
+#include "stbl/ImageIndex.h"
 #include "stbl/logging.h"
 #include "stbl/utility.h"
 
@@ -9,70 +21,474 @@ using namespace std::string_literals;
 
 namespace stbl {
 
+namespace {
+
+// The placeholder is scaled up by the browser, which blurs it
+constexpr int placeholder_width = 16;
+constexpr int placeholder_quality = 40;
+
+} // anonymous ns
+
 class ImageMgrImpl : public ImageMgr
 {
 public:
-    ImageMgrImpl(const widths_t& widths, int quality)
-    : widths_{widths}, quality_{quality}
+    ImageMgrImpl(const widths_t& widths, int quality, const JpegSettings& jpeg,
+                 ResampleFilter filter,
+                 const encodings_t& alternatives,
+                 const std::filesystem::path& root,
+                 const std::filesystem::path& indexFile,
+                 bool placeholders,
+                 const QualityTarget& target)
+    : widths_{widths}, quality_{quality}, jpeg_{jpeg}, filter_{filter}, root_{root}
+    , placeholders_{placeholders}, target_{target}
+    , index_{ImageIndex::Create(root, indexFile)}
     {
+        for(const auto& a : alternatives) {
+            if (a.format == ImageFormat::Jpeg) {
+                continue; // Always made
+            }
+            if (!Image::CanEncode(a.format)) {
+                LOG_WARN << "stbl is built without support for " << GetMimeType(a.format)
+                         << ". No such banner images will be made.";
+                continue;
+            }
+            alternatives_.push_back(a);
+        }
+
+        // An index entry made with other settings is not used
+        ostringstream settings;
+        settings << "widths";
+        for(const auto w : widths_) {
+            settings << ' ' << w;
+        }
+        settings << "; quality " << quality_ << "; filter " << static_cast<int>(filter_)
+                 << "; jpeg " << jpeg_.progressive << jpeg_.optimize_coding
+                 << static_cast<int>(jpeg_.subsampling);
+        for(const auto& a : alternatives_) {
+            settings << "; " << GetMimeType(a.format) << ' ' << a.quality;
+        }
+        if (placeholders_) {
+            settings << "; placeholder " << placeholder_width << ' ' << placeholder_quality;
+        }
+        if (target_.IsEnabled()) {
+            settings << "; target " << target_.ssim << ' ' << target_.max_bytes_per_pixel
+                     << ' ' << target_.min_quality;
+        }
+        settings_ = settings.str();
     }
 
-    images_t Prepare(const std::filesystem::path & path) override {
-        images_t images;
-        static const string scale_dir{"_scale_"};
+    ~ImageMgrImpl() {
+        {
+            lock_guard<mutex> lock{mutex_};
+            // Images that are not started yet are made in the next run
+            jobs_.clear();
+            done_ = true;
+        }
+        work_cv_.notify_all();
+        for(auto& worker : workers_) {
+            worker.join();
+        }
+    }
 
-        auto image = Image::Create(path);
-        int largest_width = 0;
-
-        for (auto w = widths_.cbegin(); w != widths_.cend(); ++w) {
-            if (*w >= image->GetWidth()) {
-                if (largest_width < image->GetWidth()) {
-                    // Use the original image
-                    ImageInfo ii;
-                    ii.relative_path = "images/"s + path.filename().string();
-                    ii.size.width = image->GetWidth();
-                    ii.size.height = image->GetHeight();
-                    images.push_back(move(ii));
+    Source Prepare(const std::filesystem::path & path) override {
+        const auto key = path.generic_string();
+        // The qualities found for the unchanged image, by relative path
+        map<string, int> known;
+        // Without an entry for the unchanged image, the variants on disk may be
+        // from another version of it
+        bool unchanged = false;
+        {
+            lock_guard<mutex> lock{mutex_};
+            if (auto it = sources_.find(key); it != sources_.end()) {
+                return it->second;
+            }
+
+            if (const auto *entry = index_->Lookup(path)) {
+                unchanged = true;
+                if (entry->settings == settings_) {
+                    if (HasVariants(*entry)) {
+                        LOG_TRACE << "Using the image index for " << path;
+                        return sources_[key] = ToSource(*entry);
+                    }
+                    for(const auto& v : entry->variants) {
+                        if (v.quality > 0) {
+                            known[v.relative_path] = v.quality;
+                        }
+                    }
+                }
+            }
+        }
+
+        // The sizes are known from the headers, so the html can be
+        // rendered while the variants are made.
+        vector<Image::Variant> variants;
+        vector<Slot> slots;
+        auto source = Plan(path, variants, slots, known, unchanged);
+        {
+            lock_guard<mutex> lock{mutex_};
+            sources_[key] = source;
+        }
+
+        Post([this, path, key, source, variants = move(variants),
+              slots = move(slots)]() mutable {
+            Make(path, source, move(variants), slots);
+            lock_guard<mutex> lock{mutex_};
+            index_->Update(path, ToEntry(source));
+            sources_[key] = move(source);
+        });
+
+        return source;
+    }
+
+    void PrepareOriginal(const std::filesystem::path& image,
+                         const std::filesystem::path& dst,
+                         int quality) override {
+        std::error_code ec;
+        const auto made = std::filesystem::last_write_time(dst, ec);
+        if (!ec && made > std::filesystem::last_write_time(image)) {
+            LOG_TRACE << "The recompressed image " << dst << " is up to date.";
+            return;
+        }
+
+        CreateDirectoryForFile(dst);
+        Post([this, image, dst, quality] {
+            try {
+                Image::Recompress(image, dst, quality, jpeg_);
+            } catch(const exception& ex) {
+                LOG_WARN << "Failed to recompress " << image << ": " << ex.what();
+                std::error_code ec;
+                std::filesystem::remove(dst, ec);
+            }
+        });
+    }
+
+    void Wait() override {
+        unique_lock<mutex> lock{mutex_};
+        idle_cv_.wait(lock, [this] {
+            return jobs_.empty() && active_ == 0;
+        });
+
+        if (error_) {
+            rethrow_exception(exchange(error_, nullptr));
+        }
+    }
+
+    void SaveIndex() override {
+        Wait();
+        lock_guard<mutex> lock{mutex_};
+        index_->Save();
+    }
+
+private:
+    void Post(function<void ()> job) {
+        {
+            lock_guard<mutex> lock{mutex_};
+            if (workers_.empty()) {
+                // Each image is made by one thread
+                const auto count = max(1u, thread::hardware_concurrency());
+                for(unsigned i = 0; i < count; ++i) {
+                    workers_.emplace_back([this] {
+                        Work();
+                    });
                 }
-                break;
             }
+            jobs_.push_back(move(job));
+        }
+        work_cv_.notify_one();
+    }
+
+    void Work() {
+        unique_lock<mutex> lock{mutex_};
+        while(true) {
+            work_cv_.wait(lock, [this] {
+                return done_ || !jobs_.empty();
+            });
+            if (jobs_.empty()) {
+                return; // done_
+            }
+
+            auto job = move(jobs_.front());
+            jobs_.pop_front();
+            ++active_;
+            lock.unlock();
+
+            exception_ptr error;
+            try {
+                job();
+            } catch(const exception& ex) {
+                LOG_ERROR << "Failed to make the images: " << ex.what();
+                error = current_exception();
+            }
+
+            lock.lock();
+            if (error && !error_) {
+                error_ = error;
+            }
+            if (--active_ == 0 && jobs_.empty()) {
+                idle_cv_.notify_all();
+            }
+        }
+    }
 
-            auto dst = path.parent_path();
-            dst /= scale_dir + to_string(*w);
-            dst /= path.filename();
+    // Where the quality of an output is kept in the Source
+    struct Slot {
+        size_t variant = 0;
+        size_t output = 0;
+        size_t image = 0;
+        // Index in the alternatives, or -1 for the JPEG image
+        int alternative = -1;
+    };
 
-            largest_width = *w;
+    // Work out the variants from the image headers, and which of them we need to make.
+    // Outputs with quality 0 get their quality from a search. Unless the image is
+    // unchanged since it was indexed, variants older than the image are made again.
+    Source Plan(const std::filesystem::path & path, vector<Image::Variant>& variants,
+                vector<Slot>& slots, const map<string, int>& known, bool unchanged) {
+        Source source;
+        auto& images = source.images;
+        static const string scale_dir{"_scale_"};
+
+        // The pixels are only decoded if we have to make a variant
+        const auto original = Image::Probe(path);
+        source.size = original;
+        const auto modified = std::filesystem::last_write_time(path);
+        // The smallest JPEG variant, if we can sample it instead of the image
+        std::filesystem::path sample;
+
+        for (const auto w : widths_) {
+            // Images that are not wider than the largest variant are used as is,
+            // but we may still need them in the other formats.
+            const bool use_original = w >= original.width;
+            const auto width = use_original ? original.width : w;
+            const auto dir = scale_dir + to_string(width);
 
             ImageInfo ii;
-            ii.relative_path = "images/"s
-                + scale_dir + to_string(*w)
-                + "/"s + path.filename().string();
-
-            if (std::filesystem::exists(dst)) {
-                LOG_TRACE << "The scaled image " << dst << " already exists.";
-                auto scaled_img = Image::Create(dst);
-                ii.size.width = scaled_img->GetWidth();
-                ii.size.height = scaled_img->GetHeight();
+            Image::Variant variant;
+            variant.size = Image::ScaledSize(original, width);
+            ii.size = variant.size;
+
+            // Sets the quality of an image we make: from the index, the configured
+            // quality, or 0 to search. Left at 0 (unknown) for existing images.
+            auto add_output = [&](ImageFormat format, std::filesystem::path dst,
+                                  const string& relativePath, int& quality, int alternative) {
+                if (auto it = known.find(relativePath); it != known.end()) {
+                    quality = it->second;
+                }
+                if (std::filesystem::exists(dst)) {
+                    if (!unchanged && std::filesystem::last_write_time(dst) < modified) {
+                        LOG_DEBUG << "The scaled image " << dst << " is older than " << path
+                                  << ". Making it again.";
+                    } else if (HasSize(format, dst, variant.size)) {
+                        LOG_TRACE << "The scaled image " << dst << " already exists.";
+                        return false;
+                    } else {
+                        LOG_DEBUG << "The scaled image " << dst << " has the wrong size. Making it again.";
+                    }
+                }
+                if (!quality && (!target_.IsEnabled() || format == ImageFormat::Avif)) {
+                    quality = GetQuality(format);
+                }
+                slots.push_back({variants.size(), variant.outputs.size(), images.size(),
+                                 alternative});
+                auto target = target_;
+                target.max_quality = GetQuality(format);
+                target.min_quality = min(target.min_quality, target.max_quality);
+                variant.outputs.push_back({format, move(dst), quality, target, jpeg_});
+                return true;
+            };
+
+            if (use_original) {
+                ii.relative_path = "images/"s + path.filename().string();
             } else {
-                CreateDirectoryForFile(dst);
-                ii.size = image->ScaleAndSave(dst, *w, quality_);
+                ii.relative_path = "images/"s + dir + "/"s + path.filename().string();
+                const auto dst = path.parent_path() / dir / path.filename();
+                if (!add_output(ImageFormat::Jpeg, dst, ii.relative_path, ii.quality, -1)) {
+                    ii.size = Image::Probe(dst);
+                    if (images.empty()) {
+                        sample = dst;
+                    }
+                }
+            }
+
+            for(const auto& a : alternatives_) {
+                auto name = path.filename();
+                name.replace_extension(GetExtension(a.format));
+                auto& alt = ii.alternatives.emplace_back();
+                alt.format = a.format;
+                alt.relative_path = "images/"s + dir + "/"s + name.string();
+                add_output(a.format, path.parent_path() / dir / name, alt.relative_path,
+                           alt.quality, static_cast<int>(ii.alternatives.size() - 1));
+            }
+
+            if (!variant.outputs.empty()) {
+                for(const auto& output : variant.outputs) {
+                    CreateDirectoryForFile(output.path);
+                }
+                variants.push_back(move(variant));
             }
 
             images.push_back(move(ii));
+
+            if (use_original) {
+                break;
+            }
         }
 
-        return images;
+        // The smallest variant is the cheapest to decode, if it is up to date
+        Sample(sample.empty() ? path : sample, source);
+        return source;
+    }
+
+    // Get the dominant color and the placeholder from a small decode of the image
+    void Sample(const std::filesystem::path & file, Source& source) const {
+        const auto image = Image::Create(file, placeholder_width * 4);
+        source.dominant_color = image->GetDominantColor();
+
+        if (placeholders_) {
+            const auto width = min(placeholder_width, image->GetWidth());
+            const auto tiny = image->Scale(image->GetScaledSize(width), ResampleFilter::Area);
+            source.placeholder = "data:image/jpeg;base64,"s
+                + Base64Encode(tiny->ToJpeg(placeholder_quality));
+        }
+    }
+
+    // Make the missing variants, and fill in what we learn from the files
+    void Make(const std::filesystem::path & path, Source& source,
+              vector<Image::Variant> variants, const vector<Slot>& slots) {
+        auto& images = source.images;
+
+        // In one pass over the source. It finds the qualities we don't know.
+        Image::MakeVariants(path, variants, filter_);
+        for(const auto& slot : slots) {
+            const auto quality = variants[slot.variant].outputs[slot.output].quality;
+            auto& ii = images[slot.image];
+            if (slot.alternative < 0) {
+                ii.quality = quality;
+            } else {
+                ii.alternatives[slot.alternative].quality = quality;
+            }
+        }
+
+        source.bytes = std::filesystem::file_size(path);
+        for(auto& ii : images) {
+            ii.bytes = std::filesystem::file_size(root_ / ii.relative_path);
+            for(auto& a : ii.alternatives) {
+                a.bytes = std::filesystem::file_size(root_ / a.relative_path);
+            }
+        }
+    }
+
+    // Images made before the EXIF orientation was applied are rotated
+    static bool HasSize(ImageFormat format, const std::filesystem::path& path,
+                        const Image::Size& size) {
+        if (format == ImageFormat::Avif) {
+            // Not probed
+            return true;
+        }
+        try {
+            const auto actual = Image::Probe(path);
+            return actual.width == size.width && actual.height == size.height;
+        } catch(const exception&) {
+            return false;
+        }
+    }
+
+    // The configured quality for the format
+    int GetQuality(ImageFormat format) const {
+        for(const auto& a : alternatives_) {
+            if (a.format == format) {
+                return a.quality;
+            }
+        }
+        return quality_;
+    }
+
+    // Variants that are deleted since the index was saved must be made again
+    bool HasVariants(const ImageIndex::Entry& entry) const {
+        for(const auto& v : entry.variants) {
+            if (!std::filesystem::exists(root_ / v.relative_path)) {
+                LOG_DEBUG << "The image " << v.relative_path << " is gone.";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // The variants are stored flat: each JPEG image, followed by its alternatives
+    ImageIndex::Entry ToEntry(const Source& source) const {
+        ImageIndex::Entry entry;
+        entry.settings = settings_;
+        entry.size = source.size;
+        entry.dominant_color = source.dominant_color;
+        entry.placeholder = source.placeholder;
+        for(const auto& ii : source.images) {
+            entry.variants.push_back({ImageFormat::Jpeg, ii.relative_path, ii.size, ii.bytes,
+                                      ii.quality});
+            for(const auto& a : ii.alternatives) {
+                entry.variants.push_back({a.format, a.relative_path, ii.size, a.bytes,
+                                          a.quality});
+            }
+        }
+        return entry;
+    }
+
+    static Source ToSource(const ImageIndex::Entry& entry) {
+        Source source;
+        source.size = entry.size;
+        source.bytes = entry.bytes;
+        source.dominant_color = entry.dominant_color;
+        source.placeholder = entry.placeholder;
+        for(const auto& v : entry.variants) {
+            if (v.format == ImageFormat::Jpeg) {
+                auto& ii = source.images.emplace_back();
+                ii.relative_path = v.relative_path;
+                ii.size = v.size;
+                ii.bytes = v.bytes;
+                ii.quality = v.quality;
+            } else if (!source.images.empty()) {
+                source.images.back().alternatives.push_back({v.format, v.relative_path, v.bytes,
+                                                            v.quality});
+            }
+        }
+        return source;
     }
 
-private:
     const widths_t widths_;
     const int quality_;
+    const JpegSettings jpeg_;
+    const ResampleFilter filter_;
+    const std::filesystem::path root_;
+    const bool placeholders_;
+    const QualityTarget target_;
+    encodings_t alternatives_;
+    string settings_;
+    unique_ptr<ImageIndex> index_;
+
+    // Protects the members below, and the index
+    mutex mutex_;
+    // The images we have seen in this run
+    map<string, Source> sources_;
+    vector<thread> workers_;
+    deque<function<void ()>> jobs_;
+    condition_variable work_cv_;
+    condition_variable idle_cv_;
+    size_t active_ = 0;
+    exception_ptr error_;
+    bool done_ = false;
 };
 
 
 std::unique_ptr<ImageMgr> ImageMgr::Create(const ImageMgr::widths_t& widths,
-                                           int quality) {
-    return make_unique<ImageMgrImpl>(widths, quality);
+                                           int quality,
+                                           const JpegSettings& jpeg,
+                                           ResampleFilter filter,
+                                           const encodings_t& alternatives,
+                                           const std::filesystem::path& root,
+                                           const std::filesystem::path& indexFile,
+                                           bool placeholders,
+                                           const QualityTarget& target) {
+    return make_unique<ImageMgrImpl>(widths, quality, jpeg, filter, alternatives, root, indexFile,
+                                     placeholders, target);
 }
 
 }
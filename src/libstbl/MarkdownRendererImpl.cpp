@@ -0,0 +1,263 @@
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "cmark-gfm.h"
+#include "cmark-gfm-core-extensions.h"
+
+#include "stbl/MarkdownRenderer.h"
+#include "stbl/logging.h"
+
+using namespace std;
+
+namespace stbl {
+
+namespace {
+
+/* Bump allocator for cmark
+ *
+ * free() is a no-op, except for the most recent allocation, and
+ * realloc() of the most recent allocation grows it in place when there
+ * is room. That is the common pattern for cmark's string buffers.
+ *
+ * Like cmark's own allocator, we abort() if we run out of memory. We
+ * can't throw through the C code.
+ */
+class Arena
+{
+public:
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator = (const Arena&) = delete;
+
+    ~Arena() {
+        for(auto& c : chunks_) {
+            free(c.data);
+        }
+    }
+
+    void *Allocate(size_t bytes) {
+        const auto need = header_size + Align(bytes);
+
+        while (true) {
+            if (current_ < chunks_.size()) {
+                auto& chunk = chunks_[current_];
+                if (chunk.size - chunk.used >= need) {
+                    auto *header = reinterpret_cast<Header *>(chunk.data + chunk.used);
+                    header->size = bytes;
+                    chunk.used += need;
+                    last_ = reinterpret_cast<char *>(header) + header_size;
+                    memset(last_, 0, bytes);
+                    return last_;
+                }
+
+                ++current_;
+                continue;
+            }
+
+            AddChunk(need);
+        }
+    }
+
+    void *Reallocate(void *ptr, size_t bytes) {
+        if (!ptr) {
+            return Allocate(bytes);
+        }
+
+        auto *header = GetHeader(ptr);
+        const auto old_size = header->size;
+        if (bytes <= old_size) {
+            return ptr;
+        }
+
+        if (ptr == last_) {
+            // Try to grow in place
+            auto& chunk = chunks_[current_];
+            const auto start = static_cast<size_t>(static_cast<char *>(ptr) - chunk.data);
+            const auto new_end = start + Align(bytes);
+            if (new_end <= chunk.size) {
+                memset(static_cast<char *>(ptr) + old_size, 0, bytes - old_size);
+                header->size = bytes;
+                chunk.used = new_end;
+                return ptr;
+            }
+        }
+
+        auto *p = Allocate(bytes);
+        memcpy(p, ptr, old_size);
+        return p;
+    }
+
+    void Free(void *ptr) noexcept {
+        if (ptr && ptr == last_) {
+            auto& chunk = chunks_[current_];
+            chunk.used = static_cast<size_t>(static_cast<char *>(ptr) - chunk.data) - header_size;
+            last_ = nullptr;
+        }
+    }
+
+    // Make all the memory available for the next document
+    void Reset() noexcept {
+        // Don't hold on to the memory used by an unusually large document
+        size_t total = 0;
+        size_t keep = 0;
+        for(; keep < chunks_.size(); ++keep) {
+            total += chunks_[keep].size;
+            if (total > max_retained && keep > 0) {
+                break;
+            }
+        }
+        for(auto i = keep; i < chunks_.size(); ++i) {
+            free(chunks_[i].data);
+        }
+        chunks_.resize(keep);
+
+        for(auto& c : chunks_) {
+            c.used = 0;
+        }
+        current_ = 0;
+        last_ = nullptr;
+    }
+
+private:
+    struct Header {
+        size_t size;
+    };
+
+    struct Chunk {
+        char *data = nullptr;
+        size_t size = 0;
+        size_t used = 0;
+    };
+
+    static constexpr size_t alignment = alignof(max_align_t);
+    static constexpr size_t chunk_size = 256 * 1024;
+    static constexpr size_t max_retained = 8 * 1024 * 1024;
+
+    static constexpr size_t Align(size_t bytes) noexcept {
+        return (bytes + alignment - 1) & ~(alignment - 1);
+    }
+
+    // Keeps the payload aligned
+    static constexpr size_t header_size = alignment;
+    static_assert(sizeof(Header) <= header_size);
+
+    static Header *GetHeader(void *ptr) noexcept {
+        return reinterpret_cast<Header *>(static_cast<char *>(ptr) - header_size);
+    }
+
+    // Insert a new chunk at current_
+    void AddChunk(size_t need) {
+        Chunk chunk;
+        chunk.size = max(chunk_size, need);
+        chunk.data = static_cast<char *>(aligned_alloc(alignment, Align(chunk.size)));
+        if (!chunk.data) {
+            LOG_ERROR << "Out of memory";
+            abort();
+        }
+        chunks_.insert(chunks_.begin() + min(current_, chunks_.size()), chunk);
+    }
+
+    vector<Chunk> chunks_;
+    size_t current_ = 0;
+    void *last_ = nullptr;
+};
+
+// The arena used by the cmark_mem functions on this thread
+thread_local Arena *current_arena = nullptr;
+
+void *ArenaCalloc(size_t count, size_t size) {
+    return current_arena->Allocate(count * size);
+}
+
+void *ArenaRealloc(void *ptr, size_t size) {
+    return current_arena->Reallocate(ptr, size);
+}
+
+void ArenaFree(void *ptr) {
+    current_arena->Free(ptr);
+}
+
+cmark_mem arena_mem = {ArenaCalloc, ArenaRealloc, ArenaFree};
+
+// Looked up once. The extensions are shared by all the threads.
+const vector<cmark_syntax_extension *>& GetExtensions() {
+    static once_flag once;
+    static vector<cmark_syntax_extension *> extensions;
+
+    call_once(once, [] {
+        cmark_gfm_core_extensions_ensure_registered();
+        for(const auto name : {"table", "strikethrough", "autolink", "tasklist"}) {
+            if (auto *ext = cmark_find_syntax_extension(name)) {
+                extensions.push_back(ext);
+            } else {
+                LOG_WARN << "The cmark-gfm extension '" << name << "' is not available";
+            }
+        }
+    });
+
+    return extensions;
+}
+
+} // anonymous ns
+
+class MarkdownRendererImpl : public MarkdownRenderer
+{
+public:
+    MarkdownRendererImpl()
+    : extensions_{GetExtensions()}
+    {
+    }
+
+    std::string_view Render(std::string_view markdown,
+                            const transform_t& transform) override {
+
+        arena_.Reset();
+        current_arena = &arena_;
+
+        // Everything below is allocated from the arena and released
+        // in one go by the next Reset(). Nothing is freed explicitly.
+        auto *parser = cmark_parser_new_with_mem(options_, &arena_mem);
+        for(auto *ext : extensions_) {
+            cmark_parser_attach_syntax_extension(parser, ext);
+        }
+
+        cmark_parser_feed(parser, markdown.data(), markdown.size());
+        auto *doc = cmark_parser_finish(parser);
+        if (!doc) {
+            LOG_ERROR << "Failed to parse markdown";
+            throw runtime_error("Markdown error");
+        }
+
+        if (transform) {
+            transform(doc);
+        }
+
+        const auto *html = cmark_render_html_with_mem(
+            doc, options_, cmark_parser_get_syntax_extensions(parser), &arena_mem);
+        if (!html) {
+            LOG_ERROR << "Failed to convert markdown to HTML";
+            throw runtime_error("Markdown error");
+        }
+
+        return html;
+    }
+
+private:
+    static constexpr int options_ = CMARK_OPT_DEFAULT | CMARK_OPT_VALIDATE_UTF8 | CMARK_OPT_UNSAFE;
+
+    const vector<cmark_syntax_extension *>& extensions_;
+    Arena arena_;
+};
+
+MarkdownRenderer& MarkdownRenderer::GetInstance() {
+    thread_local MarkdownRendererImpl renderer;
+    return renderer;
+}
+
+}
@@ -1,16 +1,21 @@
 
 #include <string.h>
-#include <fstream>
-#include <regex>
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <optional>
+#include <set>
 #include <sstream>
+#include <vector>
 
-#include <boost/algorithm/string/replace.hpp>
-#include <boost/regex.hpp>
+#include <boost/algorithm/string/predicate.hpp>
 
 #include "cmark-gfm.h"
 
 #include "stbl/stbl.h"
 #include "stbl/Page.h"
+#include "stbl/MarkdownRenderer.h"
+#include "stbl/SourceBuffer.h"
 #include "stbl/logging.h"
 #include "stbl/utility.h"
 #include "stbl/ContentManager.h"
@@ -25,13 +30,8 @@ namespace stbl {
 class PageImpl : public Page
 {
 public:
-    PageImpl(const std::filesystem::path& path)
-    : path_{path}, content_{}
-    {
-    }
-
-     PageImpl(const string& content)
-    : path_{}, content_{content}
+    PageImpl(const source_t& source)
+    : source_{source}
     {
     }
 
@@ -39,63 +39,21 @@ public:
     }
 
     size_t Render2Html(std::ostream & out, RenderCtx& ctx) override {
-
-        if (!path_.empty()) {
-            ifstream in(path_.string());
-            if (!in) {
-                auto err = strerror(errno);
-                LOG_ERROR << "IO error. Failed to open "
-                    << path_ << ": " << err;
-
-                throw runtime_error("IO error");
-            }
-
-            return Render2Html(in, out, ctx);
-        }
-
-        std::istringstream in{content_};
-        return Render2Html(in, out, ctx);
-    }
-
-private:
-    size_t Render2Html(istream& in, ostream& out, RenderCtx& ctx) {
-        EatHeader(in);
-        string content((std::istreambuf_iterator<char>(in)),
-                       istreambuf_iterator<char>());
-
         size_t words = 0;
-        static regex word_pattern("\\w+");
-        sregex_iterator next(content.begin(), content.end(), word_pattern);
-        sregex_iterator end;
-        for (; next != end; ++next) {
-            ++words;
-        }
-
-        handleVideo(content, ctx);
+        out << Render2Html(ctx, words);
+        return words;
+    }
 
-        // Quick hack to handle images in series.
-        static const std::regex images{R"(.*(!\[.+\])\((images\/.+)\))"};
-        content = std::regex_replace(content, images, "$1("s + ctx.getRelativePrefix() + "$2)");
+    std::string_view Render2Html(RenderCtx& ctx, size_t& words) override {
+        const auto body = source_->GetBody();
+        words = CountWords(body);
 
-        // Process markdown
-        if (char * output{cmark_markdown_to_html(content.c_str(), content.size(),
-            CMARK_OPT_DEFAULT | CMARK_OPT_VALIDATE_UTF8 | CMARK_OPT_UNSAFE)}) {
-            auto deleter = [](void *ptr) {
-                // We are using a C library, so call free()
-                if (ptr) free(ptr);
-            };
-            unique_ptr<char, decltype(deleter)> output_ptr{output, deleter};
-            string_view output_w{output_ptr.get()};
-
-            content.clear();
-            out << output_w;
-            return words;
-        }
-        LOG_ERROR << "Failed to convert markdown to HTML";
-        out << content;
-        return words;
+        return MarkdownRenderer::GetInstance().Render(body, [&](cmark_node *doc) {
+            Transform(doc, ctx);
+        });
     }
 
+private:
     enum class Scaling {
         p360 = 360,
         p480 = 480,
@@ -105,6 +63,75 @@ private:
         p2160 = 2160
     };
 
+    // One of the formats we publish the videos in
+    struct VideoFormat {
+        const char *dir;
+        const char *extension;
+        const char *type;
+        // The video and audio encoders, as ffmpeg names them
+        const char *video_encoder;
+        const char *audio_encoder;
+        // The codec options for the output
+        const char *options;
+    };
+
+    /* The encoders ffmpeg was built with, from "ffmpeg -encoders"
+     *
+     * Empty if ffmpeg could not be run, or its list could not be parsed.
+     * Then we don't know, and try all the formats.
+     */
+    static const set<string>& getVideoEncoders() {
+        static const auto encoders = [] {
+            set<string> names;
+            string list;
+            try {
+                list = Pipe("ffmpeg", {"-hide_banner", "-encoders"}, {});
+            } catch(const exception&) {
+                LOG_WARN << "Could not list the ffmpeg encoders. Trying all the video formats.";
+                return names;
+            }
+
+            // A legend, a line of dashes, and then " V....D libx264   Description"
+            istringstream in{list};
+            string line;
+            bool started = false;
+            while(getline(in, line)) {
+                if (!started) {
+                    started = line.find("------") != string::npos;
+                    continue;
+                }
+                istringstream fields{line};
+                string flags, name;
+                if (fields >> flags >> name) {
+                    names.insert(name);
+                }
+            }
+            LOG_DEBUG << "ffmpeg has " << names.size() << " encoders";
+            return names;
+        }();
+        return encoders;
+    }
+
+    static string quoteForShell(const string& arg) {
+        string quoted = "'";
+        for(const auto ch : arg) {
+            if (ch == '\'') {
+                quoted += "'\\''";
+            } else {
+                quoted += ch;
+            }
+        }
+        return quoted + "'";
+    }
+
+    /* Convert the video to the formats that are missing
+     *
+     * The source is decoded and scaled once, and the frames are split
+     * between the encoders, that all run in the same ffmpeg process. If
+     * that fails, each format is tried alone, so that one broken encoder
+     * does not cost us the others. Formats that ffmpeg has no encoder for
+     * are skipped.
+     */
     std::vector<std::string>
     convertVideo(const std::filesystem::path& inputFilePath, const std::string& prefix,  Scaling scaling) {
         if (!fs::exists(inputFilePath)) {
@@ -112,40 +139,88 @@ private:
             return {};
         }
 
+        // In the order of the <source> elements
+        static const array<VideoFormat, 3> formats = {{
+            {"_webm", ".webm", "video/webm", "libvpx-vp9", "libvorbis",
+             "-c:v libvpx-vp9 -b:v 0 -crf 31 -c:a libvorbis"},
+            {"_mp4", ".mp4", "video/mp4", "libx264", "aac",
+             "-c:v libx264 -crf 23 -preset medium -c:a aac -b:a 128k"},
+            {"_ogv", ".ogv", "video/ogg", "libtheora", "libvorbis",
+             "-c:v libtheora -q:v 7 -c:a libvorbis -q:a 5"}
+        }};
+
         const int height = static_cast<int>(scaling);
         const auto filename = inputFilePath.stem().string();
         const auto parentPath = inputFilePath.parent_path();
         const auto scale_tag = "_p" + std::to_string(height);
 
-        const auto output_mp4 = parentPath / "_mp4" / (filename + scale_tag + ".mp4");
-        const auto output_webm = parentPath / "_webm" /  (filename + scale_tag + ".webm");
-        const auto output_ogv = parentPath / "_ogv" / (filename + scale_tag + ".ogv");
-
-        const string scale_filter = "scale=-2:" + std::to_string(height);
-
-        const string cmd_mp4 = "ffmpeg -i " + inputFilePath.string() + " -vf \"" + scale_filter +
-                               "\" -c:v libx264 -crf 23 -preset medium -c:a aac -b:a 128k " + output_mp4.string();
-        const string cmd_webm = "ffmpeg -i " + inputFilePath.string() + " -vf \"" + scale_filter +
-                                "\" -c:v libvpx-vp9 -b:v 0 -crf 31 -c:a libvorbis " + output_webm.string();
-        const string cmd_ogv = "ffmpeg -i " + inputFilePath.string() + " -vf \"" + scale_filter +
-                               "\" -c:v libtheora -q:v 7 -c:a libvorbis -q:a 5 " + output_ogv.string();
+        auto output_path = [&](const VideoFormat& format) {
+            return parentPath / format.dir / (filename + scale_tag + format.extension);
+        };
 
-        if (!fs::exists(output_mp4)) {
-            LOG_DEBUG << "Executing: " << cmd_mp4;
-            CreateDirectoryForFile(output_mp4);
-            std::system(cmd_mp4.c_str());
+        vector<const VideoFormat *> missing;
+        for(const auto& format : formats) {
+            if (!fs::exists(output_path(format))) {
+                missing.push_back(&format);
+            }
         }
 
-        if (!fs::exists(output_webm)) {
-            LOG_DEBUG << "Executing: " << cmd_webm;
-            CreateDirectoryForFile(output_webm);
-            std::system(cmd_webm.c_str());
+        // Only ask ffmpeg for its encoders if there is something to make
+        if (!missing.empty()) {
+            const auto& encoders = getVideoEncoders();
+            missing.erase(remove_if(missing.begin(), missing.end(), [&](const auto *format) {
+                if (encoders.empty() || (encoders.count(format->video_encoder)
+                                         && encoders.count(format->audio_encoder))) {
+                    return false;
+                }
+                LOG_WARN << "ffmpeg has no " << format->video_encoder << " or "
+                         << format->audio_encoder << " encoder. Skipping the "
+                         << format->extension << " version of " << inputFilePath;
+                return true;
+            }), missing.end());
         }
 
-        if (!fs::exists(output_ogv)) {
-            LOG_DEBUG << "Executing: " << cmd_ogv;
-            CreateDirectoryForFile(output_ogv);
-            std::system(cmd_ogv.c_str());
+        // One output per format, each fed by its own copy of the scaled frames
+        auto convert = [&](const vector<const VideoFormat *>& outputs) {
+            const auto count = outputs.size();
+            string cmd = "ffmpeg -nostdin -y -i " + quoteForShell(inputFilePath.string())
+                + " -filter_complex \"[0:v:0]scale=-2:" + std::to_string(height)
+                + ",split=" + std::to_string(count);
+            for(size_t i = 0; i < count; ++i) {
+                cmd += "[v" + std::to_string(i) + "]";
+            }
+            cmd += "\"";
+            for(size_t i = 0; i < count; ++i) {
+                const auto path = output_path(*outputs[i]);
+                CreateDirectoryForFile(path);
+                cmd += " -map \"[v" + std::to_string(i) + "]\" -map '0:a:0?' "
+                    + outputs[i]->options + " " + quoteForShell(path.string());
+            }
+
+            LOG_DEBUG << "Executing: " << cmd;
+            if (std::system(cmd.c_str()) == 0) {
+                return true;
+            }
+
+            // Don't leave partial files that look like finished videos
+            for(const auto *format : outputs) {
+                std::error_code ec;
+                fs::remove(output_path(*format), ec);
+            }
+            return false;
+        };
+
+        if (!missing.empty() && !convert(missing)) {
+            if (missing.size() > 1) {
+                LOG_WARN << "Failed to convert " << inputFilePath
+                         << " to all the formats at once. Trying one format at the time.";
+            }
+            for(const auto *format : missing) {
+                if (missing.size() == 1 || !convert({format})) {
+                    LOG_ERROR << "Failed to convert " << inputFilePath << " to "
+                              << format->extension;
+                }
+            }
         }
 
         // We want the path from "video/" for the output file
@@ -161,9 +236,13 @@ private:
         };
 
         vector<string> result;
-        result.emplace_back("<source src=\""s + prefix + relative_path(output_webm).string() + "\" type=\"video/webm\">");
-        result.emplace_back("<source src=\""s + prefix + relative_path(output_mp4).string() + "\" type=\"video/mp4\">");
-        result.emplace_back("<source src=\""s + prefix + relative_path(output_ogv).string() + "\" type=\"video/ogg\">");
+        for(const auto& format : formats) {
+            const auto path = output_path(format);
+            if (fs::exists(path)) {
+                result.emplace_back("<source src=\""s + escapeForXml(prefix + relative_path(path).string())
+                                    + "\" type=\"" + format.type + "\">");
+            }
+        }
 
         return result;
     }
@@ -184,50 +263,195 @@ private:
         return Scaling::p720;
     }
 
-    void handleVideo(std::string& content, RenderCtx& ctx)
-    {
-        static const boost::regex video_pat{R"(!\[(.*?)\]\((video\/([a-zA-Z0-9\-_\.]+))(;(p\d+))?\))",
-                                            boost::regex::normal | boost::regex::icase};
-        boost::smatch matches;
-        size_t start_at = 0;
-        while (boost::regex_search(content.cbegin() + start_at, content.cend(), matches, video_pat)) {
-            const auto offset = std::distance(content.cbegin(), matches[0].first);
-
-            const string label = matches[1];
-            const string source = matches[2];
-            const string scaling = matches[5];
+    // Apply our transformations to the markdown AST:
+    //   - images in "images/" are rendered by ctx.render_image, or made
+    //     relative to the current page
+    //   - images in "video/" are replaced by a <video> element
+    //   - fenced code blocks are syntax highlighted
+    void Transform(cmark_node *doc, RenderCtx& ctx) {
+        // Collect the nodes first. We can not replace nodes while we iterate.
+        vector<cmark_node *> images, code_blocks;
+        {
+            auto iter_deleter = [](cmark_iter *iter) {
+                cmark_iter_free(iter);
+            };
+            unique_ptr<cmark_iter, decltype(iter_deleter)> iter{cmark_iter_new(doc), iter_deleter};
+
+            for(auto ev = cmark_iter_next(iter.get()); ev != CMARK_EVENT_DONE;
+                ev = cmark_iter_next(iter.get())) {
+                if (ev != CMARK_EVENT_ENTER) {
+                    continue;
+                }
+                auto *node = cmark_iter_get_node(iter.get());
+                switch(cmark_node_get_type(node)) {
+                case CMARK_NODE_IMAGE:
+                    images.push_back(node);
+                    break;
+                case CMARK_NODE_CODE_BLOCK:
+                    if (ctx.highlight_code) {
+                        code_blocks.push_back(node);
+                    }
+                    break;
+                default:
+                    ;
+                }
+            }
+        }
 
-            fs::path full_video_path = ContentManager::GetOptions().source_path;
-            full_video_path /= source;
+        size_t image_index = 0;
+        for(auto *node : images) {
+            const string_view url = cmark_node_get_url(node);
+            if (url.substr(0, 7) == "images/") {
+                if (ctx.render_image) {
+                    const auto *title = cmark_node_get_title(node);
+                    const auto html = ctx.render_image(url, GetText(node), title ? title : "",
+                                                       image_index++);
+                    if (!html.empty()) {
+                        auto *inline_html = cmark_node_new_with_mem(CMARK_NODE_HTML_INLINE,
+                                                                    cmark_node_mem(node));
+                        cmark_node_set_literal(inline_html, html.c_str());
+                        cmark_node_replace(node, inline_html);
+                        cmark_node_free(node);
+                        continue;
+                    }
+                }
+                const auto relative = ctx.getRelativePrefix() + string{url};
+                cmark_node_set_url(node, relative.c_str());
+            } else if (auto video = ParseVideoUrl(url)) {
+                HandleVideo(node, *video, ctx);
+            }
+        }
 
-            const auto sources = convertVideo(full_video_path, ctx.getRelativePrefix(), toScaling(scaling));
+        for(auto *node : code_blocks) {
+            HighlightCode(node, ctx);
+        }
+    }
 
-            string video_tag = "<video controls>\n";
-            for(const auto& src: sources) {
-                video_tag += src + "\n";
+    // The plain text of the children, like the alt text of an image
+    static string GetText(cmark_node *node) {
+        string text;
+        for(auto *child = cmark_node_first_child(node); child; child = cmark_node_next(child)) {
+            switch(cmark_node_get_type(child)) {
+            case CMARK_NODE_TEXT:
+            case CMARK_NODE_CODE:
+                if (const auto *literal = cmark_node_get_literal(child)) {
+                    text += literal;
+                }
+                break;
+            case CMARK_NODE_SOFTBREAK:
+            case CMARK_NODE_LINEBREAK:
+                text += ' ';
+                break;
+            default:
+                text += GetText(child);
             }
-            video_tag += "Your browser does not support the video tag\n</video>";
+        }
+        return text;
+    }
 
-            if (!video_tag.empty()) {
-                content.replace(matches[0].first, matches[0].second, video_tag);
-                start_at = offset + video_tag.size();
-            } else {
-                start_at = std::distance(content.cbegin(), matches[0].second);
+    struct VideoRef {
+        string source; // "video/name"
+        string scaling;
+    };
+
+    // "video/name.mp4" or "video/name.mp4;p720"
+    static optional<VideoRef> ParseVideoUrl(string_view url) {
+        if (url.size() <= 6 || !boost::iequals(url.substr(0, 6), "video/")) {
+            return {};
+        }
+
+        auto is_name_char = [](char ch) {
+            return isalnum(static_cast<unsigned char>(ch))
+                || ch == '-' || ch == '_' || ch == '.';
+        };
+
+        size_t pos = 6;
+        while (pos < url.size() && is_name_char(url[pos])) {
+            ++pos;
+        }
+        if (pos == 6) {
+            return {};
+        }
+
+        VideoRef ref;
+        ref.source = url.substr(0, pos);
+
+        if (pos < url.size()) {
+            const auto scaling = url.substr(pos + 1);
+            if (url[pos] != ';' || scaling.size() < 2
+                || (scaling[0] != 'p' && scaling[0] != 'P')
+                || !all_of(scaling.begin() + 1, scaling.end(), [](char ch) {
+                    return isdigit(static_cast<unsigned char>(ch));
+                })) {
+                return {};
             }
-            assert(start_at > offset);
+            ref.scaling = scaling;
         }
+
+        return ref;
     }
 
-    const std::filesystem::path path_;
-    const std::string content_;
-};
+    void HandleVideo(cmark_node *image, const VideoRef& video, RenderCtx& ctx) {
+        fs::path full_video_path = ContentManager::GetOptions().source_path;
+        full_video_path /= video.source;
 
-page_t Page::Create(const std::filesystem::path& path) {
-    return make_shared<PageImpl>(path);
-}
+        const auto sources = convertVideo(full_video_path, ctx.getRelativePrefix(), toScaling(video.scaling));
+
+        string video_tag = "<video controls>\n";
+        for(const auto& src: sources) {
+            video_tag += src + "\n";
+        }
+        video_tag += "Your browser does not support the video tag\n</video>";
+
+        // A video alone in a paragraph becomes a html block, like
+        // it would if the tag had been written in the markdown.
+        auto *parent = cmark_node_parent(image);
+        const bool alone = parent
+            && cmark_node_get_type(parent) == CMARK_NODE_PARAGRAPH
+            && cmark_node_first_child(parent) == image
+            && cmark_node_next(image) == nullptr;
+
+        auto *target = alone ? parent : image;
+        auto *html = cmark_node_new_with_mem(alone ? CMARK_NODE_HTML_BLOCK : CMARK_NODE_HTML_INLINE,
+                                             cmark_node_mem(image));
+        cmark_node_set_literal(html, video_tag.c_str());
+        cmark_node_replace(target, html);
+        cmark_node_free(target);
+    }
+
+    void HighlightCode(cmark_node *block, RenderCtx& ctx) {
+        const auto *info = cmark_node_get_fence_info(block);
+        if (!info) {
+            return;
+        }
+
+        // The language is the first word of the info string
+        string_view language = info;
+        language = language.substr(0, language.find_first_of(" \t"));
+        if (language.empty() || language.size() > 16
+            || !all_of(language.begin(), language.end(), [](char ch) {
+                return isalnum(static_cast<unsigned char>(ch)) || ch == '+';
+            })) {
+            return;
+        }
+
+        const auto *code = cmark_node_get_literal(block);
+        auto highlighted = ctx.highlight_code(code ? code : "", string{language});
+        if (highlighted.empty()) {
+            return;
+        }
+
+        auto *html = cmark_node_new_with_mem(CMARK_NODE_HTML_BLOCK, cmark_node_mem(block));
+        cmark_node_set_literal(html, highlighted.c_str());
+        cmark_node_replace(block, html);
+        cmark_node_free(block);
+    }
+
+    const source_t source_;
+};
 
-page_t Page::Create(const string& content) {
-    return make_shared<PageImpl>(content);
+page_t Page::Create(const source_t& source) {
+    return make_shared<PageImpl>(source);
 }
 
 }
@@ -1,6 +1,6 @@
 #include <memory>
 #include <set>
-#include <fstream>
+#include <sstream>
 #include <streambuf>
 #include <iomanip>
 #include <filesystem>
@@ -32,18 +32,7 @@ public:
 
         LOG_TRACE << "Saving sitemap: " << path;
 
-        CreateDirectoryForFile(path);
-
-        std::ofstream out(path.string(), ios_base::out | ios_base::trunc);
-
-        if (!out) {
-            auto err = strerror(errno);
-            LOG_ERROR << "IO error. Failed to open "
-                << path << " for write: " << err;
-
-            throw runtime_error("IO error");
-        }
-
+        ostringstream out;
         out << R"(<?xml version="1.0" encoding="UTF-8"?>)" << endl
             << R"(<urlset xmlns="http://www.sitemaps.org/schemas/sitemap/0.9">)"
             << endl;
@@ -54,7 +43,7 @@ public:
             date.resize(10); // we want only the date
 
             out << "  <url>" << endl
-                << "    <loc>" << e.url << "</loc>" << endl
+                << "    <loc>" << escapeForXml(e.url) << "</loc>" << endl
                 << "    <lastmod>" << date << "</lastmod>" << endl
                 << "    <priority>" << e.priority<< "</priority>" << endl;
 
@@ -66,6 +55,8 @@ public:
         }
 
         out << "</urlset>" << endl;
+
+        Save(path, out.str(), true);
     }
 
 private:
@@ -0,0 +1,171 @@
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stbl/stbl.h"
+#include "stbl/SourceBuffer.h"
+#include "stbl/logging.h"
+
+using namespace std;
+
+namespace stbl {
+
+namespace {
+
+// Smaller files are read into memory. mmap() is not worth it for them.
+constexpr size_t mmap_threshold = 64 * 1024;
+
+[[noreturn]] void IoError(const char *what, const filesystem::path& path) {
+    auto err = strerror(errno);
+    LOG_ERROR << "IO error. Failed to " << what << ' ' << path << ": " << err;
+    throw runtime_error("IO error");
+}
+
+bool IsDelimiter(string_view line) noexcept {
+    return line.size() >= 3 && line.substr(0, 3) == "---";
+}
+
+} // anonymous ns
+
+class SourceBufferImpl : public SourceBuffer
+{
+public:
+    SourceBufferImpl(const filesystem::path& path)
+    : path_{path}
+    {
+        Read();
+        Locate();
+    }
+
+    SourceBufferImpl(string content)
+    : content_{move(content)}, data_{content_}
+    {
+        Locate();
+    }
+
+    ~SourceBufferImpl() {
+        if (mapped_) {
+            munmap(mapped_, data_.size());
+        }
+    }
+
+    const filesystem::path& GetPath() const noexcept override {
+        return path_;
+    }
+
+    bool HaveHeader() const noexcept override {
+        return have_header_;
+    }
+
+    string_view GetHeader() const noexcept override {
+        return header_;
+    }
+
+    string_view GetBody() const noexcept override {
+        return body_;
+    }
+
+private:
+    void Read() {
+        const int fd = open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            IoError("open", path_);
+        }
+
+        struct FdCloser {
+            ~FdCloser() {
+                close(fd);
+            }
+            int fd;
+        } closer{fd};
+
+        struct stat st = {};
+        if (fstat(fd, &st) != 0) {
+            IoError("stat", path_);
+        }
+        const auto size = static_cast<size_t>(st.st_size);
+
+        if (size >= mmap_threshold) {
+            if (auto *ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0); ptr != MAP_FAILED) {
+                madvise(ptr, size, MADV_SEQUENTIAL);
+                mapped_ = ptr;
+                data_ = {static_cast<const char *>(ptr), size};
+                return;
+            }
+            LOG_DEBUG << "mmap() failed for " << path_ << ": " << strerror(errno)
+                      << ". Reading the file instead.";
+        }
+
+        content_.resize(size);
+        size_t bytes = 0;
+        while (bytes < size) {
+            const auto r = read(fd, content_.data() + bytes, size - bytes);
+            if (r < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                IoError("read", path_);
+            }
+            if (r == 0) {
+                // The file was truncated after fstat()
+                break;
+            }
+            bytes += static_cast<size_t>(r);
+        }
+        content_.resize(bytes);
+        data_ = content_;
+    }
+
+    // Find the header-section; the lines between the first two "---" lines.
+    void Locate() {
+        auto text = data_;
+        if (text.size() >= 3 && text.substr(0, 3) == "\xef\xbb\xbf") {
+            // BOM
+            text.remove_prefix(3);
+        }
+
+        body_ = text;
+
+        int delimiters = 0;
+        size_t header_start = 0;
+        size_t pos = 0;
+        while (pos < text.size()) {
+            const auto eol = text.find('\n', pos);
+            const auto next = (eol == string_view::npos) ? text.size() : eol + 1;
+
+            if (IsDelimiter(text.substr(pos, next - pos))) {
+                if (++delimiters == 1) {
+                    header_start = next;
+                } else {
+                    header_ = text.substr(header_start, pos - header_start);
+                    body_ = text.substr(next);
+                    have_header_ = true;
+                    return;
+                }
+            }
+            pos = next;
+        }
+    }
+
+    const filesystem::path path_;
+    string content_;
+    void *mapped_ = nullptr;
+    string_view data_;
+    string_view header_;
+    string_view body_;
+    bool have_header_ = false;
+};
+
+source_t SourceBuffer::Create(const std::filesystem::path& path) {
+    return make_shared<SourceBufferImpl>(path);
+}
+
+source_t SourceBuffer::Create(std::string content) {
+    return make_shared<SourceBufferImpl>(move(content));
+}
+
+}
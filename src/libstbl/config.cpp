@@ -0,0 +1,431 @@
+
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <string_view>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "stbl/Config.h"
+#include "stbl/logging.h"
+
+using namespace std;
+namespace pt = boost::property_tree;
+
+namespace stbl {
+
+namespace {
+
+class ConfigCompiler
+{
+public:
+    ConfigCompiler(Config& config)
+    : config_{config}
+    {
+    }
+
+    void Compile(const pt::ptree& root) {
+        for(const auto& [key, node] : root) {
+            if (key == "name") {
+                config_.name = GetString(key, node);
+            } else if (key == "abstract") {
+                config_.abstract = GetString(key, node);
+            } else if (key == "url") {
+                config_.url = GetString(key, node);
+            } else if (key == "language") {
+                config_.language = GetString(key, node);
+            } else if (key == "max-articles-on-frontpage") {
+                config_.max_articles_on_frontpage = GetNumber<int>(key, node, 1);
+            } else if (key == "banner") {
+                CompileBanner(key, node);
+            } else if (key == "images") {
+                CompileImages(key, node);
+            } else if (key == "menu") {
+                CompileMenu(config_.menu, node);
+            } else if (key == "people") {
+                CompilePeople(key, node);
+            } else if (key == "system") {
+                CompileSystem(key, node);
+            } else if (key == "publish") {
+                CompilePublish(key, node);
+            } else if (key == "rss") {
+                CompileRss(key, node);
+            } else if (key == "seo") {
+                CompileSeo(key, node);
+            } else if (key == "comments") {
+                CompileComments(key, node);
+            } else if (key == "chroma") {
+                CompileChroma(key, node);
+            } else {
+                Unknown(key);
+            }
+        }
+    }
+
+private:
+    static string Join(const string& parent, const string& key) {
+        return parent + "." + key;
+    }
+
+    [[noreturn]] static void Unknown(const string& path) {
+        LOG_ERROR << "Unknown key '" << path << "' in stbl.conf";
+        throw runtime_error("Configuration error");
+    }
+
+    [[noreturn]] static void Invalid(const string& path, const string& value, string_view expected) {
+        LOG_ERROR << "Invalid value '" << value << "' for '" << path
+                  << "' in stbl.conf. Expected " << expected << ".";
+        throw runtime_error("Configuration error");
+    }
+
+    static string GetString(const string& path, const pt::ptree& node) {
+        if (!node.empty()) {
+            LOG_ERROR << "The key '" << path << "' in stbl.conf must be a value, not a section.";
+            throw runtime_error("Configuration error");
+        }
+        return node.data();
+    }
+
+    static void ExpectSection(const string& path, const pt::ptree& node) {
+        if (!node.data().empty()) {
+            LOG_ERROR << "The key '" << path << "' in stbl.conf must be a section, not a value.";
+            throw runtime_error("Configuration error");
+        }
+    }
+
+    template <typename T>
+    static T GetNumber(const string& path, const pt::ptree& node,
+                       T min = numeric_limits<T>::lowest()) {
+        const auto value = GetString(path, node);
+        T number = {};
+        if (!boost::conversion::try_lexical_convert(boost::trim_copy(value), number)
+            || number < min) {
+            if constexpr (is_integral_v<T>) {
+                Invalid(path, value, min > 0 ? "a positive integer" : "an integer");
+            } else {
+                Invalid(path, value, "a number");
+            }
+        }
+        return number;
+    }
+
+    // A list of image widths, like "94, 248, 480"
+    static vector<int> GetWidths(const string& path, const pt::ptree& node) {
+        const auto value = GetString(path, node);
+        vector<string> values;
+        boost::split(values, value, boost::is_any_of(" ,"));
+        vector<int> widths;
+        for(const auto& v: values) {
+            if (v.empty()) {
+                continue;
+            }
+            int width = 0;
+            if (!boost::conversion::try_lexical_convert(v, width) || width <= 0) {
+                Invalid(path, value, "a list of positive integers");
+            }
+            widths.push_back(width);
+        }
+        return widths;
+    }
+
+    // Image encoder quality, 1 - 100
+    static int GetQuality(const string& path, const pt::ptree& node) {
+        const auto quality = GetNumber<int>(path, node, 1);
+        if (quality > 100) {
+            Invalid(path, node.data(), "a value between 1 and 100");
+        }
+        return quality;
+    }
+
+    static bool GetBool(const string& path, const pt::ptree& node) {
+        const auto value = GetString(path, node);
+        if (value == "true" || value == "1") {
+            return true;
+        }
+        if (value == "false" || value == "0") {
+            return false;
+        }
+        Invalid(path, value, "true or false");
+    }
+
+    void CompileBanner(const string& path, const pt::ptree& section) {
+        ExpectSection(path, section);
+        for(const auto& [key, node] : section) {
+            const auto full = Join(path, key);
+            if (key == "widths") {
+                config_.banner.widths = GetWidths(full, node);
+            } else if (key == "quality") {
+                config_.banner.quality = GetQuality(full, node);
+            } else if (key == "progressive") {
+                config_.banner.jpeg.progressive = GetBool(full, node);
+            } else if (key == "subsampling") {
+                const auto value = GetString(full, node);
+                if (!ToChromaSubsampling(value, config_.banner.jpeg.subsampling)) {
+                    Invalid(full, value, "4:2:0, 4:2:2 or 4:4:4");
+                }
+            } else if (key == "align") {
+                config_.banner.align = GetNumber<int>(full, node);
+            } else if (key == "filter") {
+                const auto value = GetString(full, node);
+                if (!ToResampleFilter(value, config_.banner.filter)) {
+                    Invalid(full, value, "lanczos3, area or bilinear");
+                }
+            } else if (key == "formats") {
+                const auto value = GetString(full, node);
+                vector<string> values;
+                boost::split(values, value, boost::is_any_of(" ,"));
+                config_.banner.formats.clear();
+                for(const auto& v: values) {
+                    if (v.empty()) {
+                        continue;
+                    }
+                    ImageFormat format;
+                    if (!ToImageFormat(v, format)) {
+                        Invalid(full, value, "a list of image formats (webp, avif)");
+                    }
+                    config_.banner.formats.push_back(format);
+                }
+            } else if (key == "webp-quality") {
+                config_.banner.webp_quality = GetQuality(full, node);
+            } else if (key == "avif-quality") {
+                config_.banner.avif_quality = GetQuality(full, node);
+            } else if (key == "placeholders") {
+                config_.banner.placeholders = GetBool(full, node);
+            } else if (key == "target-ssim") {
+                const auto ssim = GetNumber<double>(full, node, 0.0);
+                if (ssim >= 1.0) {
+                    Invalid(full, node.data(), "a value between 0 and 1");
+                }
+                config_.banner.target.ssim = ssim;
+            } else if (key == "max-bytes-per-pixel") {
+                config_.banner.target.max_bytes_per_pixel = GetNumber<double>(full, node, 0.0);
+            } else if (key == "min-quality") {
+                config_.banner.target.min_quality = GetQuality(full, node);
+            } else {
+                Unknown(full);
+            }
+        }
+    }
+
+    void CompileImages(const string& path, const pt::ptree& section) {
+        ExpectSection(path, section);
+        for(const auto& [key, node] : section) {
+            const auto full = Join(path, key);
+            if (key == "widths") {
+                config_.images.widths = GetWidths(full, node);
+            } else if (key == "sizes") {
+                config_.images.sizes = GetString(full, node);
+            } else if (key == "eager") {
+                config_.images.eager = GetNumber<int>(full, node, 0);
+            } else if (key == "placeholders") {
+                config_.images.placeholders = GetBool(full, node);
+            } else if (key == "originals") {
+                using originals_t = Config::Originals;
+                const auto value = GetString(full, node);
+                if (value == "copy") {
+                    config_.images.originals = originals_t::Copy;
+                } else if (value == "lossless") {
+                    config_.images.originals = originals_t::Lossless;
+                } else if (value == "reencode") {
+                    config_.images.originals = originals_t::Reencode;
+                } else {
+                    Invalid(full, value, "copy, lossless or reencode");
+                }
+            } else if (key == "strip-metadata") {
+                config_.images.strip_metadata = GetBool(full, node);
+            } else {
+                Unknown(full);
+            }
+        }
+    }
+
+    // A menu item has either an url, or sub-items
+    void CompileMenu(vector<Config::MenuItem>& items, const pt::ptree& section) {
+        for(const auto& [key, node] : section) {
+            Config::MenuItem item;
+            item.name = key;
+            item.url = node.data();
+            if (item.url.empty()) {
+                CompileMenu(item.children, node);
+            }
+            items.push_back(move(item));
+        }
+    }
+
+    void CompilePeople(const string& path, const pt::ptree& section) {
+        ExpectSection(path, section);
+        for(const auto& [key, node] : section) {
+            const auto full = Join(path, key);
+            if (key == "default") {
+                config_.default_author = GetString(full, node);
+                continue;
+            }
+
+            Config::Person person;
+            person.name = key;
+            for(const auto& [pkey, pnode] : node) {
+                const auto pfull = Join(full, pkey);
+                if (pkey == "name") {
+                    person.name = GetString(pfull, pnode);
+                } else if (pkey == "email") {
+                    person.email = GetString(pfull, pnode);
+                } else {
+                    Config::SocialHandle handle;
+                    handle.handle = pkey;
+                    handle.name = pkey;
+                    for(const auto& [hkey, hnode] : pnode) {
+                        const auto hfull = Join(pfull, hkey);
+                        if (hkey == "name") {
+                            handle.name = GetString(hfull, hnode);
+                        } else if (hkey == "url") {
+                            handle.url = GetString(hfull, hnode);
+                        } else if (hkey == "icon") {
+                            handle.icon = GetString(hfull, hnode);
+                        } else {
+                            Unknown(hfull);
+                        }
+                    }
+                    person.handles.push_back(move(handle));
+                }
+            }
+            config_.people[key] = move(person);
+        }
+    }
+
+    void CompileSystem(const string& path, const pt::ptree& section) {
+        ExpectSection(path, section);
+        for(const auto& [key, node] : section) {
+            const auto full = Join(path, key);
+            if (key != "date") {
+                Unknown(full);
+            }
+            ExpectSection(full, node);
+            for(const auto& [dkey, dnode] : node) {
+                const auto dfull = Join(full, dkey);
+                if (dkey == "format") {
+                    config_.date.format = GetString(dfull, dnode);
+                } else if (dkey == "roundup") {
+                    config_.date.roundup = GetNumber<time_t>(dfull, dnode, 1);
+                } else {
+                    Unknown(dfull);
+                }
+            }
+        }
+    }
+
+    void CompilePublish(const string& path, const pt::ptree& section) {
+        ExpectSection(path, section);
+        for(const auto& [key, node] : section) {
+            const auto full = Join(path, key);
+            if (key == "command") {
+                config_.publish_command = GetString(full, node);
+            } else {
+                Unknown(full);
+            }
+        }
+    }
+
+    void CompileRss(const string& path, const pt::ptree& section) {
+        ExpectSection(path, section);
+        for(const auto& [key, node] : section) {
+            const auto full = Join(path, key);
+            if (key == "enabled") {
+                config_.rss.enabled = GetBool(full, node);
+            } else if (key == "max-articles") {
+                config_.rss.max_articles = GetNumber<int>(full, node, 0);
+            } else if (key == "ttl") {
+                config_.rss.ttl = GetNumber<unsigned>(full, node);
+            } else {
+                Unknown(full);
+            }
+        }
+    }
+
+    void CompileSeo(const string& path, const pt::ptree& section) {
+        ExpectSection(path, section);
+        for(const auto& [key, node] : section) {
+            const auto full = Join(path, key);
+            if (key == "google-site-verification") {
+                config_.google_site_verification = GetString(full, node);
+            } else if (key == "sitemap") {
+                ExpectSection(full, node);
+                for(const auto& [skey, snode] : node) {
+                    const auto sfull = Join(full, skey);
+                    if (skey != "priority") {
+                        Unknown(sfull);
+                    }
+                    ExpectSection(sfull, snode);
+                    for(const auto& [pkey, pnode] : snode) {
+                        config_.sitemap_priority[pkey] = GetNumber<float>(Join(sfull, pkey), pnode, 0);
+                    }
+                }
+            } else {
+                Unknown(full);
+            }
+        }
+    }
+
+    // The keys in a provider are passed to its template as {{provider-key}}
+    void CompileComments(const string& path, const pt::ptree& section) {
+        ExpectSection(path, section);
+        for(const auto& [key, node] : section) {
+            const auto full = Join(path, key);
+            if (key == "default") {
+                config_.default_comments = GetString(full, node);
+                continue;
+            }
+
+            Config::CommentProvider provider;
+            for(const auto& [ckey, cnode] : node) {
+                const auto value = GetString(Join(full, ckey), cnode);
+                if (ckey == "template") {
+                    provider.tmplte = value;
+                }
+                provider.vars.emplace_back(key + "-" + ckey, value);
+            }
+            config_.comments[key] = move(provider);
+        }
+
+        if (!config_.default_comments.empty()
+            && config_.default_comments != "no"
+            && config_.comments.find(config_.default_comments) == config_.comments.end()) {
+            LOG_ERROR << "comments.default refers to '" << config_.default_comments
+                      << "', which is not defined in stbl.conf";
+            throw runtime_error("Configuration error");
+        }
+    }
+
+    void CompileChroma(const string& path, const pt::ptree& section) {
+        ExpectSection(path, section);
+        for(const auto& [key, node] : section) {
+            const auto full = Join(path, key);
+            if (key == "enabled") {
+                config_.chroma.enabled = GetString(full, node);
+                if (config_.chroma.enabled != "true"
+                    && config_.chroma.enabled != "false"
+                    && config_.chroma.enabled != "auto") {
+                    Invalid(full, config_.chroma.enabled, "true, false or auto");
+                }
+            } else if (key == "path") {
+                config_.chroma.path = GetString(full, node);
+            } else if (key == "style") {
+                config_.chroma.style = GetString(full, node);
+            } else {
+                Unknown(full);
+            }
+        }
+    }
+
+    Config& config_;
+};
+
+} // anonymous ns
+
+Config CompileConfig(const boost::property_tree::ptree& tree) {
+    Config config;
+    ConfigCompiler{config}.Compile(tree);
+    return config;
+}
+
+}
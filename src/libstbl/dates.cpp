@@ -0,0 +1,238 @@
+
+#include <cassert>
+#include <ctime>
+#include <string>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <map>
+#include <array>
+#include <stdexcept>
+
+#include "stbl/utility.h"
+
+using namespace std;
+
+namespace stbl {
+
+namespace {
+
+/* Formats and memoizes time stamps.
+ *
+ * A site has few distinct time-stamps, but each of them is
+ * formatted several times for every list it appears in. The time zone
+ * is loaded once, and localtime_r/gmtime_r are used so that the
+ * formatter can be used from several render threads.
+ */
+class DateFormatter
+{
+public:
+    enum Format : unsigned {
+        ANSI,
+        RSS,
+        FIRST_CUSTOM
+    };
+
+    static DateFormatter& Instance() {
+        static DateFormatter instance;
+        return instance;
+    }
+
+    string Get(time_t when, unsigned format, const string *custom = nullptr) {
+        const Key key{when, format};
+        {
+            shared_lock lock{mutex_};
+            if (auto it = cache_.find(key); it != cache_.end()) {
+                return it->second;
+            }
+        }
+
+        auto value = Format(when, format, custom);
+
+        unique_lock lock{mutex_};
+        if (cache_.size() >= max_entries) {
+            cache_.clear();
+        }
+        cache_.emplace(key, value);
+        return value;
+    }
+
+    unsigned GetFormatId(const string& format) {
+        {
+            shared_lock lock{mutex_};
+            if (auto it = formats_.find(format); it != formats_.end()) {
+                return it->second;
+            }
+        }
+
+        unique_lock lock{mutex_};
+        return formats_.emplace(format, FIRST_CUSTOM + formats_.size()).first->second;
+    }
+
+private:
+    static constexpr size_t max_entries = 1024 * 64;
+
+    struct Key {
+        time_t when;
+        unsigned format;
+
+        bool operator == (const Key& k) const noexcept {
+            return when == k.when && format == k.format;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& k) const noexcept {
+            return hash<time_t>{}(k.when) ^ (static_cast<size_t>(k.format) << 48);
+        }
+    };
+
+    DateFormatter() {
+        // Load the time zone once. localtime_r() is not required to do it.
+        tzset();
+    }
+
+    static string Format(time_t when, unsigned format, const string *custom) {
+        tm t = {};
+
+        if (format == RSS) {
+            if (!gmtime_r(&when, &t)) {
+                throw runtime_error("Invalid date after conversion by gmtime");
+            }
+            return FormatRss(t);
+        }
+
+        if (!localtime_r(&when, &t)) {
+            return {};
+        }
+
+        if (format == ANSI) {
+            if (t.tm_year + 1900 >= 1000 && t.tm_year + 1900 <= 9999) {
+                return FormatAnsi(t);
+            }
+            return FormatStrftime(t, "%F %R");
+        }
+
+        assert(custom);
+        return FormatStrftime(t, custom->c_str());
+    }
+
+    static char *Emit2(char *p, int value) noexcept {
+        *p++ = static_cast<char>('0' + (value / 10) % 10);
+        *p++ = static_cast<char>('0' + value % 10);
+        return p;
+    }
+
+    static char *Emit4(char *p, int value) noexcept {
+        p = Emit2(p, value / 100);
+        return Emit2(p, value % 100);
+    }
+
+    // 2017-11-30 09:54
+    static string FormatAnsi(const tm& t) {
+        array<char, 16> buffer;
+        auto *p = buffer.data();
+        p = Emit4(p, t.tm_year + 1900);
+        *p++ = '-';
+        p = Emit2(p, t.tm_mon + 1);
+        *p++ = '-';
+        p = Emit2(p, t.tm_mday);
+        *p++ = ' ';
+        p = Emit2(p, t.tm_hour);
+        *p++ = ':';
+        p = Emit2(p, t.tm_min);
+        return {buffer.data(), p};
+    }
+
+    // Sat, 07 Sep 2002 00:00:01 GMT
+    static string FormatRss(const tm& t) {
+        // RFC 822 was written before languages other than US English was invented...
+        static constexpr array<const char *, 7> days = {
+             "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+
+        static constexpr array <const char *, 12> months = {
+             "Jan", "Feb",  "Mar", "Apr", "May", "Jun", "Jul", "Aug",
+             "Sep", "Oct", "Nov", "Dec"};
+
+        string out;
+        out.reserve(32);
+        out += days.at(t.tm_wday);
+        out += ", ";
+
+        array<char, 24> buffer;
+        auto *p = Emit2(buffer.data(), t.tm_mday);
+        *p++ = ' ';
+        out.append(buffer.data(), p);
+        out += months.at(t.tm_mon);
+
+        p = buffer.data();
+        *p++ = ' ';
+        const auto year = t.tm_year + 1900;
+        if (year >= 0 && year <= 9999) {
+            p = Emit4(p, year);
+        } else {
+            const auto y = to_string(year);
+            out.append(buffer.data(), p);
+            out += y;
+            p = buffer.data();
+        }
+        *p++ = ' ';
+        p = Emit2(p, t.tm_hour);
+        *p++ = ':';
+        p = Emit2(p, t.tm_min);
+        *p++ = ':';
+        p = Emit2(p, t.tm_sec);
+        out.append(buffer.data(), p);
+        out += " GMT";
+        return out;
+    }
+
+    static string FormatStrftime(const tm& t, const char *format) {
+        if (!*format) {
+            return {};
+        }
+
+        string out(64, '\0');
+        while(true) {
+            if (const auto len = strftime(out.data(), out.size(), format, &t)) {
+                out.resize(len);
+                return out;
+            }
+            if (out.size() >= 4096) {
+                // The output is empty, or unreasonably long
+                return {};
+            }
+            out.resize(out.size() * 2);
+        }
+    }
+
+    shared_mutex mutex_;
+    unordered_map<Key, string, KeyHash> cache_;
+    map<string, unsigned> formats_;
+};
+
+} // anonymous ns
+
+string ToStringAnsi(const time_t& when) {
+    if (!when) {
+        return {};
+    }
+    return DateFormatter::Instance().Get(when, DateFormatter::ANSI);
+}
+
+string ToStringLocal(const time_t& when, const std::string& format) {
+    if (!when) {
+        return {};
+    }
+    auto& formatter = DateFormatter::Instance();
+    return formatter.Get(when, formatter.GetFormatId(format), &format);
+}
+
+string ToStringRss(const time_t& when) {
+    if (!when) {
+        return {};
+    }
+    return DateFormatter::Instance().Get(when, DateFormatter::RSS);
+}
+
+}
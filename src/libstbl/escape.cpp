@@ -0,0 +1,108 @@
+
+#include <cstdint>
+
+#if defined(__AVX2__)
+#   include <immintrin.h>
+#elif defined(__SSE2__)
+#   include <emmintrin.h>
+#endif
+
+#include "stbl/utility.h"
+
+using namespace std;
+
+namespace stbl {
+
+namespace {
+
+const char *Entity(char ch) noexcept {
+    switch(ch) {
+    case '&':
+        return "&amp;";
+    case '<':
+        return "&lt;";
+    case '>':
+        return "&gt;";
+    case '\"':
+        return "&quot;";
+    case '\'':
+        return "&apos;";
+    default:
+        return nullptr;
+    }
+}
+
+// Offset of the first character that needs escaping, or end - p
+size_t FindSpecial(const char *p, const char *end) noexcept {
+    const auto *start = p;
+
+#if defined(__AVX2__)
+    const auto amp = _mm256_set1_epi8('&');
+    const auto lt = _mm256_set1_epi8('<');
+    const auto gt = _mm256_set1_epi8('>');
+    const auto quot = _mm256_set1_epi8('\"');
+    const auto apos = _mm256_set1_epi8('\'');
+
+    while (end - p >= 32) {
+        const auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        const auto hits = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, amp), _mm256_cmpeq_epi8(v, lt)),
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, gt),
+                                            _mm256_cmpeq_epi8(v, quot)),
+                            _mm256_cmpeq_epi8(v, apos)));
+        if (const auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(hits))) {
+            return (p - start) + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+#elif defined(__SSE2__)
+    const auto amp = _mm_set1_epi8('&');
+    const auto lt = _mm_set1_epi8('<');
+    const auto gt = _mm_set1_epi8('>');
+    const auto quot = _mm_set1_epi8('\"');
+    const auto apos = _mm_set1_epi8('\'');
+
+    while (end - p >= 16) {
+        const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        const auto hits = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, lt)),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, gt),
+                                      _mm_cmpeq_epi8(v, quot)),
+                         _mm_cmpeq_epi8(v, apos)));
+        if (const auto mask = _mm_movemask_epi8(hits)) {
+            return (p - start) + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+
+    for(; p != end; ++p) {
+        if (Entity(*p)) {
+            break;
+        }
+    }
+    return p - start;
+}
+
+} // anonymous ns
+
+void EscapeForXml(std::string_view orig, std::string& out) {
+    out.reserve(out.size() + orig.size());
+
+    const auto *p = orig.data();
+    const auto *end = p + orig.size();
+
+    while (p != end) {
+        const auto len = FindSpecial(p, end);
+        out.append(p, len);
+        p += len;
+        if (p == end) {
+            break;
+        }
+
+        out.append(Entity(*p));
+        ++p;
+    }
+}
+
+}
@@ -1,9 +1,8 @@
 
 #include <map>
-#include <locale>
-#include <codecvt>
 #include <iomanip>
 #include <ctime>
+#include <string_view>
 
 
 #include "stbl/Node.h"
@@ -19,10 +18,9 @@ namespace stbl {
 ::std::ostream& operator << (::std::ostream& out, const stbl::Node& node) {
 
     const auto meta = node.GetMetadata();
-    std::string name;
+    std::string_view name;
     if (meta) {
-        std::wstring_convert<::std::codecvt_utf8_utf16<wchar_t>> converter;
-        name = converter.to_bytes(meta->title);
+        name = meta->title;
     }
 
     return out << '\"' << name << "\" (" << node.GetType() << ')';
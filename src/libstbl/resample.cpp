@@ -0,0 +1,697 @@
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+#if defined(__AVX2__)
+#   include <immintrin.h>
+#elif defined(__SSE2__)
+#   include <emmintrin.h>
+#endif
+
+#include "stbl/resample.h"
+
+using namespace std;
+
+namespace stbl {
+
+namespace {
+
+// Pixels are kept as 4 floats (RGB + padding) between the passes,
+// so that one pixel fits in one SSE register.
+constexpr int channels = 4;
+
+// Don't start a thread for less than this many rows
+constexpr int min_rows_per_band = 32;
+
+// Pre-reduce the source until it is at most this many times larger than the output
+constexpr int reduce_gap = 3;
+
+// The pre-reduction keeps the ratio below 2 * reduce_gap, so a filter
+// has at most 2 * 3 * 6 + 2 taps
+constexpr int max_taps = 64;
+
+// Resolution of the linear light -> sRGB table
+constexpr int srgb_steps = 4096;
+
+struct ColorTables {
+    float to_linear[256];
+    uint8_t to_srgb[srgb_steps + 1];
+};
+
+const ColorTables& GetColorTables() {
+    static const ColorTables tables = [] {
+        ColorTables t;
+        for(int i = 0; i < 256; ++i) {
+            const double v = i / 255.0;
+            t.to_linear[i] = static_cast<float>(v <= 0.04045
+                ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4));
+        }
+        for(int i = 0; i <= srgb_steps; ++i) {
+            const double v = static_cast<double>(i) / srgb_steps;
+            const double s = v <= 0.0031308
+                ? v * 12.92 : 1.055 * pow(v, 1.0 / 2.4) - 0.055;
+            t.to_srgb[i] = static_cast<uint8_t>(clamp(lround(s * 255.0), 0L, 255L));
+        }
+        return t;
+    }();
+
+    return tables;
+}
+
+double Sinc(double x) noexcept {
+    if (x == 0.0) {
+        return 1.0;
+    }
+    x *= M_PI;
+    return sin(x) / x;
+}
+
+/* The weights of the source pixels for each output pixel along one axis.
+ *
+ * All the outputs have the same number of taps, so the weights are
+ * in one flat array. Unused taps have weight 0.
+ */
+struct Contributions {
+    vector<int> first;
+    vector<float> weights;
+    int taps = 0;
+
+    Contributions(int srcSize, int dstSize, ResampleFilter filter) {
+        assert(filter != ResampleFilter::Bilinear);
+        const double scale = static_cast<double>(srcSize) / dstSize;
+        // When we downscale, the filter is stretched to cover all the
+        // source pixels. That is what prevents aliasing.
+        const double filter_scale = max(scale, 1.0);
+
+        double radius = 0;
+        switch(filter) {
+        case ResampleFilter::Area:
+            radius = 0.5;
+            break;
+        case ResampleFilter::Lanczos3:
+            radius = 3.0;
+            break;
+        default:
+            break;
+        }
+
+        const double support = radius * filter_scale;
+        taps = min(srcSize, static_cast<int>(ceil(support * 2)) + 2);
+        first.resize(dstSize);
+        weights.assign(static_cast<size_t>(dstSize) * taps, 0.0f);
+
+        vector<double> w(taps);
+        for(int i = 0; i < dstSize; ++i) {
+            const double center = (i + 0.5) * scale;
+            const int start = clamp(static_cast<int>(floor(center - support)), 0, srcSize - taps);
+            double sum = 0;
+
+            for(int k = 0; k < taps; ++k) {
+                const double pos = start + k + 0.5;
+                double v = 0;
+                switch(filter) {
+                case ResampleFilter::Area: {
+                    // How much of the source pixel is covered by the output pixel
+                    const double left = max(center - support, pos - 0.5);
+                    const double right = min(center + support, pos + 0.5);
+                    v = max(right - left, 0.0);
+                    } break;
+                case ResampleFilter::Lanczos3: {
+                    const double x = (pos - center) / filter_scale;
+                    v = abs(x) < 3.0 ? Sinc(x) * Sinc(x / 3.0) : 0.0;
+                    } break;
+                default:
+                    break;
+                }
+                w[k] = v;
+                sum += v;
+            }
+
+            first[i] = start;
+            auto *out = &weights[static_cast<size_t>(i) * taps];
+            if (sum == 0.0) {
+                // Can only happen when upscaling with Area
+                out[clamp(static_cast<int>(center) - start, 0, taps - 1)] = 1.0f;
+                continue;
+            }
+            for(int k = 0; k < taps; ++k) {
+                out[k] = static_cast<float>(w[k] / sum);
+            }
+        }
+    }
+};
+
+/* The two source pixels for each output pixel along one axis, for
+ * ResampleFilter::Bilinear. The filter is not stretched when we
+ * downscale, so only 2x2 source pixels are read for each output pixel.
+ */
+struct BilinearTap {
+    int first = 0;
+    // 1, or 0 if the source is only one pixel wide
+    int next = 0;
+    // The weight of the second pixel
+    float fraction = 0;
+};
+
+vector<BilinearTap> GetBilinearTaps(int srcSize, int dstSize) {
+    const double scale = static_cast<double>(srcSize) / dstSize;
+    vector<BilinearTap> taps(dstSize);
+    for(int i = 0; i < dstSize; ++i) {
+        auto& t = taps[i];
+        const double pos = (i + 0.5) * scale - 0.5;
+        t.next = srcSize > 1 ? 1 : 0;
+        t.first = clamp(static_cast<int>(floor(pos)), 0, srcSize - 1 - t.next);
+        t.fraction = static_cast<float>(clamp(pos - t.first, 0.0, 1.0)) * t.next;
+    }
+    return taps;
+}
+
+// Call fn(begin, end) for bands of [0, rows) in parallel
+template <typename FnT>
+void ForEachBand(int rows, unsigned threads, const FnT& fn) {
+    const int bands = max(1, min(static_cast<int>(threads), rows / min_rows_per_band));
+    if (bands == 1) {
+        fn(0, rows);
+        return;
+    }
+
+    vector<thread> workers;
+    workers.reserve(bands - 1);
+    const int band_rows = (rows + bands - 1) / bands;
+    for(int begin = band_rows; begin < rows; begin += band_rows) {
+        workers.emplace_back([&fn, begin, end = min(rows, begin + band_rows)] {
+            fn(begin, end);
+        });
+    }
+    fn(0, min(rows, band_rows));
+
+    for(auto& w : workers) {
+        w.join();
+    }
+}
+
+// Resample one row of linear pixels horizontally
+void ResampleRow(const float *in, float *out, const Contributions& cx, int width) noexcept {
+    const auto taps = cx.taps;
+    const float *weights = cx.weights.data();
+    int x = 0;
+
+#if defined(__AVX2__)
+    // Two output pixels at the time, one in each half of the register
+    for(; x + 2 <= width; x += 2, weights += taps * 2, out += channels * 2) {
+        const float *left = in + static_cast<size_t>(cx.first[x]) * channels;
+        const float *right = in + static_cast<size_t>(cx.first[x + 1]) * channels;
+        const float *right_weights = weights + taps;
+        auto acc = _mm256_setzero_ps();
+        for(int k = 0; k < taps; ++k, left += channels, right += channels) {
+            const auto px = _mm256_loadu2_m128(right, left);
+            const auto w = _mm256_set_m128(_mm_broadcast_ss(right_weights + k),
+                                           _mm_broadcast_ss(weights + k));
+#   if defined(__FMA__)
+            acc = _mm256_fmadd_ps(px, w, acc);
+#   else
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(px, w));
+#   endif
+        }
+        _mm256_storeu_ps(out, acc);
+    }
+#endif
+
+    for(; x < width; ++x, weights += taps, out += channels) {
+        const float *px = in + static_cast<size_t>(cx.first[x]) * channels;
+#if defined(__SSE2__)
+        auto acc = _mm_setzero_ps();
+        for(int k = 0; k < taps; ++k, px += channels) {
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(px), _mm_set1_ps(weights[k])));
+        }
+        _mm_storeu_ps(out, acc);
+#else
+        float r = 0, g = 0, b = 0;
+        for(int k = 0; k < taps; ++k, px += channels) {
+            r += px[0] * weights[k];
+            g += px[1] * weights[k];
+            b += px[2] * weights[k];
+        }
+        out[0] = r;
+        out[1] = g;
+        out[2] = b;
+        out[3] = 0;
+#endif
+    }
+}
+
+uint8_t ToSrgb(const ColorTables& tables, float v) noexcept {
+    return tables.to_srgb[static_cast<int>(clamp(v, 0.0f, 1.0f) * srgb_steps + 0.5f)];
+}
+
+// Interpolate output row y from the source rows top and bottom
+void BilinearRow(const uint8_t *top, const uint8_t *bottom, float fy,
+                 const vector<BilinearTap>& tx, const ColorTables& tables,
+                 uint8_t *out) noexcept {
+    const auto *lin = tables.to_linear;
+    for(const auto& t : tx) {
+        const auto *a = top + t.first * 3;
+        const auto *b = bottom + t.first * 3;
+        const auto step = t.next * 3;
+        for(int c = 0; c < 3; ++c, ++a, ++b) {
+            const float upper = lin[a[0]] + (lin[a[step]] - lin[a[0]]) * t.fraction;
+            const float lower = lin[b[0]] + (lin[b[step]] - lin[b[0]]) * t.fraction;
+            *out++ = ToSrgb(tables, upper + (lower - upper) * fy);
+        }
+    }
+}
+
+/* How to get from the source size to the destination size
+ *
+ * For large ratios, the source is first reduced by an integer factor
+ * by averaging blocks of pixels. The filter then only sees a few
+ * times more pixels than it outputs, which is much faster, and just
+ * as good to the eye.
+ */
+struct Plan {
+    Plan(int srcWidth, int srcHeight, int dstWidth, int dstHeight, ResampleFilter filter)
+    : src_width{srcWidth}, src_height{srcHeight}, dst_width{dstWidth}
+    , kx{max(1, srcWidth / (dstWidth * reduce_gap))}
+    , ky{max(1, srcHeight / (dstHeight * reduce_gap))}
+    , reduced_width{(srcWidth + kx - 1) / kx}
+    , reduced_height{(srcHeight + ky - 1) / ky}
+    , cx{reduced_width, dstWidth, filter}
+    , cy{reduced_height, dstHeight, filter}
+    , line_floats{static_cast<size_t>(reduced_width) * channels}
+    , row_floats{static_cast<size_t>(dstWidth) * channels}
+    , tables{GetColorTables()}
+    {
+        assert(srcWidth > 0 && srcHeight > 0 && dstWidth > 0 && dstHeight > 0);
+        assert(cy.taps <= max_taps);
+    }
+
+    // Add a source row, in linear light, to the (reduced) line. The
+    // first row of a reduced row replaces what is in the line.
+    void Accumulate(const uint8_t *in, float *line, bool first) const noexcept {
+        const auto *lin = tables.to_linear;
+        if (kx == 1) {
+            if (first) {
+                for(int x = 0; x < src_width; ++x, in += 3, line += channels) {
+                    line[0] = lin[in[0]];
+                    line[1] = lin[in[1]];
+                    line[2] = lin[in[2]];
+                }
+            } else {
+                for(int x = 0; x < src_width; ++x, in += 3, line += channels) {
+                    line[0] += lin[in[0]];
+                    line[1] += lin[in[1]];
+                    line[2] += lin[in[2]];
+                }
+            }
+            return;
+        }
+
+        if (first) {
+            fill(line, line + line_floats, 0.0f);
+        }
+        float *px = line;
+        for(int x = 0; x < src_width; px += channels) {
+            for(const int block_end = min(src_width, x + kx); x < block_end; ++x, in += 3) {
+                px[0] += lin[in[0]];
+                px[1] += lin[in[1]];
+                px[2] += lin[in[2]];
+            }
+        }
+    }
+
+    // Turn the sums of the source rows in the line into averages,
+    // and resample it horizontally into row.
+    void FinishLine(float *line, int rows, float *row) const noexcept {
+        if (kx > 1 || rows > 1) {
+            for(int bx = 0; bx < reduced_width; ++bx) {
+                const int cols = min(src_width, (bx + 1) * kx) - bx * kx;
+                const float scale = 1.0f / static_cast<float>(rows * cols);
+                float *px = &line[static_cast<size_t>(bx) * channels];
+                px[0] *= scale;
+                px[1] *= scale;
+                px[2] *= scale;
+            }
+        }
+
+        ResampleRow(line, row, cx, dst_width);
+    }
+
+    // Number of source rows in reduced row ry
+    int RowsIn(int ry) const noexcept {
+        return min(src_height, (ry + 1) * ky) - ry * ky;
+    }
+
+    // Combine the horizontally resampled rows for output row y, and
+    // convert them back to sRGB. getRow(ry) returns reduced row ry.
+    template <typename FnT>
+    void MakeOutputRow(int y, const FnT& getRow, uint8_t *out) const noexcept {
+        // The rows that count, so that the sums can stay in registers
+        const float *rows[max_taps];
+        float weights[max_taps];
+        int count = 0;
+        const auto *w = &cy.weights[static_cast<size_t>(y) * cy.taps];
+        for(int k = 0; k < cy.taps; ++k) {
+            if (w[k] != 0.0f) {
+                rows[count] = getRow(cy.first[y] + k);
+                weights[count++] = w[k];
+            }
+        }
+
+        const auto *srgb = tables.to_srgb;
+        size_t i = 0;
+#if defined(__AVX2__)
+        // Two pixels at the time
+        const auto zero = _mm256_setzero_ps();
+        const auto one = _mm256_set1_ps(1.0f);
+        const auto steps = _mm256_set1_ps(static_cast<float>(srgb_steps));
+        const auto half = _mm256_set1_ps(0.5f);
+        alignas(32) int32_t index[8];
+        for(; i + channels * 2 <= row_floats; i += channels * 2, out += 6) {
+            auto acc = _mm256_setzero_ps();
+            for(int k = 0; k < count; ++k) {
+                const auto px = _mm256_loadu_ps(rows[k] + i);
+                const auto wk = _mm256_broadcast_ss(&weights[k]);
+#   if defined(__FMA__)
+                acc = _mm256_fmadd_ps(px, wk, acc);
+#   else
+                acc = _mm256_add_ps(acc, _mm256_mul_ps(px, wk));
+#   endif
+            }
+            acc = _mm256_min_ps(_mm256_max_ps(acc, zero), one);
+            _mm256_store_si256(reinterpret_cast<__m256i *>(index),
+                               _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(acc, steps), half)));
+            out[0] = srgb[index[0]];
+            out[1] = srgb[index[1]];
+            out[2] = srgb[index[2]];
+            out[3] = srgb[index[4]];
+            out[4] = srgb[index[5]];
+            out[5] = srgb[index[6]];
+        }
+#endif
+#if defined(__SSE2__)
+        const auto zero4 = _mm_setzero_ps();
+        const auto one4 = _mm_set1_ps(1.0f);
+        const auto steps4 = _mm_set1_ps(static_cast<float>(srgb_steps));
+        const auto half4 = _mm_set1_ps(0.5f);
+        alignas(16) int32_t index4[4];
+        for(; i < row_floats; i += channels, out += 3) {
+            auto acc = _mm_setzero_ps();
+            for(int k = 0; k < count; ++k) {
+                acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(rows[k] + i),
+                                                 _mm_set1_ps(weights[k])));
+            }
+            acc = _mm_min_ps(_mm_max_ps(acc, zero4), one4);
+            _mm_store_si128(reinterpret_cast<__m128i *>(index4),
+                            _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(acc, steps4), half4)));
+            out[0] = srgb[index4[0]];
+            out[1] = srgb[index4[1]];
+            out[2] = srgb[index4[2]];
+        }
+#else
+        for(; i < row_floats; i += channels, out += 3) {
+            float r = 0, g = 0, b = 0;
+            for(int k = 0; k < count; ++k) {
+                r += rows[k][i] * weights[k];
+                g += rows[k][i + 1] * weights[k];
+                b += rows[k][i + 2] * weights[k];
+            }
+            out[0] = ToSrgb(tables, r);
+            out[1] = ToSrgb(tables, g);
+            out[2] = ToSrgb(tables, b);
+        }
+#endif
+    }
+
+    const int src_width;
+    const int src_height;
+    const int dst_width;
+    const int kx;
+    const int ky;
+    const int reduced_width;
+    const int reduced_height;
+    const Contributions cx;
+    const Contributions cy;
+    const size_t line_floats;
+    const size_t row_floats;
+    const ColorTables& tables;
+};
+
+/* Makes the output rows [begin, end) of a plan from the source rows they
+ * need, starting at GetSourceRow(). Keeps a ring of the last cy.taps
+ * horizontally resampled rows. An output row is made as soon as the
+ * last source row it needs arrives. Since the windows only move forward,
+ * no row is needed after it is overwritten.
+ */
+class RowRing
+{
+public:
+    RowRing(const Plan& plan, int begin, int end)
+    : plan_{plan}
+    , line_(plan.line_floats)
+    , ring_(plan.row_floats * plan.cy.taps)
+    , out_(static_cast<size_t>(plan.dst_width) * 3)
+    , reduced_row_{plan.cy.first[begin]}
+    , src_row_{reduced_row_ * plan.ky}
+    , dst_row_{begin}
+    , dst_end_{end}
+    {
+    }
+
+    //! The next source row to push
+    int GetSourceRow() const noexcept {
+        return src_row_;
+    }
+
+    //! True when all the output rows are made
+    bool IsDone() const noexcept {
+        return dst_row_ == dst_end_;
+    }
+
+    //! Push the next source row. sink(row, y) gets the output rows.
+    template <typename FnT>
+    void Push(const uint8_t *row, const FnT& sink) {
+        assert(src_row_ < plan_.src_height);
+        plan_.Accumulate(row, line_.data(), src_row_ % plan_.ky == 0);
+
+        if (++src_row_ < plan_.src_height && src_row_ % plan_.ky != 0) {
+            return; // Still filling the reduced row
+        }
+
+        plan_.FinishLine(line_.data(), plan_.RowsIn(reduced_row_), GetRow(reduced_row_));
+        ++reduced_row_;
+
+        const auto& cy = plan_.cy;
+        while (dst_row_ < dst_end_ && cy.first[dst_row_] + cy.taps <= reduced_row_) {
+            plan_.MakeOutputRow(dst_row_, [this](int ry) { return GetRow(ry); }, out_.data());
+            sink(out_.data(), dst_row_);
+            ++dst_row_;
+        }
+    }
+
+private:
+    float *GetRow(int ry) noexcept {
+        return &ring_[plan_.row_floats * (ry % plan_.cy.taps)];
+    }
+
+    const Plan& plan_;
+    vector<float> line_;
+    vector<float> ring_;
+    vector<uint8_t> out_;
+    int reduced_row_;
+    int src_row_;
+    int dst_row_;
+    const int dst_end_;
+};
+
+class RowResamplerImpl : public RowResampler
+{
+public:
+    RowResamplerImpl(int srcWidth, int srcHeight, int dstWidth, int dstHeight,
+                     ResampleFilter filter, sink_t sink)
+    : plan_{srcWidth, srcHeight, dstWidth, dstHeight, filter}
+    , ring_{plan_, 0, dstHeight}
+    , sink_{move(sink)}
+    {
+    }
+
+    void Push(const uint8_t *row) override {
+        ring_.Push(row, sink_);
+    }
+
+private:
+    const Plan plan_;
+    RowRing ring_;
+    const sink_t sink_;
+};
+
+// Keeps the last two source rows, which is all a bilinear output row needs
+class BilinearRowResampler : public RowResampler
+{
+public:
+    BilinearRowResampler(int srcWidth, int srcHeight, int dstWidth, int dstHeight,
+                         sink_t sink)
+    : src_height_{srcHeight}
+    , tx_{GetBilinearTaps(srcWidth, dstWidth)}
+    , ty_{GetBilinearTaps(srcHeight, dstHeight)}
+    , tables_{GetColorTables()}
+    , sink_{move(sink)}
+    , previous_(static_cast<size_t>(srcWidth) * 3)
+    , current_(previous_.size())
+    , out_(static_cast<size_t>(dstWidth) * 3)
+    {
+    }
+
+    void Push(const uint8_t *row) override {
+        assert(src_row_ < src_height_);
+        swap(previous_, current_);
+        copy(row, row + current_.size(), current_.begin());
+        const int y = src_row_++;
+
+        // An output row is made when its last source row arrives
+        while (dst_row_ < static_cast<int>(ty_.size())
+               && ty_[dst_row_].first + ty_[dst_row_].next == y) {
+            const auto& t = ty_[dst_row_];
+            BilinearRow(t.next ? previous_.data() : current_.data(), current_.data(),
+                        t.fraction, tx_, tables_, out_.data());
+            sink_(out_.data(), dst_row_);
+            ++dst_row_;
+        }
+    }
+
+private:
+    const int src_height_;
+    const vector<BilinearTap> tx_;
+    const vector<BilinearTap> ty_;
+    const ColorTables& tables_;
+    const sink_t sink_;
+    vector<uint8_t> previous_;
+    vector<uint8_t> current_;
+    vector<uint8_t> out_;
+    int src_row_ = 0;
+    int dst_row_ = 0;
+};
+
+} // anonymous ns
+
+bool ToResampleFilter(string_view name, ResampleFilter& filter) noexcept {
+    if (name == "lanczos3") {
+        filter = ResampleFilter::Lanczos3;
+    } else if (name == "area") {
+        filter = ResampleFilter::Area;
+    } else if (name == "bilinear") {
+        filter = ResampleFilter::Bilinear;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void Resample(const uint8_t *src, int srcWidth, int srcHeight, ptrdiff_t srcStride,
+              uint8_t *dst, int dstWidth, int dstHeight, ptrdiff_t dstStride,
+              ResampleFilter filter, unsigned threads) {
+
+    if (threads == 0) {
+        threads = max(1u, thread::hardware_concurrency());
+    }
+
+    if (filter == ResampleFilter::Bilinear) {
+        const auto tx = GetBilinearTaps(srcWidth, dstWidth);
+        const auto ty = GetBilinearTaps(srcHeight, dstHeight);
+        const auto& tables = GetColorTables();
+        ForEachBand(dstHeight, threads, [&](int begin, int end) {
+            for(int y = begin; y < end; ++y) {
+                const auto& t = ty[y];
+                const auto *top = src + t.first * srcStride;
+                BilinearRow(top, top + t.next * srcStride, t.fraction, tx, tables,
+                            dst + y * dstStride);
+            }
+        });
+        return;
+    }
+
+    // Each band streams the source rows it needs through its own ring, so
+    // only a few rows are kept, as in RowResampler. The bands overlap by
+    // the height of the filter.
+    const Plan plan{srcWidth, srcHeight, dstWidth, dstHeight, filter};
+    ForEachBand(dstHeight, threads, [&](int begin, int end) {
+        RowRing ring{plan, begin, end};
+        for(auto y = ring.GetSourceRow(); !ring.IsDone(); ++y) {
+            ring.Push(src + y * srcStride, [&](const uint8_t *row, int dy) {
+                copy(row, row + static_cast<size_t>(dstWidth) * 3, dst + dy * dstStride);
+            });
+        }
+    });
+}
+
+unique_ptr<RowResampler> RowResampler::Create(int srcWidth, int srcHeight,
+                                              int dstWidth, int dstHeight,
+                                              ResampleFilter filter, sink_t sink) {
+    if (filter == ResampleFilter::Bilinear) {
+        return make_unique<BilinearRowResampler>(srcWidth, srcHeight, dstWidth, dstHeight,
+                                                 move(sink));
+    }
+    return make_unique<RowResamplerImpl>(srcWidth, srcHeight, dstWidth, dstHeight,
+                                         filter, move(sink));
+}
+
+double Ssim(const uint8_t *left, ptrdiff_t leftStride,
+            const uint8_t *right, ptrdiff_t rightStride,
+            int width, int height) {
+
+    constexpr int window = 8;
+    constexpr int step = 4;
+    constexpr double c1 = (0.01 * 255) * (0.01 * 255);
+    constexpr double c2 = (0.03 * 255) * (0.03 * 255);
+
+    auto luma = [width, height](const uint8_t *src, ptrdiff_t stride) {
+        vector<float> y(static_cast<size_t>(width) * height);
+        for(int row = 0; row < height; ++row) {
+            const uint8_t *px = src + row * stride;
+            for(int x = 0; x < width; ++x, px += 3) {
+                y[static_cast<size_t>(row) * width + x] = 0.299f * px[0] + 0.587f * px[1] + 0.114f * px[2];
+            }
+        }
+        return y;
+    };
+
+    const auto a = luma(left, leftStride);
+    const auto b = luma(right, rightStride);
+
+    const int wnd_x = min(window, width);
+    const int wnd_y = min(window, height);
+    const double n = wnd_x * wnd_y;
+
+    double total = 0;
+    size_t windows = 0;
+    for(int y0 = 0; y0 + wnd_y <= height; y0 += step) {
+        for(int x0 = 0; x0 + wnd_x <= width; x0 += step) {
+            double sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+            for(int y = y0; y < y0 + wnd_y; ++y) {
+                for(int x = x0; x < x0 + wnd_x; ++x) {
+                    const double va = a[static_cast<size_t>(y) * width + x];
+                    const double vb = b[static_cast<size_t>(y) * width + x];
+                    sa += va;
+                    sb += vb;
+                    saa += va * va;
+                    sbb += vb * vb;
+                    sab += va * vb;
+                }
+            }
+
+            const double ma = sa / n, mb = sb / n;
+            const double va = saa / n - ma * ma;
+            const double vb = sbb / n - mb * mb;
+            const double cov = sab / n - ma * mb;
+            total += ((2 * ma * mb + c1) * (2 * cov + c2))
+                / ((ma * ma + mb * mb + c1) * (va + vb + c2));
+            ++windows;
+        }
+    }
+
+    return windows ? total / windows : 1.0;
+}
+
+}
@@ -0,0 +1,280 @@
+
+#include <cstdint>
+
+#if defined(__SSE2__)
+#   include <emmintrin.h>
+#endif
+
+#include "stbl/utf8.h"
+
+using namespace std;
+
+namespace stbl {
+
+namespace {
+
+constexpr char32_t replacement_char = 0xFFFD;
+
+// Returns the length of the valid sequence starting at p, or 0
+size_t ValidSequenceLength(const uint8_t *p, const uint8_t *end) noexcept {
+    const auto ch = *p;
+    const auto avail = static_cast<size_t>(end - p);
+
+    auto cont = [](uint8_t c) {
+        return (c & 0xC0) == 0x80;
+    };
+
+    if (ch < 0x80) {
+        return 1;
+    }
+
+    if (ch >= 0xC2 && ch <= 0xDF) {
+        return (avail >= 2 && cont(p[1])) ? 2 : 0;
+    }
+
+    if (ch >= 0xE0 && ch <= 0xEF) {
+        if (avail < 3) {
+            return 0;
+        }
+        const auto lo = (ch == 0xE0) ? 0xA0 : 0x80;
+        const auto hi = (ch == 0xED) ? 0x9F : 0xBF;
+        return (p[1] >= lo && p[1] <= hi && cont(p[2])) ? 3 : 0;
+    }
+
+    if (ch >= 0xF0 && ch <= 0xF4) {
+        if (avail < 4) {
+            return 0;
+        }
+        const auto lo = (ch == 0xF0) ? 0x90 : 0x80;
+        const auto hi = (ch == 0xF4) ? 0x8F : 0xBF;
+        return (p[1] >= lo && p[1] <= hi && cont(p[2]) && cont(p[3])) ? 4 : 0;
+    }
+
+    return 0;
+}
+
+// Number of leading ASCII bytes in [p, end), checked 16 bytes at the time.
+size_t AsciiPrefix(const uint8_t *p, const uint8_t *end) noexcept {
+    const auto *start = p;
+#if defined(__SSE2__)
+    while (end - p >= 16) {
+        const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        if (const auto mask = _mm_movemask_epi8(v)) {
+            return (p - start) + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    while (p != end && *p < 0x80) {
+        ++p;
+    }
+    return p - start;
+}
+
+bool InRange(char32_t cp, char32_t first, char32_t last) noexcept {
+    return cp >= first && cp <= last;
+}
+
+// Simple (1:1) lower-case mapping for the scripts we care about.
+char32_t ToLower(char32_t cp) noexcept {
+    if (cp < 0x80) {
+        return InRange(cp, 'A', 'Z') ? cp + 0x20 : cp;
+    }
+
+    // Latin-1 Supplement
+    if (InRange(cp, 0xC0, 0xDE)) {
+        return cp == 0xD7 ? cp : cp + 0x20;
+    }
+
+    // Latin Extended-A
+    if (InRange(cp, 0x100, 0x17F)) {
+        if (cp == 0x130) {
+            return 'i';
+        }
+        if (cp == 0x178) {
+            return 0xFF;
+        }
+        if (InRange(cp, 0x100, 0x137) || InRange(cp, 0x14A, 0x177)) {
+            return cp | 1;
+        }
+        if (InRange(cp, 0x139, 0x148) || InRange(cp, 0x179, 0x17E)) {
+            return (cp & 1) ? cp + 1 : cp;
+        }
+        return cp;
+    }
+
+    // Greek
+    if (InRange(cp, 0x370, 0x3FF)) {
+        if (InRange(cp, 0x391, 0x3AB)) {
+            return cp == 0x3A2 ? cp : cp + 0x20;
+        }
+        switch (cp) {
+        case 0x386: return 0x3AC;
+        case 0x388: return 0x3AD;
+        case 0x389: return 0x3AE;
+        case 0x38A: return 0x3AF;
+        case 0x38C: return 0x3CC;
+        case 0x38E: return 0x3CD;
+        case 0x38F: return 0x3CE;
+        default:
+            return cp;
+        }
+    }
+
+    // Cyrillic and Cyrillic Supplement
+    if (InRange(cp, 0x400, 0x52F)) {
+        if (InRange(cp, 0x400, 0x40F)) {
+            return cp + 0x50;
+        }
+        if (InRange(cp, 0x410, 0x42F)) {
+            return cp + 0x20;
+        }
+        if (cp == 0x4C0) {
+            return 0x4CF;
+        }
+        if (InRange(cp, 0x460, 0x481) || InRange(cp, 0x48A, 0x4BF)
+            || InRange(cp, 0x4D0, 0x52F)) {
+            return cp | 1;
+        }
+        if (InRange(cp, 0x4C1, 0x4CE)) {
+            return (cp & 1) ? cp + 1 : cp;
+        }
+        return cp;
+    }
+
+    // Armenian
+    if (InRange(cp, 0x531, 0x556)) {
+        return cp + 0x30;
+    }
+
+    // Latin Extended Additional
+    if (InRange(cp, 0x1E00, 0x1EFF)) {
+        if (cp == 0x1E9E) {
+            return 0xDF;
+        }
+        if (InRange(cp, 0x1E00, 0x1E95) || InRange(cp, 0x1EA0, 0x1EFF)) {
+            return cp | 1;
+        }
+        return cp;
+    }
+
+    // Full-width Latin
+    if (InRange(cp, 0xFF21, 0xFF3A)) {
+        return cp + 0x20;
+    }
+
+    return cp;
+}
+
+} // anonymous ns
+
+bool IsValidUtf8(std::string_view str) noexcept {
+    const auto *p = reinterpret_cast<const uint8_t *>(str.data());
+    const auto *end = p + str.size();
+
+    while (p != end) {
+        p += AsciiPrefix(p, end);
+        if (p == end) {
+            break;
+        }
+
+        const auto len = ValidSequenceLength(p, end);
+        if (!len) {
+            return false;
+        }
+        p += len;
+    }
+
+    return true;
+}
+
+char32_t DecodeUtf8(std::string_view str, size_t& pos) noexcept {
+    const auto *p = reinterpret_cast<const uint8_t *>(str.data()) + pos;
+    const auto *end = reinterpret_cast<const uint8_t *>(str.data()) + str.size();
+
+    const auto len = ValidSequenceLength(p, end);
+    switch (len) {
+    case 1:
+        ++pos;
+        return p[0];
+    case 2:
+        pos += 2;
+        return ((p[0] & 0x1F) << 6) | (p[1] & 0x3F);
+    case 3:
+        pos += 3;
+        return ((p[0] & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+    case 4:
+        pos += 4;
+        return ((p[0] & 0x07) << 18) | ((p[1] & 0x3F) << 12)
+            | ((p[2] & 0x3F) << 6) | (p[3] & 0x3F);
+    default:
+        ++pos;
+        return replacement_char;
+    }
+}
+
+void AppendUtf8(std::string& out, char32_t cp) {
+    if (cp < 0x80) {
+        out += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+        out += static_cast<char>(0xC0 | (cp >> 6));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += static_cast<char>(0xE0 | (cp >> 12));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else {
+        out += static_cast<char>(0xF0 | (cp >> 18));
+        out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+}
+
+std::string Utf8ToLower(std::string_view str) {
+    string out;
+    // None of our mappings makes the encoded text longer
+    out.reserve(str.size());
+
+    size_t pos = 0;
+    while (pos < str.size()) {
+#if defined(__SSE2__)
+        while (str.size() - pos >= 16) {
+            auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(str.data() + pos));
+            if (_mm_movemask_epi8(v)) {
+                break;
+            }
+            const auto upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                                             _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+            v = _mm_add_epi8(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+
+            char buffer[16];
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(buffer), v);
+            out.append(buffer, sizeof(buffer));
+            pos += 16;
+        }
+        if (pos == str.size()) {
+            break;
+        }
+#endif
+        const auto ch = static_cast<unsigned char>(str[pos]);
+        if (ch < 0x80) {
+            out += static_cast<char>((ch >= 'A' && ch <= 'Z') ? ch + 0x20 : ch);
+            ++pos;
+            continue;
+        }
+
+        const auto start = pos;
+        const auto cp = DecodeUtf8(str, pos);
+        if (cp == replacement_char) {
+            // Keep invalid bytes as they are
+            out.append(str.substr(start, pos - start));
+            continue;
+        }
+        AppendUtf8(out, ToLower(cp));
+    }
+
+    return out;
+}
+
+}
@@ -1,12 +1,20 @@
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <fstream>
 #include <streambuf>
 #include <iomanip>
 #include <ctime>
 #include <iostream>
-#include <codecvt>
 #include <filesystem>
 #include <string_view>
+#include <vector>
+
+#include <climits>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/info_parser.hpp>
@@ -47,26 +55,165 @@ string Load(const fs::path& path) {
     return str;
 }
 
+namespace {
+
+atomic_bool write_if_changed{false};
+
+constexpr size_t compare_chunk_size = 1024 * 64;
+
+size_t TotalSize(const vector<string_view>& segments) {
+    size_t size = 0;
+    for(const auto& s : segments) {
+        size += s.size();
+    }
+    return size;
+}
+
+// Compare the file, chunk by chunk, with the segments
+bool HaveSameContent(const fs::path& path, const vector<string_view>& segments) {
+    const auto size = TotalSize(segments);
+    std::error_code ec;
+    if (fs::file_size(path, ec) != size || ec) {
+        return false;
+    }
+
+    std::ifstream in(path, ios_base::in | ios_base::binary);
+    if (!in) {
+        return false;
+    }
+
+    vector<char> buffer(min(compare_chunk_size, max<size_t>(size, 1)));
+    for(auto data : segments) {
+        while (!data.empty()) {
+            const auto bytes = min(buffer.size(), data.size());
+            if (!in.read(buffer.data(), bytes)
+                || memcmp(buffer.data(), data.data(), bytes) != 0) {
+                return false;
+            }
+            data.remove_prefix(bytes);
+        }
+    }
+
+    return true;
+}
+
+// Write all the segments, retrying on short writes
+void WriteAll(int fd, const fs::path& path, const vector<string_view>& segments) {
+    vector<iovec> iov;
+    iov.reserve(segments.size());
+    for(const auto& s : segments) {
+        if (!s.empty()) {
+            iov.push_back({const_cast<char *>(s.data()), s.size()});
+        }
+    }
+
+    for(size_t first = 0; first < iov.size();) {
+        const auto count = static_cast<int>(min<size_t>(iov.size() - first, IOV_MAX));
+        auto written = writev(fd, &iov[first], count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            auto err = strerror(errno);
+            LOG_ERROR << "IO error. Failed to write to "
+                << path << ": " << err;
+            throw runtime_error("IO error");
+        }
+
+        // Skip what was written
+        for(; first < iov.size() && static_cast<size_t>(written) >= iov[first].iov_len; ++first) {
+            written -= iov[first].iov_len;
+        }
+        if (written > 0) {
+            iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + written;
+            iov[first].iov_len -= written;
+        }
+    }
+}
+
+// Compare two files, chunk by chunk
+bool HaveSameFiles(const fs::path& left, const fs::path& right) {
+    std::error_code ec;
+    const auto size = fs::file_size(left, ec);
+    if (ec || fs::file_size(right, ec) != size || ec) {
+        return false;
+    }
+
+    std::ifstream lin(left, ios_base::in | ios_base::binary);
+    std::ifstream rin(right, ios_base::in | ios_base::binary);
+    if (!lin || !rin) {
+        return false;
+    }
+
+    vector<char> lbuf(compare_chunk_size), rbuf(compare_chunk_size);
+    for(uintmax_t remaining = size; remaining > 0;) {
+        const auto bytes = static_cast<size_t>(min<uintmax_t>(remaining, compare_chunk_size));
+        if (!lin.read(lbuf.data(), bytes) || !rin.read(rbuf.data(), bytes)
+            || memcmp(lbuf.data(), rbuf.data(), bytes) != 0) {
+            return false;
+        }
+        remaining -= bytes;
+    }
+
+    return true;
+}
+
+void CountWritten(uint64_t bytes) {
+    auto& stats = GetWriteStats();
+    ++stats.written;
+    stats.bytes_written += bytes;
+}
+
+void CountSkipped(uint64_t bytes) {
+    auto& stats = GetWriteStats();
+    ++stats.skipped;
+    stats.bytes_skipped += bytes;
+}
+
+} // anonymous ns
+
+void SetWriteIfChanged(bool enable) {
+    write_if_changed = enable;
+}
+
+bool IsWriteIfChanged() {
+    return write_if_changed;
+}
+
+WriteStats& GetWriteStats() {
+    static WriteStats stats;
+    return stats;
+}
+
 void Save(const fs::path& path,
           const string& data,
           bool createDirectoryIsMissing,
-          bool binary) {
+          bool /*binary*/) {
 
-    LOG_TRACE << "Saving: " << path
-        << (binary ? " [bin]" : " [text]");
+    // There is no text mode translation on the platforms we support
+    Save(path, vector<string_view>{data}, createDirectoryIsMissing);
+}
 
+void Save(const fs::path& path,
+          const vector<string_view>& segments,
+          bool createDirectoryIsMissing) {
 
-    if (createDirectoryIsMissing) {
-        CreateDirectoryForFile(path);
+    const auto size = TotalSize(segments);
+
+    if (write_if_changed && HaveSameContent(path, segments)) {
+        LOG_TRACE << "Unchanged: " << path;
+        CountSkipped(size);
+        return;
     }
 
-    auto mode = ios_base::out | ios_base::trunc;
-    if (binary) {
-        mode |= ios_base::binary;
+    LOG_TRACE << "Saving: " << path << " [" << segments.size() << " segments]";
+
+    if (createDirectoryIsMissing) {
+        CreateDirectoryForFile(path);
     }
-    std::ofstream out(path.string(), mode);
 
-    if (!out) {
+    const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
         auto err = strerror(errno);
         LOG_ERROR << "IO error. Failed to open "
             << path << " for write: " << err;
@@ -74,7 +221,21 @@ void Save(const fs::path& path,
         throw runtime_error("IO error");
     }
 
-    out << data;
+    try {
+        WriteAll(fd, path, segments);
+    } catch(...) {
+        close(fd);
+        throw;
+    }
+
+    if (close(fd) != 0) {
+        auto err = strerror(errno);
+        LOG_ERROR << "IO error. Failed to close "
+            << path << ": " << err;
+        throw runtime_error("IO error");
+    }
+
+    CountWritten(size);
 }
 
 void CreateDirectoryForFile(const std::filesystem::path& path) {
@@ -104,25 +265,6 @@ LoadProperties(const fs::path& path) {
     return tree;
 }
 
-string ToString(const std::wstring& str) {
-    wstring_convert<codecvt_utf8<wchar_t>> converter;
-    return converter.to_bytes(str);
-}
-
-std::wstring ToWstring(const string& str) {
-    wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
-    return converter.from_bytes(str);
-}
-
-string ToStringAnsi(const time_t& when) {
-    if (when) {
-        if (const auto tm = std::localtime(&when)) {
-            return boost::lexical_cast<string>(put_time(tm, "%F %R"));
-        }
-    }
-    return {};
-}
-
 time_t Roundup(time_t when, const int roundup) {
     if (!when) {
         return {};
@@ -157,6 +299,7 @@ void CopyDirectory(const fs::path& src,
         LOG_TRACE << "Copying " << de.path() << " --> " << d;
         if (fs::is_regular_file(de.path())) {
             fs::copy_file(de.path(), d, fs::copy_options::overwrite_existing);
+            CountWritten(fs::file_size(d));
         } else if (is_symlink(de.path())) {
             fs::copy_symlink(de.path(), d);
         } else if (is_directory(de.path())) {
@@ -168,37 +311,63 @@ void CopyDirectory(const fs::path& src,
     }
 }
 
-void EatHeader(std::istream& in) {
+void SyncDirectory(const fs::path& src,
+                   const fs::path& dst) {
 
-    int separators = 0;
+    if (!is_directory(src)) {
+        LOG_ERROR << "The dirrectory "
+            << src << " need to exist in order to copy it!";
+        throw runtime_error("I/O error - Missing required directory.");
+    }
 
-    if (!in) {
-        throw runtime_error("Parse error: Empty file?");
+    if (fs::exists(fs::symlink_status(dst)) && !is_directory(fs::symlink_status(dst))) {
+        fs::remove(dst);
     }
 
-    if (in.peek() == 0xef) {
-        in.get();
-        if ((!in || in.get() != 0xbb) || (!in || in.get() != 0xbf)) {
-            throw runtime_error("Parse error: Invalid file format (failed to parse BOM)");
-        }
+    if (!is_directory(dst)) {
+        create_directories(dst);
     }
 
-    while(in) {
-        if ((in && in.get() == '-')
-            && (in && (in.get() == '-'))
-            && (in && (in.get() == '-'))) {
-            ++separators;
+    // Remove what is no longer in src
+    std::vector<fs::path> obsolete;
+    for (const auto& de : fs::directory_iterator{dst}) {
+        if (!fs::exists(fs::symlink_status(src / de.path().filename()))) {
+            obsolete.push_back(de.path());
         }
+    }
+    for(const auto& path : obsolete) {
+        LOG_TRACE << "Removing " << path;
+        fs::remove_all(path);
+    }
 
-        while(in && (in.get() != '\n'))
-            ;
+    for (const auto& de : fs::directory_iterator{src})
+    {
+        const auto d = dst / de.path().filename();
+        const auto dst_status = fs::symlink_status(d);
 
-        if (separators == 2) {
-            return;
+        if (is_symlink(de.symlink_status())) {
+            if (fs::exists(dst_status)) {
+                fs::remove_all(d);
+            }
+            fs::copy_symlink(de.path(), d);
+        } else if (fs::is_regular_file(de.path())) {
+            if (is_directory(dst_status) || is_symlink(dst_status)) {
+                fs::remove_all(d);
+            } else if (fs::is_regular_file(dst_status) && HaveSameFiles(de.path(), d)) {
+                LOG_TRACE << "Unchanged: " << d;
+                CountSkipped(fs::file_size(d));
+                continue;
+            }
+            LOG_TRACE << "Copying " << de.path() << " --> " << d;
+            fs::copy_file(de.path(), d, fs::copy_options::overwrite_existing);
+            CountWritten(fs::file_size(d));
+        } else if (is_directory(de.path())) {
+            SyncDirectory(de.path(), d);
+        }  else {
+            LOG_WARN << "Skipping " << de.path()
+                << " from directory copy. I don't know what it is...";
         }
     }
-
-    throw runtime_error("Parse error: Failed to locate header section.");
 }
 
 string CreateUuid() {
@@ -213,6 +382,37 @@ std::filesystem::path MkTmpPath()
     return path;
 }
 
+string Base64Encode(string_view data) {
+    static constexpr char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    string out;
+    out.reserve((data.size() + 2) / 3 * 4);
+    size_t i = 0;
+    for(; i + 2 < data.size(); i += 3) {
+        const uint32_t v = (static_cast<uint8_t>(data[i]) << 16)
+            | (static_cast<uint8_t>(data[i + 1]) << 8)
+            | static_cast<uint8_t>(data[i + 2]);
+        out += alphabet[(v >> 18) & 0x3f];
+        out += alphabet[(v >> 12) & 0x3f];
+        out += alphabet[(v >> 6) & 0x3f];
+        out += alphabet[v & 0x3f];
+    }
+
+    if (const auto left = data.size() - i) {
+        uint32_t v = static_cast<uint8_t>(data[i]) << 16;
+        if (left == 2) {
+            v |= static_cast<uint8_t>(data[i + 1]) << 8;
+        }
+        out += alphabet[(v >> 18) & 0x3f];
+        out += alphabet[(v >> 12) & 0x3f];
+        out += left == 2 ? alphabet[(v >> 6) & 0x3f] : '=';
+        out += '=';
+    }
+
+    return out;
+}
+
 string Pipe(const string& cmd,
             const std::vector<string>& args,
             const string& input)
@@ -0,0 +1,313 @@
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include "stbl/utility.h"
+
+using namespace std;
+
+namespace stbl {
+
+namespace {
+
+enum ByteClass : uint8_t {
+    SEPARATOR,
+    LETTER,
+    NEWLINE,
+    BACKTICK,
+    CLOSE_BRACKET,
+    LESS_THAN,
+    APOSTROPHE,
+    UTF8_LEAD,
+    UTF8_CONT
+};
+
+constexpr array<uint8_t, 256> MakeClasses() {
+    array<uint8_t, 256> cls{};
+    for(int ch = 0; ch < 256; ++ch) {
+        if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z')
+            || (ch >= '0' && ch <= '9')) {
+            cls[ch] = LETTER;
+        } else if (ch >= 0x80 && ch < 0xC0) {
+            cls[ch] = UTF8_CONT;
+        } else if (ch >= 0xC2 && ch <= 0xF4) {
+            cls[ch] = UTF8_LEAD;
+        } else {
+            cls[ch] = SEPARATOR;
+        }
+    }
+    cls['\n'] = NEWLINE;
+    cls['`'] = BACKTICK;
+    cls[']'] = CLOSE_BRACKET;
+    cls['<'] = LESS_THAN;
+    cls['\''] = APOSTROPHE;
+    return cls;
+}
+
+constexpr auto classes = MakeClasses();
+
+inline uint8_t Class(const char *p) noexcept {
+    return classes[static_cast<uint8_t>(*p)];
+}
+
+const char *NextLine(const char *p, const char *end) noexcept {
+    if (auto nl = static_cast<const char *>(memchr(p, '\n', end - p))) {
+        return nl + 1;
+    }
+    return end;
+}
+
+size_t RunLength(const char *p, const char *end, char ch) noexcept {
+    const auto *start = p;
+    while (p != end && *p == ch) {
+        ++p;
+    }
+    return p - start;
+}
+
+// If p starts a fence line (``` or ~~~), return the fence length
+size_t FenceLength(const char *p, const char *end) noexcept {
+    for(int indent = 0; indent < 3 && p != end && *p == ' '; ++indent) {
+        ++p;
+    }
+    if (p == end || (*p != '`' && *p != '~')) {
+        return 0;
+    }
+    const auto len = RunLength(p, end, *p);
+    return len >= 3 ? len : 0;
+}
+
+char FenceChar(const char *p, const char *end) noexcept {
+    while (p != end && *p == ' ') {
+        ++p;
+    }
+    return p == end ? 0 : *p;
+}
+
+// p points to the line after the opening fence. Returns the position
+// after the closing fence, or end if the block is unterminated.
+const char *SkipFencedBlock(const char *p, const char *end, char fence, size_t len) noexcept {
+    while (p != end) {
+        const auto *line = p;
+        p = NextLine(p, end);
+        if (FenceChar(line, p) == fence && FenceLength(line, p) >= len) {
+            return p;
+        }
+    }
+    return end;
+}
+
+// Inline code: skip to the closing run of the same number of backticks
+const char *SkipCodeSpan(const char *p, const char *end) noexcept {
+    const auto len = RunLength(p, end, '`');
+    auto *q = p + len;
+    while (q != end) {
+        q = static_cast<const char *>(memchr(q, '`', end - q));
+        if (!q) {
+            break;
+        }
+        const auto closing = RunLength(q, end, '`');
+        if (closing == len) {
+            return q + closing;
+        }
+        q += closing;
+    }
+    // Unmatched. The backticks are just text.
+    return p + len;
+}
+
+// p points to ']'. Skip the target of an inline link, "](...)",
+// or the rest of a reference definition, "]: url".
+const char *SkipLinkTarget(const char *p, const char *end) noexcept {
+    ++p;
+    if (p != end && *p == ':') {
+        auto nl = static_cast<const char *>(memchr(p, '\n', end - p));
+        return nl ? nl : end;
+    }
+    if (p == end || *p != '(') {
+        return p;
+    }
+
+    int depth = 0;
+    for(auto *q = p; q != end; ++q) {
+        if (*q == '(') {
+            ++depth;
+        } else if (*q == ')' && --depth == 0) {
+            return q + 1;
+        } else if (*q == '\n') {
+            break;
+        }
+    }
+    return p;
+}
+
+// Skip html tags, comments and autolinks like <https://example.com>.
+// A tag must start with a name, followed by whitespace, '/', '>' or ':'
+// (autolinks), and end on the same line. Else the '<' is just text,
+// like in "if i<n".
+const char *SkipTag(const char *p, const char *end) noexcept {
+    static constexpr string_view comment_start{"<!--"};
+    static constexpr string_view comment_end{"-->"};
+
+    const string_view rest{p, static_cast<size_t>(end - p)};
+    if (rest.substr(0, comment_start.size()) == comment_start) {
+        if (const auto close = rest.find(comment_end, comment_start.size());
+            close != string_view::npos) {
+            return p + close + comment_end.size();
+        }
+        return p + 1;
+    }
+
+    auto *q = p + 1;
+    if (q != end && (*q == '/' || *q == '!' || *q == '?')) {
+        ++q;
+    }
+    if (q == end || Class(q) != LETTER) {
+        return p + 1;
+    }
+    while (q != end && (Class(q) == LETTER || *q == '-')) {
+        ++q;
+    }
+    if (q == end || !(*q == ' ' || *q == '\t' || *q == '\n' || *q == '\r'
+                      || *q == '/' || *q == '>' || *q == ':')) {
+        return p + 1;
+    }
+
+    auto nl = static_cast<const char *>(memchr(q, '\n', end - q));
+    const auto *line_end = nl ? nl : end;
+    if (auto gt = static_cast<const char *>(memchr(q, '>', line_end - q))) {
+        return gt + 1;
+    }
+    return p + 1;
+}
+
+bool IsBareUrl(const char *p, const char *end) noexcept {
+    const auto avail = static_cast<size_t>(end - p);
+    return (avail >= 7 && memcmp(p, "http://", 7) == 0)
+        || (avail >= 8 && memcmp(p, "https://", 8) == 0);
+}
+
+const char *SkipToWhitespace(const char *p, const char *end) noexcept {
+    while (p != end && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') {
+        ++p;
+    }
+    return p;
+}
+
+// Non-ASCII characters are letters, except for the ones in the
+// Latin-1 punctuation block (U+0080 - U+00BF, like nbsp, « and »),
+// General Punctuation (U+2000 - U+206F, like dashes and quotes) and
+// the ideographic space.
+bool IsUtf8Letter(const char *p, const char *end) noexcept {
+    const auto lead = static_cast<uint8_t>(p[0]);
+    if (end - p < 2) {
+        return false;
+    }
+    const auto second = static_cast<uint8_t>(p[1]);
+    if (lead == 0xC2) {
+        return false;
+    }
+    if (lead == 0xE2 && (second == 0x80 || second == 0x81)) {
+        return false;
+    }
+    if (lead == 0xE3 && second == 0x80 && end - p >= 3
+        && static_cast<uint8_t>(p[2]) == 0x80) {
+        return false;
+    }
+    return true;
+}
+
+size_t Utf8Length(const char *p) noexcept {
+    const auto lead = static_cast<uint8_t>(*p);
+    if (lead >= 0xF0) {
+        return 4;
+    }
+    if (lead >= 0xE0) {
+        return 3;
+    }
+    return 2;
+}
+
+} // anonymous ns
+
+size_t CountWords(std::string_view markdown) {
+    const auto *p = markdown.data();
+    const auto *end = p + markdown.size();
+    size_t words = 0;
+    bool in_word = false;
+    bool line_start = true;
+
+    while (p < end) {
+        if (line_start) {
+            line_start = false;
+            if (const auto len = FenceLength(p, end)) {
+                const auto fence = FenceChar(p, end);
+                p = SkipFencedBlock(NextLine(p, end), end, fence, len);
+                in_word = false;
+                line_start = true;
+                continue;
+            }
+        }
+
+        switch(Class(p)) {
+        case LETTER:
+            if (!in_word) {
+                if (*p == 'h' && IsBareUrl(p, end)) {
+                    p = SkipToWhitespace(p, end);
+                    continue;
+                }
+                ++words;
+                in_word = true;
+            }
+            ++p;
+            while (p != end && Class(p) == LETTER) {
+                ++p;
+            }
+            break;
+        case UTF8_LEAD:
+            if (IsUtf8Letter(p, end)) {
+                if (!in_word) {
+                    ++words;
+                    in_word = true;
+                }
+            } else {
+                in_word = false;
+            }
+            p += min<size_t>(Utf8Length(p), end - p);
+            break;
+        case APOSTROPHE:
+            // Keep contractions like "don't" as one word
+            if (!(in_word && (p + 1) != end && Class(p + 1) == LETTER)) {
+                in_word = false;
+            }
+            ++p;
+            break;
+        case NEWLINE:
+            in_word = false;
+            line_start = true;
+            ++p;
+            break;
+        case BACKTICK:
+            p = SkipCodeSpan(p, end);
+            in_word = false;
+            break;
+        case CLOSE_BRACKET:
+            p = SkipLinkTarget(p, end);
+            in_word = false;
+            break;
+        case LESS_THAN:
+            p = SkipTag(p, end);
+            in_word = false;
+            break;
+        default:
+            in_word = false;
+            ++p;
+        }
+    }
+
+    return words;
+}
+
+}
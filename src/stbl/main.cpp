@@ -70,6 +70,7 @@ bool parse_command_line(int argc, char * argv[], Options &options)
         ("automatic-update,u", po::value(&options.automatic_update)->default_value(options.automatic_update),
             "Automatically set the updated attribute if the file-time is newer than the publish-time")
         ("preview", "Do not update the source article headers. Generate all articles.")
+        ("write-if-changed", "Only write files in the destination directory that have changed.")
         ("version,v", "Show version and exit.")
         ("init", "Initialize a new blog directory structure at the destination.")
         ("init-all", "Initialize a new blog directory structure at the destination, including templates and embedded files.")
@@ -158,6 +159,10 @@ bool parse_command_line(int argc, char * argv[], Options &options)
         options.publish = true;
     }
 
+    if (vm.count("write-if-changed")) {
+        options.write_if_changed = true;
+    }
+
     if (vm.count("publish-to")) {
         options.publish_destination = vm["publish-to"].as<string>();
         options.publish = true;
@@ -197,6 +202,7 @@ bool parse_command_line(int argc, char * argv[], Options &options)
     std::filesystem::path opts = options.source_path;
     opts /= "stbl.conf";
     options.options = LoadProperties(opts);
+    options.config = CompileConfig(options.options);
 
     return true;
 }
@@ -227,7 +233,7 @@ int main(int argc, char * argv[])
 
     if (!options.open_in_browser.empty()) {
         std::filesystem::path dst_path = options.publish
-            ? options.options.get<string>("url")
+            ? options.config.url
             : options.destination_path;
         dst_path /= "index.html";
         //system(cmd.c_str());
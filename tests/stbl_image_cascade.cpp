@@ -0,0 +1,161 @@
+
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <jpeglib.h>
+
+#include <boost/log/trivial.hpp>
+
+#include "stbl/Image.h"
+#include "stbl/resample.h"
+#include "stbl/utility.h"
+#include "stbl_tests.h"
+
+using namespace std;
+using namespace stbl;
+namespace fs = std::filesystem;
+
+namespace {
+
+// Below this, a cascaded variant is visibly different from one scaled
+// directly from the source
+constexpr double min_cascade_ssim = 0.98;
+
+struct Pixels {
+    int width = 0;
+    int height = 0;
+    vector<uint8_t> rgb;
+};
+
+// Gradients, rings and a fine diagonal pattern, so that softening or
+// aliasing in the cascade shows up in the SSIM.
+Pixels Generate(int width, int height) {
+    Pixels img{width, height, vector<uint8_t>(static_cast<size_t>(width) * height * 3)};
+    auto *p = img.rgb.data();
+    for(int y = 0; y < height; ++y) {
+        for(int x = 0; x < width; ++x, p += 3) {
+            const double dx = x - width / 2.0;
+            const double dy = y - height / 2.0;
+            const double rings = 0.5 + 0.5 * sin(sqrt(dx * dx + dy * dy) / 12.0);
+            const double fine = 0.5 + 0.5 * sin((x + y) / 3.0);
+            p[0] = static_cast<uint8_t>(255.0 * x / width);
+            p[1] = static_cast<uint8_t>(255.0 * rings);
+            p[2] = static_cast<uint8_t>(127.0 * fine + 128.0 * y / height);
+        }
+    }
+    return img;
+}
+
+void WriteJpeg(const fs::path& path, const Pixels& img) {
+    unique_ptr<FILE, decltype(&fclose)> file{fopen(path.c_str(), "wb"), &fclose};
+    jpeg_compress_struct cinfo;
+    jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, file.get());
+    cinfo.image_width = img.width;
+    cinfo.image_height = img.height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 95, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        auto row = const_cast<JSAMPROW>(&img.rgb[cinfo.next_scanline * img.width * 3]);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+}
+
+Pixels ReadJpeg(const fs::path& path) {
+    unique_ptr<FILE, decltype(&fclose)> file{fopen(path.c_str(), "rb"), &fclose};
+    jpeg_decompress_struct cinfo;
+    jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, file.get());
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+
+    Pixels img;
+    img.width = static_cast<int>(cinfo.output_width);
+    img.height = static_cast<int>(cinfo.output_height);
+    img.rgb.resize(static_cast<size_t>(img.width) * img.height * 3);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = &img.rgb[cinfo.output_scanline * img.width * 3];
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return img;
+}
+
+Image::Variant MakeVariant(const Image::Size& source, int width, const fs::path& path) {
+    Image::Variant v;
+    v.size = Image::ScaledSize(source, width);
+    v.outputs.push_back({ImageFormat::Jpeg, path, 95, {}});
+    return v;
+}
+
+} // anonymous ns
+
+const lest::test specification[] = {
+
+STARTCASE(CascadedVariantsMatchDirectScaling) {
+    const auto dir = MkTmpPath();
+    fs::create_directories(dir);
+
+    const Image::Size source{3000, 2000};
+    const auto original = dir / "original.jpg";
+    WriteJpeg(original, Generate(source.width, source.height));
+
+    // Each variant is at least twice as wide as the next, so all but the
+    // first are fed from the one before it.
+    const int widths[] = {1600, 800, 400, 200};
+
+    for(const auto filter : {ResampleFilter::Lanczos3, ResampleFilter::Area,
+                             ResampleFilter::Bilinear}) {
+        vector<Image::Variant> cascade;
+        for(const auto w : widths) {
+            cascade.push_back(MakeVariant(source, w, dir / ("cascade_" + to_string(w) + ".jpg")));
+        }
+        Image::MakeVariants(original, cascade, filter);
+
+        for(const auto w : widths) {
+            const auto direct_path = dir / ("direct_" + to_string(w) + ".jpg");
+            vector<Image::Variant> direct_variant{MakeVariant(source, w, direct_path)};
+            Image::MakeVariants(original, direct_variant, filter);
+
+            const auto cascaded = ReadJpeg(dir / ("cascade_" + to_string(w) + ".jpg"));
+            const auto direct = ReadJpeg(direct_path);
+            CHECK_EQUAL(cascaded.width, direct.width);
+            CHECK_EQUAL(cascaded.height, direct.height);
+
+            const auto stride = static_cast<ptrdiff_t>(direct.width) * 3;
+            const auto ssim = Ssim(cascaded.rgb.data(), stride, direct.rgb.data(), stride,
+                                   direct.width, direct.height);
+            LOG_INFO << "Filter " << static_cast<int>(filter) << ", width " << w
+                     << ": SSIM " << ssim;
+            EXPECT(ssim >= min_cascade_ssim);
+        }
+    }
+
+    fs::remove_all(dir);
+} ENDCASE
+}; //lest
+
+int main( int argc, char * argv[] )
+{
+    namespace logging = boost::log;
+    logging::core::get()->set_filter
+    (
+        logging::trivial::severity >= logging::trivial::info
+    );
+    return lest::run( specification, argc, argv );
+}